@@ -0,0 +1,92 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "common_constants.h"
+
+#include <utility>
+
+//Axis-aligned bounding box. Three intervals, one per axis. If a ray misses the box it misses everything inside it,
+//which is the entire reason the BVH is fast.
+class aabb {
+public:
+    interval x, y, z;
+
+    aabb() {} // The default AABB is empty, since intervals are empty by default.
+
+    aabb(const interval& ix, const interval& iy, const interval& iz)
+        : x(ix), y(iy), z(iz) {}
+
+    aabb(const point3& a, const point3& b) {
+        // Treat the two points a and b as extrema for the bounding box, so we don't require a
+        // particular minimum/maximum coordinate order.
+        x = interval(fmin(a[0],b[0]), fmax(a[0],b[0]));
+        y = interval(fmin(a[1],b[1]), fmax(a[1],b[1]));
+        z = interval(fmin(a[2],b[2]), fmax(a[2],b[2]));
+    }
+
+    //The box that holds both boxes.
+    aabb(const aabb& box0, const aabb& box1) {
+        x = interval(box0.x, box1.x);
+        y = interval(box0.y, box1.y);
+        z = interval(box0.z, box1.z);
+    }
+
+    const interval& axis(int n) const {
+        if (n == 1) return y;
+        if (n == 2) return z;
+        return x;
+    }
+
+    bool empty() const {
+        return x.min > x.max || y.min > y.max || z.min > z.max;
+    }
+
+    point3 centroid() const {
+        return point3(0.5*(x.min + x.max), 0.5*(y.min + y.max), 0.5*(z.min + z.max));
+    }
+
+    //The surface area heuristic (SAH) uses this. The chance a random ray hits a box is proportional to its area.
+    double surface_area() const {
+        if (empty()) return 0;
+        auto dx = x.size();
+        auto dy = y.size();
+        auto dz = z.size();
+        return 2 * (dx*dy + dy*dz + dz*dx);
+    }
+
+    int longest_axis() const {
+        if (x.size() > y.size())
+            return x.size() > z.size() ? 0 : 2;
+        return y.size() > z.size() ? 1 : 2;
+    }
+
+    //The slab test. Where does the ray enter and leave the box on each axis? If the latest entry comes before the
+    //earliest exit the ray passed through the box.
+    bool hit(const ray& r, interval ray_t) const {
+        vec3 dir = r.direction();
+        vec3 inv_dir(1/dir.x(), 1/dir.y(), 1/dir.z());
+        return hit(r.origin(), inv_dir, ray_t);
+    }
+
+    //Same test with the reciprocal direction already worked out. The BVH visits many boxes per ray so it does the
+    //three divisions once up front.
+    bool hit(const point3& orig, const vec3& inv_dir, interval ray_t) const {
+        for (int a = 0; a < 3; a++) {
+            const interval& ax = axis(a);
+            auto t0 = (ax.min - orig[a]) * inv_dir[a];
+            auto t1 = (ax.max - orig[a]) * inv_dir[a];
+
+            if (inv_dir[a] < 0)
+                std::swap(t0, t1);
+
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "common_constants.h"
+
+#include "camera.h"
+#include "image_writer.h"
+#include "scene_file.h"
+#include "scene_objects.h"
+#include "sphere_set.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+
+//Animations: a scene with `frames` set (see scene_file.h) renders as a numbered run of images instead of one.
+//
+//From one frame to the next hardly anything changes: the camera moves along its keys and a few spheres along
+//theirs. So the world is built once and only nudged for each frame. Moving spheres are moved in place in the
+//sphere_set and its BVH refit (new boxes, same tree) instead of built again, and the camera keeps its thread pool
+//and film from frame to frame. Writing a frame out happens on another thread while the next one renders.
+
+//Works out where everything is at a given time from a scene's keys.
+class animator {
+public:
+    explicit animator(const scene_description& scene)
+        : camera_keys(scene.camera_keys), sphere_keys(scene.sphere_keys)
+    {
+        std::stable_sort(camera_keys.begin(), camera_keys.end(),
+                         [](const camera_key& a, const camera_key& b) { return a.time < b.time; });
+        // Grouped by sphere and in time order within each group, so a sphere's keys are one run.
+        std::stable_sort(sphere_keys.begin(), sphere_keys.end(), [](const sphere_key& a, const sphere_key& b) {
+            return a.sphere != b.sphere ? a.sphere < b.sphere : a.time < b.time;
+        });
+    }
+
+    //Put the camera where it is at `time`. Position and look at point go through every key on a Catmull-Rom curve
+    //(no sudden turns as it passes a key), fov and focus distance go straight from key to key. Before the first key
+    //and after the last it sits on that key. No keys and the camera is left alone.
+    void pose_camera(double time, camera& cam) const {
+        if (camera_keys.empty())
+            return;
+
+        auto after = std::upper_bound(camera_keys.begin(), camera_keys.end(), time,
+                                      [](double t, const camera_key& key) { return t < key.time; });
+        if (after == camera_keys.begin() || after == camera_keys.end()) {
+            const camera_key& key = after == camera_keys.begin() ? camera_keys.front() : camera_keys.back();
+            cam.position   = key.position;
+            cam.lookat     = key.lookat;
+            cam.vfov       = key.vfov;
+            cam.focus_dist = key.focus_dist;
+            return;
+        }
+
+        size_t k = static_cast<size_t>(after - camera_keys.begin()) - 1; // Between key k and k + 1.
+        const camera_key& a = camera_keys[k];
+        const camera_key& b = camera_keys[k + 1];
+        double u = (time - a.time) / (b.time - a.time);
+
+        cam.position   = curve(&camera_key::position, k, u);
+        cam.lookat     = curve(&camera_key::lookat, k, u);
+        cam.vfov       = a.vfov + u * (b.vfov - a.vfov);
+        cam.focus_dist = a.focus_dist + u * (b.focus_dist - a.focus_dist);
+    }
+
+    bool moves_spheres() const { return !sphere_keys.empty(); }
+
+    //Move every sphere that has keys to where it is at `time` (straight lines between its keys) and refit the BVH.
+    void pose_spheres(double time, sphere_set& spheres) const {
+        if (sphere_keys.empty())
+            return;
+        for (size_t first = 0; first < sphere_keys.size();) {
+            size_t end = first + 1;
+            while (end < sphere_keys.size() && sphere_keys[end].sphere == sphere_keys[first].sphere)
+                end++;
+            spheres.move(sphere_keys[first].sphere, sphere_at(first, end, time));
+            first = end;
+        }
+        spheres.refit();
+    }
+
+private:
+    std::vector<camera_key> camera_keys;
+    std::vector<sphere_key> sphere_keys;
+
+    //Cubic Hermite between keys k and k + 1 with Catmull-Rom tangents: at each key the curve heads the way the line
+    //from the key before to the key after does. The end keys have nothing on one side and use their one neighbour.
+    //Tangents are per second and scaled by the segment's length, so uneven gaps between keys don't make kinks.
+    point3 curve(point3 camera_key::*field, size_t k, double u) const {
+        double span = camera_keys[k + 1].time - camera_keys[k].time;
+        vec3 m0 = tangent(field, k) * span;
+        vec3 m1 = tangent(field, k + 1) * span;
+        const point3& p0 = camera_keys[k].*field;
+        const point3& p1 = camera_keys[k + 1].*field;
+
+        double u2 = u * u, u3 = u2 * u;
+        return (2*u3 - 3*u2 + 1) * p0 + (u3 - 2*u2 + u) * m0 + (-2*u3 + 3*u2) * p1 + (u3 - u2) * m1;
+    }
+
+    vec3 tangent(point3 camera_key::*field, size_t k) const {
+        size_t before = k > 0 ? k - 1 : k;
+        size_t after = k + 1 < camera_keys.size() ? k + 1 : k;
+        double dt = camera_keys[after].time - camera_keys[before].time;
+        if (dt <= 0)
+            return vec3(0, 0, 0);
+        return (camera_keys[after].*field - camera_keys[before].*field) / dt;
+    }
+
+    //Where the sphere whose keys are sphere_keys[first, end) is at `time`.
+    point3 sphere_at(size_t first, size_t end, double time) const {
+        if (time <= sphere_keys[first].time)
+            return sphere_keys[first].center;
+        for (size_t k = first + 1; k < end; k++) {
+            const sphere_key& b = sphere_keys[k];
+            if (time < b.time) {
+                const sphere_key& a = sphere_keys[k - 1];
+                double u = (time - a.time) / (b.time - a.time);
+                return a.center + u * (b.center - a.center);
+            }
+        }
+        return sphere_keys[end - 1].center;
+    }
+};
+
+//Frame 7 of "image.ppm" is "image_0007.ppm". "-" (stdout) stays "-": the frames just follow each other.
+inline std::string frame_path(const std::string& output_file, int frame) {
+    if (output_file.empty() || output_file == "-")
+        return output_file;
+    char number[16];
+    std::snprintf(number, sizeof(number), "_%04d", frame);
+    return path_with_suffix(output_file, number);
+}
+
+//Render every frame of `scene` into frame_path(cam.output_file, frame). `world` must have been made from `scene` by
+//build_scene (which also pointed the camera), and ends up posed at the last frame. False if a frame couldn't be
+//written.
+inline bool render_animation(const scene_description& scene, scene_objects& world, camera& cam) {
+    animator motion(scene);
+    std::string output_file = cam.output_file;
+    cam.output_file = ""; // render2 leaves the frame in the film and we save it from there.
+
+    //At most one frame is being written at a time: frame N is written out while frame N + 1 renders, and frame
+    //N + 2 waits for it. So the files come out in order and the copies never pile up however long it runs.
+    std::future<bool> saving;
+    std::string saving_path;
+    bool ok = true;
+    auto finish_saving = [&] {
+        if (saving.valid() && !saving.get()) {
+            std::cerr << "\nCould not write " << saving_path << '\n';
+            ok = false;
+        }
+    };
+
+    for (int frame = 0; frame < scene.frames; frame++) {
+        double time = frame / scene.fps;
+        motion.pose_camera(time, cam);
+        motion.pose_spheres(time, world.spheres);
+
+        std::clog << "\rFrame " << (frame + 1) << " of " << scene.frames << '\n';
+        cam.render2(world);
+
+        finish_saving();
+        saving_path = frame_path(output_file, frame);
+        if (!saving_path.empty()) {
+            saving = std::async(std::launch::async, [image = cam.image(), path = saving_path] {
+                return save_image(image, path);
+            });
+        }
+    }
+    finish_saving();
+
+    cam.output_file = output_file;
+    return ok;
+}
+
+#endif //ANIMATION_H
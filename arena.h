@@ -0,0 +1,86 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+//Pool storage for scene objects. Making a million materials with make_unique meant a million trips to malloc, a
+//million scattered little blocks (each with malloc's own bookkeeping in front of it) and a million frees at the end.
+//An object_pool<T> puts the objects side by side in a few big chunks instead: making one is bumping a counter, the
+//ones made one after another sit one after another in memory, and throwing them all away is a handful of frees.
+//
+//Objects never move once made (chunks are never reallocated), so handing out plain pointers to them is fine. They
+//can't be freed one at a time, only all together, which is exactly how a scene's objects live and die anyway.
+
+template <typename T>
+class object_pool {
+public:
+    object_pool() = default;
+    object_pool(const object_pool&) = delete;
+    object_pool& operator=(const object_pool&) = delete;
+
+    ~object_pool() { clear(); }
+
+    template <typename... Args>
+    T* make(Args&&... args) {
+        if (chunks.empty() || chunks.back().used == chunks.back().capacity)
+            add_chunk(next_chunk_size());
+        chunk& c = chunks.back();
+        T* object = new (c.data + c.used) T(std::forward<Args>(args)...);
+        c.used++;
+        count++;
+        return object;
+    }
+
+    //Make sure the next n objects go in one chunk (one allocation) rather than several growing ones.
+    void reserve(size_t n) {
+        if (chunks.empty() || chunks.back().capacity - chunks.back().used < n)
+            add_chunk(n);
+    }
+
+    size_t size() const { return count; }
+
+    void clear() {
+        for (auto& c : chunks) {
+            if (!std::is_trivially_destructible<T>::value) {
+                for (size_t k = 0; k < c.used; k++)
+                    c.data[k].~T();
+            }
+            ::operator delete(static_cast<void*>(c.data), std::align_val_t(alignof(T)));
+        }
+        chunks.clear();
+        count = 0;
+    }
+
+private:
+    //Chunks start small (most scenes have a few dozen of anything) and double up to a cap, so big scenes only
+    //need a few dozen of them.
+    static constexpr size_t first_chunk = 64;
+    static constexpr size_t max_chunk = 65536;
+
+    struct chunk {
+        T* data;
+        size_t used;
+        size_t capacity;
+    };
+
+    std::vector<chunk> chunks;
+    size_t count = 0;
+
+    size_t next_chunk_size() const {
+        if (chunks.empty())
+            return first_chunk;
+        size_t last = chunks.back().capacity;
+        return last >= max_chunk ? max_chunk : last * 2;
+    }
+
+    void add_chunk(size_t capacity) {
+        void* memory = ::operator new(capacity * sizeof(T), std::align_val_t(alignof(T)));
+        chunks.push_back(chunk{static_cast<T*>(memory), 0, capacity});
+    }
+};
+
+#endif //ARENA_H
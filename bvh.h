@@ -0,0 +1,337 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "common_constants.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <vector>
+
+//Bounding Volume Hierarchy.
+//hittable_list::hit asks every object in the scene whether the ray hit it. With ~480 spheres that's ~480 sphere tests
+//per bounce. The BVH groups objects into nested boxes so a ray that misses a box skips everything inside it, which
+//turns the cost per ray from linear into (roughly) logarithmic in the number of objects.
+//
+//The tree is built with the surface area heuristic (SAH): cheap-to-hit-by-accident (small) boxes full of objects
+//are good, big boxes with few objects are bad. Instead of trying every possible split we drop object centroids into
+//a fixed number of bins per axis and only try splitting between bins ("binned SAH").
+//
+//Once built, the tree is flattened into one array in depth-first order. The left child of a node is always the very
+//next node in the array, so only the right child's index needs storing and traversal walks mostly forward in memory.
+
+struct bvh_flat_node {
+    aabb box;
+    int  offset; // Leaf: first primitive in the leaf. Interior: index of the second (right) child.
+    int  count;  // Number of primitives in the leaf. 0 means this is an interior node.
+    int  axis;   // Split axis. Traversal visits the child nearer the ray first.
+};
+
+class bvh_tree {
+public:
+    std::vector<bvh_flat_node> nodes;
+    std::vector<int> prim_indices; // Primitive indices in leaf order. Leaves point into this.
+
+    //Build the tree over a set of primitive bounding boxes. Anything that has boxes can reuse this (the bvh_node
+    //below for generic hittables, but also anything that wants to store its primitives its own way).
+    void build(const std::vector<aabb>& boxes, int max_leaf_size = 4) {
+        nodes.clear();
+        prim_indices.clear();
+        if (boxes.empty())
+            return;
+
+        std::vector<prim_ref> refs(boxes.size());
+        for (size_t i = 0; i < boxes.size(); i++)
+            refs[i] = prim_ref{boxes[i], boxes[i].centroid(), static_cast<int>(i)};
+
+        leaf_size = max_leaf_size < 1 ? 1 : max_leaf_size;
+        auto root = build_recursive(refs, 0, refs.size(), 0);
+
+        prim_indices.reserve(refs.size());
+        for (const auto& ref : refs)
+            prim_indices.push_back(ref.index);
+
+        nodes.reserve(root->node_count);
+        flatten(*root);
+    }
+
+    //Walk the tree front to back. leaf_hit(first, count, ray_t) tests the primitives prim_indices[first..first+count)
+    //and returns true on a hit, shrinking ray_t.max to the new closest hit so farther boxes get culled.
+    template <typename LeafFn>
+    bool traverse(const ray& r, interval ray_t, LeafFn&& leaf_hit) const {
+        if (nodes.empty())
+            return false;
+
+        point3 orig = r.origin();
+        vec3 dir = r.direction();
+        vec3 inv_dir(1/dir.x(), 1/dir.y(), 1/dir.z());
+        bool dir_is_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+        int stack[max_stack];
+        int stack_size = 0;
+        int current = 0;
+        bool hit_anything = false;
+
+        while (true) {
+            const bvh_flat_node& node = nodes[current];
+            RT_STAT(++thread_stats().box_tests);
+            if (node.box.hit(orig, inv_dir, ray_t)) {
+                if (node.count > 0) {
+                    if (leaf_hit(node.offset, node.count, ray_t))
+                        hit_anything = true;
+                    if (stack_size == 0) break;
+                    current = stack[--stack_size];
+                } else if (dir_is_neg[node.axis]) {
+                    // Ray travels toward the low end of the axis, so the right child is nearer.
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            } else {
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            }
+        }
+        return hit_anything;
+    }
+
+    aabb bounding_box() const {
+        return nodes.empty() ? aabb() : nodes[0].box;
+    }
+
+    //The primitives moved but the tree shape stays: recompute every box bottom up. leaf_box(first, count) gives the
+    //box around prim_indices[first..first+count) (or whatever the owner keeps in leaf order) as they are now.
+    //Children always come after their parent in `nodes`, so one backwards pass sees every child before its parent.
+    //Far cheaper than build(), but the tree gets worse the further things move from where it was built.
+    template <typename LeafBoxFn>
+    void refit(LeafBoxFn&& leaf_box) {
+        for (size_t k = nodes.size(); k-- > 0;) {
+            bvh_flat_node& node = nodes[k];
+            if (node.count > 0)
+                node.box = leaf_box(node.offset, node.count);
+            else
+                node.box = aabb(nodes[k + 1].box, nodes[node.offset].box);
+        }
+    }
+
+private:
+    static constexpr int num_bins = 12;
+    static constexpr int max_stack = 128;
+    //Past this depth we stop trusting SAH and split at the median, which guarantees the rest of the tree stays
+    //shallow enough for the fixed traversal stack.
+    static constexpr int max_sah_depth = 64;
+    //Subtrees with at least this many primitives get built on their own thread.
+    static constexpr size_t parallel_threshold = 16384;
+
+    struct prim_ref {
+        aabb   box;
+        point3 centroid;
+        int    index;
+    };
+
+    struct build_node {
+        aabb box;
+        size_t first = 0, count = 0;
+        int axis = 0;
+        int node_count = 1;
+        std::unique_ptr<build_node> left, right;
+    };
+
+    int leaf_size = 4;
+
+    std::unique_ptr<build_node> build_recursive(std::vector<prim_ref>& refs, size_t begin, size_t end, int depth) {
+        auto node = std::make_unique<build_node>();
+
+        aabb bounds, centroid_bounds;
+        for (size_t i = begin; i < end; i++) {
+            bounds = aabb(bounds, refs[i].box);
+            centroid_bounds = aabb(centroid_bounds, aabb(refs[i].centroid, refs[i].centroid));
+        }
+        node->box = bounds;
+
+        size_t count = end - begin;
+        auto make_leaf = [&]() {
+            node->first = begin;
+            node->count = count;
+            return std::move(node);
+        };
+
+        if (count <= 1)
+            return make_leaf();
+
+        int axis = centroid_bounds.longest_axis();
+        size_t mid = begin + count/2;
+
+        if (centroid_bounds.axis(axis).size() <= 0) {
+            // Every centroid is in the same spot. No split will separate them so just cut the list in half.
+            if (count <= static_cast<size_t>(leaf_size))
+                return make_leaf();
+        } else if (depth >= max_sah_depth) {
+            std::nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end,
+                             [axis](const prim_ref& a, const prim_ref& b) {
+                                 return a.centroid[axis] < b.centroid[axis];
+                             });
+        } else {
+            // Binned SAH. Try every bin boundary on every axis and keep the cheapest.
+            double best_cost = infinity;
+            int best_axis = -1;
+            int best_split = 0;
+
+            for (int a = 0; a < 3; a++) {
+                const interval& extent = centroid_bounds.axis(a);
+                if (extent.size() <= 0)
+                    continue;
+
+                aabb bin_box[num_bins];
+                int bin_count[num_bins] = {0};
+                auto scale = num_bins / extent.size();
+
+                for (size_t i = begin; i < end; i++) {
+                    int b = bin_of(refs[i].centroid[a], extent.min, scale);
+                    bin_count[b]++;
+                    bin_box[b] = aabb(bin_box[b], refs[i].box);
+                }
+
+                // Sweep from the right to get the area/count of everything right of each boundary.
+                double right_area[num_bins];
+                int right_count[num_bins];
+                aabb acc;
+                int acc_count = 0;
+                for (int b = num_bins - 1; b > 0; b--) {
+                    acc = aabb(acc, bin_box[b]);
+                    acc_count += bin_count[b];
+                    right_area[b] = acc.surface_area();
+                    right_count[b] = acc_count;
+                }
+
+                // Then sweep from the left and price each split.
+                acc = aabb();
+                acc_count = 0;
+                for (int b = 1; b < num_bins; b++) {
+                    acc = aabb(acc, bin_box[b-1]);
+                    acc_count += bin_count[b-1];
+                    if (acc_count == 0 || right_count[b] == 0)
+                        continue;
+                    auto cost = acc_count * acc.surface_area() + right_count[b] * right_area[b];
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = a;
+                        best_split = b;
+                    }
+                }
+            }
+
+            // Traversing a node costs about as much as one intersection test (the 1 below). If testing every
+            // primitive directly is cheaper than the best split, stop here.
+            auto area = bounds.surface_area();
+            auto leaf_cost = static_cast<double>(count);
+            auto split_cost = area > 0 ? 1 + best_cost / area : infinity;
+
+            if (count <= static_cast<size_t>(leaf_size) && leaf_cost <= split_cost)
+                return make_leaf();
+
+            if (best_axis >= 0) {
+                axis = best_axis;
+                const interval& extent = centroid_bounds.axis(axis);
+                auto scale = num_bins / extent.size();
+                auto split_it = std::partition(refs.begin() + begin, refs.begin() + end,
+                                               [&](const prim_ref& ref) {
+                                                   return bin_of(ref.centroid[axis], extent.min, scale) < best_split;
+                                               });
+                mid = split_it - refs.begin();
+            }
+
+            if (mid == begin || mid == end) {
+                mid = begin + count/2;
+                std::nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end,
+                                 [axis](const prim_ref& a, const prim_ref& b) {
+                                     return a.centroid[axis] < b.centroid[axis];
+                                 });
+            }
+        }
+
+        node->axis = axis;
+
+        // The two halves of refs don't overlap so big halves can be built at the same time.
+        if (count >= parallel_threshold) {
+            auto left_future = std::async(std::launch::async, &bvh_tree::build_recursive, this,
+                                          std::ref(refs), begin, mid, depth + 1);
+            node->right = build_recursive(refs, mid, end, depth + 1);
+            node->left = left_future.get();
+        } else {
+            node->left = build_recursive(refs, begin, mid, depth + 1);
+            node->right = build_recursive(refs, mid, end, depth + 1);
+        }
+
+        node->node_count = 1 + node->left->node_count + node->right->node_count;
+        return node;
+    }
+
+    static int bin_of(double centroid, double min, double scale) {
+        int b = static_cast<int>((centroid - min) * scale);
+        return b < 0 ? 0 : (b >= num_bins ? num_bins - 1 : b);
+    }
+
+    //Depth first. Left child lands right after its parent, the right child's index gets patched in afterwards.
+    int flatten(const build_node& node) {
+        int index = static_cast<int>(nodes.size());
+        nodes.push_back(bvh_flat_node{node.box, 0, 0, node.axis});
+
+        if (!node.left) {
+            nodes[index].offset = static_cast<int>(node.first);
+            nodes[index].count = static_cast<int>(node.count);
+        } else {
+            flatten(*node.left);
+            nodes[index].offset = flatten(*node.right);
+        }
+        return index;
+    }
+};
+
+//The BVH as a hittable. Hand it a hittable_list and it takes the objects over in leaf order, so a leaf's objects are
+//next to each other in the objects array too.
+class bvh_node : public hittable {
+public:
+    bvh_node(const hittable_list& list) : bvh_node(list.objects) {}
+
+    bvh_node(const std::vector<shared_ptr<hittable>>& src_objects) {
+        std::vector<aabb> boxes;
+        boxes.reserve(src_objects.size());
+        for (const auto& object : src_objects)
+            boxes.push_back(object->bounding_box());
+
+        tree.build(boxes);
+
+        objects.reserve(src_objects.size());
+        for (int index : tree.prim_indices)
+            objects.push_back(src_objects[index]);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        return tree.traverse(r, ray_t, [&](int first, int count, interval& t) {
+            bool hit_leaf = false;
+            for (int i = first; i < first + count; i++) {
+                if (objects[i]->hit(r, t, rec)) {
+                    hit_leaf = true;
+                    t.max = rec.t;
+                }
+            }
+            return hit_leaf;
+        });
+    }
+
+    aabb bounding_box() const override { return tree.bounding_box(); }
+
+private:
+    bvh_tree tree;
+    std::vector<shared_ptr<hittable>> objects; // Reordered to match the leaves.
+};
+
+#endif
@@ -3,20 +3,29 @@
 
 #include "common_constants.h"
 
+#include "checkpoint.h"
 #include "color.h"
+#include "denoise.h"
+#include "environment.h"
+#include "framebuffer.h"
 #include "hittable.h"
+#include "image_writer.h"
+#include "lights.h"
 #include "material.h"
-#include "parallel.h"
+#include "sampler.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "wavefront.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
-#include <thread>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
-#include <future>
-
-#define PARALLEL_FOR_BEGIN(nb_elements) parallel_for(nb_elements, [&](int start, int end){ for(int i = start; i < end; ++i)
-#define PARALLEL_FOR_END()})
-
-int progress;
 
 class camera {
 public:
@@ -34,9 +43,9 @@ public:
     double aspect_ratio      = 1.0; //Default. Should be overwritten.
     int    image_width       = 100; //Default. Should be overwritten. 
     int    samples_per_pixel = 10;  //Count of random samples for each pixel
-    int    max_depth         = 10;  //Maximum number of ray bounces in the scene. Why? Because ray_color is recursive. It stops recursing when it fails to 
-                                    //hit anything. That's long enough to blow the stack if it happens too long. So we return no light contribution
-                                    //At maximum depth.
+    int    max_depth         = 10;  //Maximum number of ray bounces in the scene. A path that is still bouncing at max_depth
+                                    //contributes no light.
+    int    rr_min_depth      = 3;   //Bounces before Russian roulette is allowed to end a path early (see ray_color).
     
     double vfov = 90;  // Vertical view angle (field of view)
     point3 position = point3(0,0,-1);  // Point camera is looking from
@@ -46,60 +55,115 @@ public:
     double defocus_angle = 0;  // Variation angle of rays through each pixel
     double focus_dist = 10;    // Distance from camera position point to distance where focus is perfect.
     
+    int    threads           = 0;   //Worker threads used by render2. 0 means one per hardware thread.
+    int    tile_size         = 32;  //render2 hands out square tiles of this many pixels a side.
+    bool   wavefront         = false; //Trace each tile a bounce at a time over queues of rays (see trace_wavefront)
+                                      //instead of a path at a time. Same image, different order of work.
+    int    wavefront_size    = 2048; //Most paths a tile puts in flight at once. More than fit go in chunks and rounds.
+                                     //Small enough that a round stays in the L2 cache.
+    bool   stream_output     = false; //render2 writes each band (row of tiles) out as soon as it and every band above
+                                      //it are done, and only keeps stream_window bands in memory. For images too big
+                                      //to hold whole. PPM only (anything else renders normally). Same image.
+    int    stream_window     = 4;   //Bands render2 may be working on at once when streaming. Threads that get that far
+                                    //ahead of the last band written wait for it.
+    unsigned long long seed  = 0;   //Seed for the per sample random numbers. Same seed and settings, same image.
+    uint64_t scene_hash      = 0;   //Which scene this is, so render_progressive can tell its own checkpoints from
+                                    //other scenes' (and render_distributed its workers). build_scene sets it.
+    sampler_kind sampling    = sampler_kind::independent; //Where those numbers come from (see sampler.h). The others
+                                                          //spread each pixel's samples out evenly and converge faster.
+    const light_list* lights = nullptr; //The scene's lights. build_scene points this at the world's light_list.
+    bool   light_sampling    = true;  //Aim a shadow ray at a light at every diffuse bounce (see sample_lights) as well
+                                      //as waiting to bounce into one. Converges far faster with small lights.
+    double sky               = 1;     //How bright the sky is. 0 leaves a scene lit by its own lights alone.
+    const environment_map* environment = nullptr; //An HDR image to use as the sky instead (sky doesn't scale it, it
+                                                  //has an intensity of its own). Shadow rays get aimed at it too.
+    std::string output_file  = "image.ppm"; //Where the finished image goes. ".pfm" writes float HDR, "-" is stdout,
+                                            //"" keeps it in memory only (see frame()).
+    
+    int    samples_per_pass  = 4;   //render_progressive adds this many samples to every pixel per pass.
+    std::string checkpoint_file = ""; //render_progressive saves its progress here. Empty means no checkpoints.
+    double checkpoint_interval = 60; //Seconds between checkpoints.
+    
+    double adaptive_threshold = 0;  //Adaptive sampling. A pixel stops taking samples once its noise (after gamma) is
+                                    //below this, e.g. 0.005 is about 1 level out of 255. 0 turns it off and every
+                                    //pixel gets samples_per_pixel. Noisy pixels still stop at samples_per_pixel.
+    int    adaptive_min_samples = 16; //Samples every pixel takes before it's allowed to stop. Too few and a pixel can
+                                      //look converged just because none of its rays found the bright stuff yet.
+    std::string sample_count_file = ""; //If set, a heat map of how many samples each pixel took gets written here.
+    std::string stats_file = "";    //Where the render's counters go as JSON. Only in a RT_ENABLE_STATS build.
+    
+    bool   denoise           = false; //Smooth what noise is left out of the finished image (see denoise.h). Made for
+                                      //low sample counts, where it's worth up to about twice the samples. Not with
+                                      //stream_output, which never has the whole image to work on.
+    int    feature_samples   = 4;     //Camera rays per pixel for the denoiser's albedo, normal and depth buffers.
+    std::string feature_file = "";    //If set, e.g. "features.pfm", those buffers are also written out, as
+                                      //features_albedo.pfm, features_normal.pfm and features_depth.pfm.
+    denoise_settings denoise_options; //How hard the denoiser smooths and what it treats as an edge.
+    
     //But if they aren't overwritten then the program won't explode.
     
-    //render2 uses renderLine.
-    std::string renderLine(int image_width, int samples_per_pixel, const hittable& world, int j) {
-        std::string coloredLine;
-        
-        for (int i = 0; i < image_width; ++i) {
-            color pixel_color(0,0,0); //Base pixel color of 'no values'.
-            for (int sample = 0; sample < samples_per_pixel; ++sample) { //multi-sample for anti-aliasing.
-                //Default sample size "samples_per_pixel" is set in int main() of main.cpp but there is a default value 
-                // "10" stored here in camera.h in case that is forgotten.
-                ray r = get_ray(i, j);
-                pixel_color += ray_color(r, max_depth, world);
-            }
-            coloredLine.append(async_write_color(pixel_color, samples_per_pixel));
+    //render2 splits the image into tiles and renders them on a persistent thread pool. Idle workers steal tiles from
+    //busy ones, so it keeps every core busy without making one thread per scanline.
+    void render2(const hittable& world) {
+        if (stream_output && can_stream_image(output_file) && sample_count_file.empty()) {
+            render_streamed(world);
+            return;
         }
-        //Keeping tabs on progress. The number is a mess and I should probably discard this, but I tried to run this without
-        // a progress tracker and staring at a blank command prompt wondering if the program is even responding is
-        // even worse than having a nonsense number.
-        std::clog << "\rScanlines remaining: " << --progress << ' ' << std::flush; //This function is run asynchronously so this messes up.
-        return coloredLine;
+        initialize();
+        render_tiles(world, 0, samples_per_pixel);
+        post_process(world);
+        save_film();
+        std::clog << "\rDone. Used render2                 \n"; 
     }
     
-    void render2(const hittable& world) {
+    //Like render2 but in passes of samples_per_pass samples per pixel. Every pass refines the whole image, and every
+    //checkpoint_interval seconds the samples so far are saved to checkpoint_file (and the image so far to
+    //output_file, so you can peek at it). Kill it whenever the image looks good enough. Run it again with the same
+    //settings and it picks up from the checkpoint instead of starting over.
+    //Since every sample is seeded by its index, and each pixel's sums are carried over from pass to pass at full
+    //precision (running_sums) rather than rounded into the float film every pass, the finished image is the same as
+    //one uninterrupted render2. Resumed or not.
+    void render_progressive(const hittable& world) {
         initialize();
+        running_sums.resize(film.pixel_count());
         
-        std::vector<std::future<std::string>> futures;
-        progress = image_height; //Progress indicator for async to display progress to the user. 
-        // Render
-        //PPM image header - This header is ID. It tells programs what kind of file it is (ppm in our case).
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+        int samples_done = 0;
+        if (!checkpoint_file.empty())
+            samples_done = resume_checkpoint();
         
-        for (int j = 0; j < image_height; ++j) {
-            //Progress marker
-            //std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-            futures.push_back(std::async(std::launch::async, &camera::renderLine, this, image_width, samples_per_pixel, std::cref(world), j));
-            //Do it line by line and make sure each line returns in the correct order.
+        // Run again after it finished: nothing left to render, but the image still gets made.
+        if (samples_done > 0 && samples_done >= samples_per_pixel) {
+            post_process(world);
+            save_film();
         }
-        for (auto& jobList : futures) {
-            std::string result = jobList.get();
-            //std::clog << "Job List\n";
-            std::cout << result;
+        
+        auto last_checkpoint = std::chrono::steady_clock::now();
+        int pass_size = samples_per_pass > 0 ? samples_per_pass : 1;
+        
+        while (samples_done < samples_per_pixel) {
+            int pass_end = std::min(samples_done + pass_size, samples_per_pixel);
+            std::clog << "\rSamples " << samples_done << '-' << pass_end << " of " << samples_per_pixel << ". ";
+            render_tiles(world, samples_done, pass_end);
+            samples_done = pass_end;
+            
+            auto now = std::chrono::steady_clock::now();
+            bool finished = samples_done >= samples_per_pixel;
+            if (finished || std::chrono::duration<double>(now - last_checkpoint).count() >= checkpoint_interval) {
+                write_checkpoint(samples_done);
+                post_process(world);
+                save_film();
+                last_checkpoint = now;
+            }
         }
-        std::clog << "\rDone. Used render2                 \n"; 
+        running_sums = pixel_sums();
+        std::clog << "\rDone. Used render_progressive                 \n";
     }
     
-    //This function does not use renderLine. Because renderLine is mea
+    //The single threaded renderer. Kept around because it's the easiest one to debug.
     void render(const hittable& world) {
         initialize();
         
         // Render
-        //PPM image header - This header is ID. Tells programs what kind of file it is (ppm in our case).
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-        
         for (int j = 0; j < image_height; ++j) {
             //Progress marker
             std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
@@ -119,18 +183,47 @@ public:
     
                 std::cout << ir << ' ' << ig << ' ' << ib << '\n';
                 */
-                color pixel_color(0,0,0); //Base pixel color of 'no values'.
-                for (int sample = 0; sample < samples_per_pixel; ++sample) {
-                    //Default sample size is set in int main() for now. But there is a default value for samples_per_pixel
-                    ray r = get_ray(i, j);
-                    pixel_color += ray_color(r, max_depth, world);
-                }
-                write_color(std::cout, pixel_color, samples_per_pixel);
+                //Default sample size is set in int main() for now. But there is a default value for samples_per_pixel
+                render_pixel(i, j, 0, samples_per_pixel, world);
             }
         }
+        post_process(world);
+        save_film();
         std::clog << "\rDone. Used render1                 \n";
     }
 
+    //One image rendered in pieces, possibly by other processes (see distributed.h). begin_frame() sets up and clears
+    //the film, render_region() takes every sample of the pixels in [x0,x1) x [y0,y1) on the thread pool, add_region()
+    //adds a piece rendered somewhere else and finish_frame() denoises (if asked) and saves the image. Every sample is
+    //seeded by its pixel and index, so however the pieces are split up and whoever renders them, together they are
+    //the render2 image.
+    void begin_frame() { initialize(); }
+
+    void render_region(int x0, int y0, int x1, int y1, const hittable& world) {
+        render_tiles(world, x0, y0, x1, y1, 0, samples_per_pixel, false);
+    }
+
+    void add_region(int x0, int y0, const framebuffer& piece) { film.add(x0, y0, piece); }
+
+    void finish_frame(const hittable& world) {
+        post_process(world);
+        save_film();
+    }
+
+    //The accumulated linear color of the last render. Sums plus sample counts, see framebuffer.h.
+    const framebuffer& frame() const { return film; }
+
+    //The image as it gets saved: frame(), or with denoise on, the denoised version of it.
+    const framebuffer& image() const { return denoise ? denoised : film; }
+
+    //The last render's feature buffers. Only made when denoise is on or feature_file is set.
+    const feature_buffers& features() const { return film_features; }
+
+#ifdef RT_ENABLE_STATS
+    //Counters for the last render, every thread's added together. See stats.h.
+    const render_stats& stats() const { return frame_stats; }
+#endif
+
 private:
     int    image_height;   // Rendered image height
     point3 center;         // Camera center
@@ -140,8 +233,18 @@ private:
     vec3   u, v, w;        // Camera frame basis vectors
     vec3   defocus_disk_u;  // Defocus disk horizontal radius
     vec3   defocus_disk_v;  // Defocus disk vertical radius
+    std::shared_ptr<thread_pool> pool; // Made on the first render2 and reused after that.
+    framebuffer film;      // Where the samples are summed up.
+    pixel_sums running_sums; // The film's sums at full precision, while render_progressive runs. Empty otherwise.
+    framebuffer denoised;  // film after denoising, when denoise is on.
+    feature_buffers film_features; // First hit albedo, normal and depth, for the denoiser.
+    bool   features_ready = false; // film_features are for this render (they don't change between passes).
+#ifdef RT_ENABLE_STATS
+    render_stats frame_stats;
+#endif
     
-    void initialize() {
+    //streamed: the film only gets room for the bands render_streamed keeps, not the whole image.
+    void initialize(bool streamed = false) {
         
         // Calculate the image height, and ensure that it's at least 1.
         image_height = static_cast<int>(image_width / aspect_ratio); //Image height is not a real value and it is the smaller of the two values
@@ -151,6 +254,13 @@ private:
         
         center = position;
         
+        if (streamed)
+            film.resize_wrapped(image_width, std::min(image_height, std::max(stream_window, 1) * tile_size));
+        else
+            film.resize(image_width, image_height);
+        features_ready = false;
+        RT_STAT(reset_stats());
+        
         // Camera
 
         //Now that we're going into 3D, the image can be bigger than the camera view so we need a camera.
@@ -184,7 +294,577 @@ private:
         defocus_disk_v = v * defocus_radius;
     }
 
-    ray get_ray(int i, int j) const {
+    //Only make a new pool if there isn't one or someone changed the thread count since the last render.
+    void start_pool() {
+        if (!pool || (threads > 0 && pool->size() != static_cast<unsigned>(threads)))
+            pool = std::make_shared<thread_pool>(threads > 0 ? threads : 0);
+    }
+
+    //Render sample indices [sample_begin, sample_end) of every pixel on the thread pool and add them to the film.
+    void render_tiles(const hittable& world, int sample_begin, int sample_end) {
+        render_tiles(world, 0, 0, image_width, image_height, sample_begin, sample_end, true);
+    }
+
+    //The same for only the pixels in [x0,x1) x [y0,y1), tiled from x0,y0.
+    void render_tiles(const hittable& world, int x0, int y0, int x1, int y1, int sample_begin, int sample_end,
+                      bool show_progress) {
+        start_pool();
+        
+        int tiles_x = (x1 - x0 + tile_size - 1) / tile_size;
+        int tiles_y = (y1 - y0 + tile_size - 1) / tile_size;
+        int tile_count = tiles_x * tiles_y;
+        
+        std::atomic<int> tiles_remaining(tile_count);
+        std::mutex log_lock;
+        auto start = std::chrono::steady_clock::now();
+        
+        pool->parallel_for(tile_count, [&](int tile) {
+            int tx0 = x0 + (tile % tiles_x) * tile_size;
+            int ty0 = y0 + (tile / tiles_x) * tile_size;
+            render_tile(tx0, ty0, std::min(tx0 + tile_size, x1), std::min(ty0 + tile_size, y1),
+                        sample_begin, sample_end, world);
+            
+            //Keeping tabs on progress. Staring at a blank command prompt wondering if the program is even responding
+            //is worse than anything.
+            int left = --tiles_remaining;
+            if (!show_progress)
+                return;
+            std::lock_guard<std::mutex> guard(log_lock);
+            std::clog << "\rTiles remaining: " << left << time_left(tile_count - left, tile_count, start) << ' '
+                      << std::flush;
+        });
+    }
+
+    //render2 with stream_output. Same tiles, but handed out strictly in order (left to right, top to bottom) from a
+    //shared counter instead of the pool's per thread blocks, so the band being waited on is always the one furthest
+    //along. When the last tile of a band finishes, that band and any finished ones after it are written and cleared
+    //for reuse. A thread whose next tile is stream_window bands past the last one written waits until it's written:
+    //that's what keeps the film at stream_window bands. Ordered handout is also what makes the waiting safe: every
+    //tile above a waiting one is already being rendered by a thread that isn't waiting.
+    void render_streamed(const hittable& world) {
+        initialize(true);
+        start_pool();
+
+        ppm_stream out;
+        if (!out.open(output_file, image_width, image_height)) {
+            std::cerr << "Could not write " << output_file << '\n';
+            return;
+        }
+
+        int tiles_x = (image_width + tile_size - 1) / tile_size;
+        int bands = (image_height + tile_size - 1) / tile_size;
+        int tile_count = tiles_x * bands;
+        int window = film.height / tile_size + (film.height % tile_size != 0);
+
+        std::vector<std::atomic<int>> tiles_left(static_cast<size_t>(bands));
+        for (auto& left : tiles_left)
+            left.store(tiles_x);
+        std::atomic<int> next_tile(0);
+        std::atomic<int> tiles_done(0);
+        auto start = std::chrono::steady_clock::now();
+
+        std::mutex write_lock;                 // Guards everything below it.
+        std::condition_variable band_written;
+        std::vector<char> band_done(static_cast<size_t>(bands), 0);
+        int bands_written = 0;
+
+        pool->parallel_for(static_cast<int>(pool->size()), [&](int) {
+            for (;;) {
+                int tile = next_tile++;
+                if (tile >= tile_count)
+                    return;
+                int band = tile / tiles_x;
+                if (band >= window) {
+                    std::unique_lock<std::mutex> lock(write_lock);
+                    band_written.wait(lock, [&] { return bands_written > band - window; });
+                }
+
+                int tx0 = (tile % tiles_x) * tile_size;
+                int ty0 = band * tile_size;
+                render_tile(tx0, ty0, std::min(tx0 + tile_size, image_width), std::min(ty0 + tile_size, image_height),
+                            0, samples_per_pixel, world);
+                int done = ++tiles_done;
+                if (--tiles_left[static_cast<size_t>(band)] > 0)
+                    continue;
+
+                {
+                    std::lock_guard<std::mutex> guard(write_lock);
+                    band_done[static_cast<size_t>(band)] = 1;
+                    while (bands_written < bands && band_done[static_cast<size_t>(bands_written)]) {
+                        int first = bands_written * tile_size;
+                        int rows = std::min(tile_size, image_height - first);
+                        out.write_rows(film, first, rows);
+                        film.clear_rows(first, rows);
+                        bands_written++;
+                    }
+                    std::clog << "\rRows written: " << std::min(bands_written * tile_size, image_height) << " of "
+                              << image_height << time_left(done, tile_count, start) << ' ' << std::flush;
+                }
+                band_written.notify_all();
+            }
+        });
+
+        if (!out.close())
+            std::cerr << "\nCould not write " << output_file << '\n';
+        save_stats();
+        std::clog << "\rDone. Used render2, streamed                 \n";
+    }
+
+    //Render one tile of pixels [x0,x1) x [y0,y1), one path at a time or as a wavefront.
+    void render_tile(int x0, int y0, int x1, int y1, int sample_begin, int sample_end, const hittable& world) {
+        RT_STAT(auto tile_start = std::chrono::steady_clock::now());
+        if (wavefront) {
+            render_tile_wavefront(x0, y0, x1, y1, sample_begin, sample_end, world);
+        } else {
+            for (int j = y0; j < y1; ++j)
+                for (int i = x0; i < x1; ++i)
+                    render_pixel(i, j, sample_begin, sample_end, world);
+        }
+        RT_STAT(
+            auto& stats = thread_stats();
+            auto ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - tile_start).count());
+            stats.tiles++;
+            stats.tile_ns += ns;
+            stats.tile_ns_max = std::max(stats.tile_ns_max, ns);
+        );
+    }
+
+    //", about 12s left" going by how long the first `done` of `total` took. Nothing until there's something to go on.
+    static std::string time_left(int done, int total, std::chrono::steady_clock::time_point start) {
+        if (done <= 0 || done >= total)
+            return "";
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        auto left = static_cast<long long>(elapsed / done * (total - done) + 0.5);
+        return ", about " + std::to_string(left) + "s left";
+    }
+    
+    //Take samples [sample_begin, sample_end) of pixel i,j and add them to the film.
+    //With adaptive sampling on, a pixel stops as soon as it's converged (and converged pixels don't take any more
+    //samples in later passes either), so the samples go where the noise is.
+    void render_pixel(int i, int j, int sample_begin, int sample_end, const hittable& world) {
+        bool adaptive = adaptive_threshold > 0;
+        auto p = film.index(i, j);
+        
+        color pixel_color(0,0,0); //Base pixel color of 'no values'.
+        real lum_sq = 0;
+        int before = 0; //Samples already summed, when render_progressive carries the sums over.
+        if (!carry_over(p, sample_begin, pixel_color, lum_sq, before))
+            return;
+        if (running_sums.empty() && adaptive && converged(p, color(0,0,0), 0, 0))
+            return;
+        
+        int taken = 0;
+        for (int sample = sample_begin; sample < sample_end; ++sample) {
+            color c = sample_pixel(i, j, sample, world);
+            pixel_color += c;
+            lum_sq += luminance(c) * luminance(c);
+            ++taken;
+            
+            //Checking every sample would cost more than it saves, so check every few.
+            if (adaptive && (before + taken) % 4 == 0 && converged(p, pixel_color, lum_sq, taken))
+                break;
+        }
+        add_to_film(i, j, pixel_color, taken, lum_sq);
+    }
+    
+    //render_pixel for a whole tile at once, the wavefront way. Every sample of every pixel in the tile becomes a path
+    //in one queue and trace_wavefront follows them all together. The results are then added up per pixel in sample
+    //order, exactly as render_pixel would, so the image comes out the same.
+    //With adaptive sampling the samples go out 4 at a time (render_pixel checks every 4 too) and only to pixels that
+    //haven't converged. Either way no more than wavefront_size paths are in flight (4, for one pixel, if it's less).
+    void render_tile_wavefront(int x0, int y0, int x1, int y1, int sample_begin, int sample_end,
+                               const hittable& world) {
+        thread_local wavefront_queue queue;
+        thread_local std::vector<color> results;
+
+        int width = x1 - x0;
+        int pixels = width * (y1 - y0);
+        bool adaptive = adaptive_threshold > 0;
+
+        std::vector<color> sums(pixels, color(0,0,0));
+        std::vector<real> lum_sqs(pixels, 0);
+        std::vector<int> taken(pixels, 0), before(pixels, 0);
+        std::vector<uint8_t> done(pixels, 0), skipped(pixels, 0);
+        for (int p = 0; p < pixels; p++) {
+            auto film_index = film.index(x0 + p % width, y0 + p / width);
+            if (!carry_over(film_index, sample_begin, sums[p], lum_sqs[p], before[p])
+                || (running_sums.empty() && adaptive && converged(film_index, color(0,0,0), 0, 0)))
+                done[p] = skipped[p] = 1;
+        }
+
+        // At most wavefront_size paths at once: the tile's pixels go through in chunks that many samples each fit
+        // into, and each chunk's samples in rounds. A pixel's samples still add up in order, so chunking changes
+        // nothing in the image.
+        int round = adaptive ? 4 : std::max(1, wavefront_size / pixels);
+        int chunk = std::max(1, wavefront_size / round);
+        for (int c0 = 0; c0 < pixels; c0 += chunk) {
+            int c1 = std::min(pixels, c0 + chunk);
+            for (int s0 = sample_begin; s0 < sample_end; s0 += round) {
+                int n = std::min(round, sample_end - s0);
+
+                // Generate: a camera ray per sample, each with the same random numbers render_pixel would give it.
+                queue.clear();
+                results.assign(static_cast<size_t>(c1 - c0) * n, color(0,0,0));
+                for (int p = c0; p < c1; p++) {
+                    if (done[p])
+                        continue;
+                    int i = x0 + p % width, j = y0 + p / width;
+                    for (int s = 0; s < n; s++) {
+                        sampler numbers;
+                        start_sample(numbers, i, j, s0 + s);
+                        ray r = get_ray(i, j, numbers);
+                        queue.push(r, thread_rng(), numbers, static_cast<uint32_t>((p - c0) * n + s));
+                    }
+                }
+                if (queue.size() == 0)
+                    break;
+
+                trace_wavefront(queue, results, world);
+
+                for (int p = c0; p < c1; p++) {
+                    if (done[p])
+                        continue;
+                    auto film_index = film.index(x0 + p % width, y0 + p / width);
+                    for (int s = 0; s < n; s++) {
+                        const color& c = results[static_cast<size_t>(p - c0) * n + s];
+                        sums[p] += c;
+                        lum_sqs[p] += luminance(c) * luminance(c);
+                        ++taken[p];
+                        if (adaptive && (before[p] + taken[p]) % 4 == 0
+                            && converged(film_index, sums[p], lum_sqs[p], taken[p])) {
+                            done[p] = 1;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        for (int p = 0; p < pixels; p++)
+            if (!skipped[p])
+                add_to_film(x0 + p % width, y0 + p / width, sums[p], taken[p], lum_sqs[p]);
+    }
+
+    //Where film pixel p's sums start from. Zero, unless render_progressive is carrying them over from the passes
+    //before: then it's those, and `before` is how many samples went into them. False if the pixel already stopped
+    //(adaptive sampling) in an earlier pass: it has fewer samples than the passes before gave out, or it converged on
+    //the last one (the check render_pixel makes every 4 samples, made again on the same sums).
+    bool carry_over(size_t p, int sample_begin, color& sum, real& lum_sq, int& before) const {
+        if (running_sums.empty())
+            return true;
+        before = static_cast<int>(film.samples[p]);
+        if (before < sample_begin)
+            return false;
+        sum = color(static_cast<real>(running_sums.rgb[3*p]), static_cast<real>(running_sums.rgb[3*p + 1]),
+                    static_cast<real>(running_sums.rgb[3*p + 2]));
+        lum_sq = static_cast<real>(running_sums.lum_sq[p]);
+        return !(adaptive_threshold > 0 && before > 0 && before % 4 == 0 && converged(p, sum, lum_sq, 0));
+    }
+
+    //Add `taken` new samples of pixel i,j to the film. When render_progressive carries the sums over, sum and lum_sq
+    //are the totals so far (see carry_over) and the film gets them rounded once, exactly as render2's film gets all of
+    //a pixel's samples summed and then rounded.
+    void add_to_film(int i, int j, const color& sum, int taken, real lum_sq) {
+        if (running_sums.empty()) {
+            film.accumulate(i, j, sum, taken, lum_sq);
+            return;
+        }
+        auto p = film.index(i, j);
+        for (int c = 0; c < 3; c++) {
+            running_sums.rgb[3*p + c] = sum[c];
+            film.rgb[3*p + c] = static_cast<float>(sum[c]);
+        }
+        running_sums.lum_sq[p] = lum_sq;
+        film.lum_sq[p] = static_cast<float>(lum_sq);
+        film.samples[p] += taken;
+    }
+
+    //ray_color for a whole queue of paths, a bounce at a time: intersect them all, shade all the hits one material
+    //kind at a time (so the same scatter() runs over a batch in a row, and its branches stay predictable), squeeze
+    //out the paths that ended, repeat. A path's color lands in results[slot] when it ends.
+    void trace_wavefront(wavefront_queue& queue, std::vector<color>& results, const hittable& world) const {
+        for (int bounce = 0; bounce < max_depth && queue.size() > 0; ++bounce) {
+            size_t n = queue.size();
+            queue.hits.resize(n);
+            queue.alive.assign(n, 1);
+
+            // Intersect.
+            size_t counts[material_kind_count] = {};
+            for (size_t k = 0; k < n; k++) {
+                RT_STAT(++(bounce == 0 ? thread_stats().primary_rays : thread_stats().secondary_rays));
+                ray r = queue.get_ray(k);
+                if (!world.hit(r, interval(0.001, infinity), queue.hits[k])) {
+                    RT_STAT(++thread_stats().escaped, thread_stats().end_path(bounce));
+                    results[queue.slot[k]] += queue.throughput(k) * sky_light(r, queue.pdf[k]);
+                    queue.alive[k] = 0;
+                    continue;
+                }
+                results[queue.slot[k]] += queue.throughput(k) * emission(r, queue.hits[k], queue.pdf[k]);
+                counts[static_cast<int>(queue.hits[k].mat->kind())]++;
+            }
+
+            // Sort the hits by material kind (a counting sort, the kinds are few).
+            size_t starts[material_kind_count + 1] = {};
+            for (int m = 0; m < material_kind_count; m++)
+                starts[m + 1] = starts[m] + counts[m];
+            size_t fill[material_kind_count];
+            std::copy(starts, starts + material_kind_count, fill);
+            queue.batches.resize(starts[material_kind_count]);
+            for (size_t k = 0; k < n; k++)
+                if (queue.alive[k])
+                    queue.batches[fill[static_cast<int>(queue.hits[k].mat->kind())]++] = static_cast<uint32_t>(k);
+
+            // Shade, one batch per kind.
+            const uint32_t* batch = queue.batches.data();
+            shade_wavefront<lambertian>(queue, results, world, batch + starts[0], batch + starts[1], bounce);
+            shade_wavefront<metal>(queue, results, world, batch + starts[1], batch + starts[2], bounce);
+            shade_wavefront<dielectric>(queue, results, world, batch + starts[2], batch + starts[3], bounce);
+            shade_wavefront<diffuse_light>(queue, results, world, batch + starts[3], batch + starts[4], bounce);
+
+            // Compact.
+            queue.compact();
+        }
+
+        // Whatever is still going ran out of bounces. Its results stay black.
+        RT_STAT(
+            for (size_t k = 0; k < queue.size(); k++)
+                ++thread_stats().depth_limited, thread_stats().end_path(max_depth);
+        );
+    }
+
+    //The scatter half of one ray_color bounce for a batch of hits that all have material T: the shadow ray, scatter,
+    //update the throughput, Russian roulette. Same steps in the same order as ray_color, drawing from the path's own
+    //generator. Shadow rays are traced right here rather than queued up, there's at most one per path per bounce.
+    template <typename T>
+    void shade_wavefront(wavefront_queue& queue, std::vector<color>& results, const hittable& world,
+                         const uint32_t* begin, const uint32_t* end, int bounce) const {
+        pcg32& rng = thread_rng();
+        for (const uint32_t* it = begin; it != end; ++it) {
+            size_t k = *it;
+            const hit_record& rec = queue.hits[k];
+            const T& mat = rec.mat->as<T>();
+            rng = queue.rng[k];
+            sampler& numbers = queue.samplers[k];
+            ray r = queue.get_ray(k);
+
+            bool aim = light_sampling && (lights || environment) && mat.samples_lights();
+            if (aim)
+                results[queue.slot[k]] += queue.throughput(k) * sample_lights(r, rec, world, numbers, bounce);
+            numbers.start_bounce(bounce);
+
+            ray scattered;
+            color attenuation;
+            RT_STAT(++thread_stats().scatters[static_cast<int>(rec.mat->kind())]);
+            if (!mat.scatter(r, rec, attenuation, scattered, numbers)) {
+                RT_STAT(++thread_stats().absorbed, thread_stats().end_path(bounce + 1));
+                queue.alive[k] = 0;
+                continue;
+            }
+
+            color throughput = queue.throughput(k) * attenuation;
+
+            auto max_throughput = fmax(throughput.x(), fmax(throughput.y(), throughput.z()));
+            if (max_throughput <= 0) {
+                RT_STAT(++thread_stats().absorbed, thread_stats().end_path(bounce + 1));
+                queue.alive[k] = 0;
+                continue;
+            }
+
+            if (bounce + 1 >= rr_min_depth) {
+                auto survive = fmin(max_throughput, 0.95);
+                numbers.start_roulette(bounce);
+                if (numbers.get_1d() >= survive) {
+                    RT_STAT(++thread_stats().roulette, thread_stats().end_path(bounce + 1));
+                    queue.alive[k] = 0;
+                    continue;
+                }
+                throughput /= survive;
+            }
+
+            queue.set_ray(k, scattered);
+            queue.set_throughput(k, throughput);
+            queue.pdf[k] = aim ? mat.scatter_pdf(r, rec, scattered.direction()) : 0;
+            queue.rng[k] = rng;
+        }
+    }
+
+    //Is pixel p (plus `extra` more samples not yet in the film) good enough to stop?
+    //The error that matters is the one we'd see, after gamma correction. sqrt(L) changes by about dL/(2*sqrt(L)), so a
+    //pixel is done when the standard error of its mean, squashed that way, is under adaptive_threshold.
+    bool converged(size_t p, const color& extra_sum, real extra_lum_sq, int extra) const {
+        auto n = static_cast<double>(film.samples[p]) + extra;
+        if (n < adaptive_min_samples || n < 2)
+            return false;
+        
+        // Sums carried over by render_progressive already include what's in the film.
+        bool carried = !running_sums.empty();
+        real film_lum = carried ? real(0) : luminance(color(film.rgb[3*p + 0], film.rgb[3*p + 1], film.rgb[3*p + 2]));
+        float film_lum_sq = carried ? 0.0f : film.lum_sq[p];
+        auto mean = (film_lum + luminance(extra_sum)) / n;
+        auto variance = std::max(0.0, (film_lum_sq + extra_lum_sq) / n - mean*mean);
+        auto standard_error = std::sqrt(variance / (n - 1));
+        return standard_error <= adaptive_threshold * 2 * std::sqrt(std::max(mean, 1e-4));
+    }
+    
+    //Load checkpoint_file into the film if it belongs to this render. Returns how many samples it already has.
+    int resume_checkpoint() {
+        framebuffer saved;
+        pixel_sums saved_sums;
+        checkpoint_info info;
+        std::string error;
+        if (!load_checkpoint(checkpoint_file, image_width, image_height, saved, saved_sums, info, error)) {
+            if (!error.empty())
+                std::clog << "Ignoring " << checkpoint_file << ": " << error << ".\n";
+            return 0;
+        }
+        
+        if (info.seed != seed || static_cast<int>(info.max_depth) != max_depth
+            || info.sampler != static_cast<uint32_t>(sampling) || info.scene != scene_hash) {
+            std::clog << "Ignoring " << checkpoint_file << ": it was made with a different scene, seed, max_depth or "
+                      << "sampler.\n";
+            return 0;
+        }
+        // Samples can't be taken back out of the sums, and the image would quietly have more than asked for.
+        if (static_cast<int64_t>(info.samples_done) > samples_per_pixel) {
+            std::clog << "Ignoring " << checkpoint_file << ": it already has " << info.samples_done
+                      << " samples per pixel, more than the " << samples_per_pixel << " asked for.\n";
+            return 0;
+        }
+        
+        film = std::move(saved);
+        running_sums = std::move(saved_sums);
+        std::clog << "Resuming from " << checkpoint_file << " with " << info.samples_done << " samples per pixel.\n";
+        return static_cast<int>(info.samples_done);
+    }
+    
+    void write_checkpoint(int samples_done) const {
+        if (checkpoint_file.empty())
+            return;
+        checkpoint_info info;
+        info.width = image_width;
+        info.height = image_height;
+        info.samples_done = samples_done;
+        info.max_depth = static_cast<uint32_t>(max_depth);
+        info.seed = seed;
+        info.sampler = static_cast<uint32_t>(sampling);
+        info.scene = scene_hash;
+        if (!save_checkpoint(checkpoint_file, film, running_sums, info))
+            std::cerr << "\nCould not write checkpoint " << checkpoint_file << '\n';
+    }
+    
+    //Whatever the film needs before it's saved: the feature buffers when they're wanted, and the denoised image.
+    void post_process(const hittable& world) {
+        if (!denoise && feature_file.empty())
+            return;
+        start_pool();
+        if (!features_ready)
+            render_features(world);
+        if (denoise) {
+            std::clog << "\rDenoising...                      " << std::flush;
+            // The other samplers spread a pixel's samples out evenly, so its mean is closer than their spread says.
+            denoise_settings options = denoise_options;
+            if (sampling != sampler_kind::independent)
+                options.variance_scale *= 0.56f;
+            denoise_image(film, film_features, denoised, *pool, options);
+        }
+    }
+
+    //The denoiser's feature buffers: first hit albedo, normal and depth of every pixel, averaged over its first
+    //feature_samples camera rays. Those are the same rays its first samples took, so the features' edges line up
+    //with the image's, anti-aliasing and all. A mirror or glass hit follows the ray on through and takes the albedo
+    //(tinted by what it went through) and normal of what's seen in it, the depth stays the mirror's.
+    void render_features(const hittable& world) {
+        film_features.resize(image_width, image_height);
+        int count = std::max(1, feature_samples);
+        const int max_specular = 8; // Mirrors facing each other stop somewhere.
+        pool->parallel_for(image_height, [&](int j) {
+            for (int i = 0; i < image_width; i++) {
+                color albedo(0,0,0);
+                vec3 normal(0,0,0);
+                double depth = 0;
+                for (int sample = 0; sample < count; sample++) {
+                    sampler numbers;
+                    start_sample(numbers, i, j, sample);
+                    ray r = get_ray(i, j, numbers);
+                    color throughput(1,1,1);
+                    hit_record rec;
+                    for (int bounce = 0; ; bounce++) {
+                        if (!world.hit(r, interval(0.001, infinity), rec)) {
+                            albedo += throughput * background(r);
+                            normal += -unit_vector(r.direction());
+                            break;
+                        }
+                        if (bounce == 0)
+                            depth += rec.t * r.direction().length();
+                        ray scattered;
+                        color attenuation;
+                        numbers.start_bounce(bounce);
+                        if (!rec.mat->is_specular() || bounce + 1 >= max_specular
+                            || !rec.mat->scatter(r, rec, attenuation, scattered, numbers)) {
+                            albedo += throughput * rec.mat->surface_albedo();
+                            normal += rec.normal;
+                            break;
+                        }
+                        throughput = throughput * attenuation;
+                        r = scattered;
+                    }
+                }
+                size_t p = static_cast<size_t>(j) * image_width + i;
+                for (int c = 0; c < 3; c++) {
+                    film_features.albedo[3*p + c] = static_cast<float>(albedo[c] / count);
+                    film_features.normal[3*p + c] = static_cast<float>(normal[c] / count);
+                }
+                film_features.depth[p] = static_cast<float>(depth / count);
+            }
+        });
+        features_ready = true;
+    }
+
+    void save_film() {
+        if (!output_file.empty() && !save_image(image(), output_file))
+            std::cerr << "\nCould not write " << output_file << '\n';
+        if (!feature_file.empty() && features_ready) {
+            const feature_buffers& f = film_features;
+            bool ok = save_image(feature_buffers::image(f.albedo, 3, f.width, f.height),
+                                 path_with_suffix(feature_file, "_albedo"))
+                   && save_image(feature_buffers::image(f.normal, 3, f.width, f.height),
+                                 path_with_suffix(feature_file, "_normal"))
+                   && save_image(feature_buffers::image(f.depth, 1, f.width, f.height),
+                                 path_with_suffix(feature_file, "_depth"));
+            if (!ok)
+                std::cerr << "\nCould not write the feature buffers to " << feature_file << '\n';
+        }
+        if (!sample_count_file.empty() && !save_image(film, sample_count_file, sample_count_writer()))
+            std::cerr << "\nCould not write " << sample_count_file << '\n';
+        save_stats();
+    }
+
+    void save_stats() {
+#ifdef RT_ENABLE_STATS
+        //Called between passes (or at the end) while the pool is idle, so reading every thread's counters is safe.
+        frame_stats = collect_stats();
+        std::string json = frame_stats.to_json() + '\n';
+        if (!stats_file.empty() && !write_file(stats_file, std::vector<char>(json.begin(), json.end())))
+            std::cerr << "\nCould not write " << stats_file << '\n';
+#endif
+    }
+
+    //One sample of pixel i,j. The random numbers are reseeded from (seed, pixel, sample) first so the result doesn't
+    //depend on which thread runs it or what that thread did before.
+    color sample_pixel(int i, int j, int sample, const hittable& world) const {
+        sampler numbers;
+        start_sample(numbers, i, j, sample);
+        ray r = get_ray(i, j, numbers);
+        return ray_color(r, max_depth, world, numbers);
+    }
+
+    void start_sample(sampler& numbers, int i, int j, int sample) const {
+        numbers.start(sampling, seed, i, j, static_cast<uint64_t>(j) * image_width + i,
+                      static_cast<uint32_t>(sample), static_cast<uint32_t>(samples_per_pixel));
+    }
+
+    ray get_ray(int i, int j, sampler& numbers) const {
         //Get a randomly sampled camera ray for the pixel at location i,j.
         auto pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
         
@@ -197,44 +877,187 @@ private:
         //to a pixel.
         //pixel_center is actually pixel LOCATION.
         //(Of our target I mean. In world space)
-        auto pixel_sample = pixel_center + pixel_sample_square(); //Now we sample the square around the pixel for anti-aliasing.
+        auto pixel_sample = pixel_center + pixel_sample_square(numbers); //Now we sample the square around the pixel for anti-aliasing.
 
         //Calculate the ray direction from the camera center to the pixel center
         //auto ray_origin = center; //With this, the focus is perfect. Our defocusing lens is size 0.
-        auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+        auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample(numbers);
         auto ray_direction = pixel_sample - ray_origin;
 
         return ray(ray_origin, ray_direction);
     }
     
-    vec3 pixel_sample_square() const {
+    vec3 pixel_sample_square(sampler& numbers) const {
         // Returns a random point in the square surrounding a pixel at the origin.
-        auto px = -0.5 + random_double();
-        auto py = -0.5 + random_double();
+        sample2 u = numbers.get_2d();
+        auto px = -0.5 + u.x;
+        auto py = -0.5 + u.y;
         return (px * pixel_delta_u) + (py * pixel_delta_v);
     }
     
-    point3 defocus_disk_sample() const {
+    point3 defocus_disk_sample(sampler& numbers) const {
         // Returns a random point in the camera defocus disk.
-        auto p = random_in_unit_disk();
+        auto p = numbers.get_disk();
         return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 
-    color ray_color(const ray& r, int depth, const hittable& world) const {
+    //Follow one path through the scene. This used to call itself once per bounce which meant deep stacks at high
+    //max_depth. Now it's a loop that carries along the 'throughput': how much of whatever light the path eventually
+    //finds actually makes it back to the camera (the product of every attenuation so far). Light is picked up on
+    //the way too, from lights the path runs into and from the shadow rays it sends at them.
+    color ray_color(const ray& r_in, int depth, const hittable& world, sampler& numbers) const {
         hit_record rec;
+        ray r = r_in;
+        color throughput(1,1,1);
+        color radiance(0,0,0);
+        real bsdf_pdf = 0; // Of the bounce that sent r off (see emission). The camera ray wasn't one.
 
-        // If we've exceeded the ray bounce limit, no more light is gathered.
-        if (depth <= 0)
-            return color(0,0,0);
+        for (int bounce = 0; bounce < depth; ++bounce) {
+            RT_STAT(++(bounce == 0 ? thread_stats().primary_rays : thread_stats().secondary_rays));
+            if (!world.hit(r, interval(0.001, infinity), rec)) {
+                RT_STAT(++thread_stats().escaped, thread_stats().end_path(bounce));
+                return radiance + throughput * sky_light(r, bsdf_pdf);
+            }
+            radiance += throughput * emission(r, rec, bsdf_pdf);
+
+            bool aim = light_sampling && (lights || environment) && rec.mat->samples_lights();
+            if (aim)
+                radiance += throughput * sample_lights(r, rec, world, numbers, bounce);
 
-        if (world.hit(r, interval(0.001, infinity), rec)) {
             ray scattered;
             color attenuation;
-            if (rec.mat->scatter(r, rec, attenuation, scattered))
-                return attenuation * ray_color(scattered, depth-1, world);
-            return color(0,0,0);
+            RT_STAT(++thread_stats().scatters[static_cast<int>(rec.mat->kind())]);
+            numbers.start_bounce(bounce);
+            if (!rec.mat->scatter(r, rec, attenuation, scattered, numbers)) {
+                RT_STAT(++thread_stats().absorbed, thread_stats().end_path(bounce + 1));
+                return radiance;
+            }
+            bsdf_pdf = aim ? rec.mat->scatter_pdf(r, rec, scattered.direction()) : 0;
+
+            throughput = throughput * attenuation;
+
+            // Nothing can get through a completely black surface, so there's no reason to keep tracing.
+            auto max_throughput = fmax(throughput.x(), fmax(throughput.y(), throughput.z()));
+            if (max_throughput <= 0) {
+                RT_STAT(++thread_stats().absorbed, thread_stats().end_path(bounce + 1));
+                return radiance;
+            }
+
+            //Russian roulette. Past rr_min_depth bounces, paths that carry very little light are likely to be
+            //killed off, and the survivors get boosted by exactly the amount that makes up for the dead ones. So dim
+            //paths stop early but the average (the image) doesn't change.
+            if (bounce + 1 >= rr_min_depth) {
+                auto survive = fmin(max_throughput, 0.95);
+                numbers.start_roulette(bounce);
+                if (numbers.get_1d() >= survive) {
+                    RT_STAT(++thread_stats().roulette, thread_stats().end_path(bounce + 1));
+                    return radiance;
+                }
+                throughput /= survive;
+            }
+
+            r = scattered;
         }
 
+        RT_STAT(++thread_stats().depth_limited, thread_stats().end_path(depth));
+        // If we've exceeded the ray bounce limit, no more light is gathered.
+        return radiance;
+    }
+
+    //Next event estimation: pick a light, aim a shadow ray at it from rec.p and, if nothing's in the way, the light
+    //that comes down it and bounces off towards r_in's origin (still to be multiplied by the path's throughput). With
+    //an environment map, a second shadow ray goes off towards a bright part of that.
+    //
+    //The same light can also be found by the bounce itself running into it (see emission and sky_light), so each
+    //way's result is weighted by the power heuristic (Veach's multiple importance sampling) and the two add up to the
+    //light exactly once. Each counts for most where it's the likelier of the two to find it: shadow rays for small
+    //lights and rough surfaces, bouncing for big lights seen in something shiny.
+    color sample_lights(const ray& r_in, const hit_record& rec, const hittable& world, sampler& numbers,
+                        int bounce) const {
+        color found(0,0,0);
+        if (lights)
+            found += sample_light_list(r_in, rec, world, numbers, bounce);
+        if (environment)
+            found += sample_environment(r_in, rec, world, numbers, bounce);
+        return found;
+    }
+
+    color sample_light_list(const ray& r_in, const hit_record& rec, const hittable& world, sampler& numbers,
+                            int bounce) const {
+        numbers.start_light(bounce);
+        double pick = numbers.get_1d();
+        sample2 u = numbers.get_2d();
+        light_sample light;
+        if (!lights->sample(rec.p, pick, u, light))
+            return color(0,0,0);
+        real bsdf_pdf = rec.mat->scatter_pdf(r_in, rec, light.direction);
+        if (bsdf_pdf <= 0)
+            return color(0,0,0);
+
+        RT_STAT(++thread_stats().shadow_rays);
+        hit_record blocker;
+        if (world.hit(ray(rec.p, light.direction), interval(0.001, light.distance * (1 - 1e-3)), blocker))
+            return color(0,0,0);
+
+        // albedo * bsdf_pdf is what the surface sends on (see lambertian::scatter_pdf), divided by light.pdf for the
+        // sample and weighted by light.pdf^2 / (light.pdf^2 + bsdf_pdf^2).
+        double weight = bsdf_pdf * power_heuristic(light.pdf, bsdf_pdf) / light.pdf;
+        return rec.mat->surface_albedo() * light.emission * weight;
+    }
+
+    //The same with a direction picked from the environment map. Nothing at all may be in the way this time.
+    color sample_environment(const ray& r_in, const hit_record& rec, const hittable& world, sampler& numbers,
+                             int bounce) const {
+        numbers.start_environment(bounce);
+        sample2 u = numbers.get_2d();
+        vec3 direction;
+        color radiance;
+        real light_pdf;
+        if (!environment->sample(u, direction, radiance, light_pdf) || light_pdf <= 0)
+            return color(0,0,0);
+        real bsdf_pdf = rec.mat->scatter_pdf(r_in, rec, direction);
+        if (bsdf_pdf <= 0)
+            return color(0,0,0);
+
+        RT_STAT(++thread_stats().shadow_rays);
+        hit_record blocker;
+        if (world.hit(ray(rec.p, direction), interval(0.001, infinity), blocker))
+            return color(0,0,0);
+
+        double weight = bsdf_pdf * power_heuristic(light_pdf, bsdf_pdf) / light_pdf;
+        return rec.mat->surface_albedo() * radiance * weight;
+    }
+
+    //What the ray r sees glowing where it hit. bsdf_pdf is that of the bounce that sent r off, or 0 if no shadow ray
+    //was aimed from there (the camera, mirrors, glass): then running into it is the only way this light gets seen and
+    //it counts fully. Otherwise it's weighted against the shadow ray that could have found it too.
+    color emission(const ray& r, const hit_record& rec, real bsdf_pdf) const {
+        if (!rec.front_face || rec.mat->kind() != material_kind::diffuse_light)
+            return color(0,0,0);
+        color emitted = rec.mat->emitted();
+        if (bsdf_pdf <= 0)
+            return emitted;
+        return emitted * power_heuristic(bsdf_pdf, lights ? lights->pdf(r.origin(), rec) : 0);
+    }
+
+    //What the ray r sees when it escapes, weighted against the shadow rays sent at the environment map like
+    //emission() does for lights.
+    color sky_light(const ray& r, real bsdf_pdf) const {
+        if (!environment || bsdf_pdf <= 0)
+            return background(r);
+        return background(r) * power_heuristic(bsdf_pdf, environment->pdf(r.direction()));
+    }
+
+    //The weight for a sample taken with pdf `a` when another strategy could have taken it with pdf `b`.
+    static double power_heuristic(double a, double b) {
+        return a * a / (a * a + b * b);
+    }
+
+    //The sky. What a ray sees if it hits nothing at all.
+    color background(const ray& r) const {
+        if (environment)
+            return environment->lookup(r.direction());
+
         //Make whatever ray we were given a unit vector (that means make it length 1 but still pointing in where it is supposed to be pointing.
         vec3 unit_direction = unit_vector(r.direction());
 
@@ -244,7 +1067,7 @@ private:
         //That is: The equation will return the startValue or endValue depending where we are.
         //If 'a' is between 0 and 1 then we are returning a value between our start and end value.
         //So therefore 'a' can be anything because it is determined by us and what we want. Right now I want 'a' to change as we go down the image.
-        return (1.0-a)*color(1.0, 1.0, 1.0) + a*color(0.5, 0.7, 1.0);
+        return sky * ((1.0-a)*color(1.0, 1.0, 1.0) + a*color(0.5, 0.7, 1.0));
     }
 };
 
@@ -0,0 +1,130 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "framebuffer.h"
+#include "image_writer.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+//Saving and loading a render in progress, so a 7 hour render that gets killed at hour 6 only loses the last few
+//minutes instead of everything.
+//
+//A checkpoint is the render's per pixel sums plus enough to carry on exactly where it stopped. The random numbers
+//don't need saving: every sample reseeds from (seed, pixel, sample index) (see rng.h), so knowing the seed and how
+//many samples are done is the entire "RNG state". What else went into the samples (the scene, max_depth, the sampler)
+//is saved too, so a checkpoint from some other render never gets mixed into this one.
+//
+//The sums are the full precision ones (pixel_sums), not the film's floats. Rounding them to float at every checkpoint
+//would make a resumed render come out different from one that never stopped.
+//
+//Layout, all little endian: 8 byte magic, then checkpoint_info, then width*height*3 doubles of summed color,
+//width*height uint32 sample counts and width*height doubles of summed luminance squared (framebuffer::lum_sq).
+
+//Every pixel's summed color and luminance squared, at full precision. render_progressive carries these over from
+//pass to pass (see camera::add_to_film); the film only ever gets them rounded to float.
+struct pixel_sums {
+    std::vector<double> rgb;     // 3 per pixel, like framebuffer::rgb.
+    std::vector<double> lum_sq;
+
+    void resize(size_t pixels) {
+        rgb.assign(3 * pixels, 0.0);
+        lum_sq.assign(pixels, 0.0);
+    }
+
+    bool empty() const { return lum_sq.empty(); }
+};
+
+struct checkpoint_info {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t samples_done = 0;  // Every pixel has had sample indices [0, samples_done) added (or converged early).
+    uint32_t max_depth = 0;
+    uint64_t seed = 0;
+    uint32_t sampler = 0;       // A sampler_kind.
+    uint32_t reserved = 0;
+    uint64_t scene = 0;         // camera::scene_hash.
+};
+
+static const char checkpoint_magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '3', '\0'};
+
+inline bool save_checkpoint(const std::string& path, const framebuffer& fb, const pixel_sums& sums,
+                            const checkpoint_info& info) {
+    size_t color_bytes = sums.rgb.size() * sizeof(double);
+    size_t count_bytes = fb.samples.size() * sizeof(uint32_t);
+    size_t lum_bytes = sums.lum_sq.size() * sizeof(double);
+
+    std::vector<char> bytes(sizeof(checkpoint_magic) + sizeof(info) + color_bytes + count_bytes + lum_bytes);
+    char* out = bytes.data();
+    std::memcpy(out, checkpoint_magic, sizeof(checkpoint_magic)); out += sizeof(checkpoint_magic);
+    std::memcpy(out, &info, sizeof(info));                        out += sizeof(info);
+    std::memcpy(out, sums.rgb.data(), color_bytes);               out += color_bytes;
+    std::memcpy(out, fb.samples.data(), count_bytes);              out += count_bytes;
+    std::memcpy(out, sums.lum_sq.data(), lum_bytes);
+
+    // Write next to the real file and swap it in, so getting killed halfway through a save can't wreck the last
+    // good checkpoint.
+    std::string temp = path + ".tmp";
+    if (!write_file(temp, bytes))
+        return false;
+#ifdef _WIN32
+    std::remove(path.c_str()); // Windows won't rename over an existing file.
+#endif
+    return std::rename(temp.c_str(), path.c_str()) == 0;
+}
+
+//Load a checkpoint of a width x height render into fb (the sums rounded to float, as the film keeps them) and sums.
+//Returns false and leaves both alone if there's no file (error empty), or it isn't a checkpoint of an image that size
+//(error says why). The size is checked before anything gets allocated, so a damaged header can't ask for terabytes.
+inline bool load_checkpoint(const std::string& path, int width, int height, framebuffer& fb, pixel_sums& sums,
+                            checkpoint_info& info, std::string& error) {
+    error.clear();
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+
+    char magic[sizeof(checkpoint_magic)];
+    checkpoint_info loaded;
+    bool ok = std::fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+              && std::memcmp(magic, checkpoint_magic, sizeof(magic)) == 0
+              && std::fread(&loaded, sizeof(loaded), 1, file) == 1;
+    if (!ok) {
+        std::fclose(file);
+        error = "not a checkpoint";
+        return false;
+    }
+    if (width <= 0 || height <= 0 || loaded.width != static_cast<uint32_t>(width)
+        || loaded.height != static_cast<uint32_t>(height)) {
+        std::fclose(file);
+        error = "it was made with a different image size";
+        return false;
+    }
+
+    framebuffer temp(width, height);
+    pixel_sums temp_sums;
+    temp_sums.resize(temp.pixel_count());
+    ok = std::fread(temp_sums.rgb.data(), sizeof(double), temp_sums.rgb.size(), file) == temp_sums.rgb.size()
+         && std::fread(temp.samples.data(), sizeof(uint32_t), temp.samples.size(), file) == temp.samples.size()
+         && std::fread(temp_sums.lum_sq.data(), sizeof(double), temp_sums.lum_sq.size(), file)
+            == temp_sums.lum_sq.size();
+    std::fclose(file);
+    if (!ok) {
+        error = "file is cut short";
+        return false;
+    }
+
+    for (size_t k = 0; k < temp.rgb.size(); k++)
+        temp.rgb[k] = static_cast<float>(temp_sums.rgb[k]);
+    for (size_t k = 0; k < temp.lum_sq.size(); k++)
+        temp.lum_sq[k] = static_cast<float>(temp_sums.lum_sq[k]);
+    fb = std::move(temp);
+    sums = std::move(temp_sums);
+    info = loaded;
+    return true;
+}
+
+#endif //CHECKPOINT_H
@@ -5,14 +5,12 @@
 #ifndef COMMON_CONSTANTS_H
 #define COMMON_CONSTANTS_H
 
-#include <random>
 #include <cmath>
 #include <limits>
 #include <memory>
 
-std::random_device rd;
-std::minstd_rand mt(rd());
-std::uniform_real_distribution<double> dist(0, 1.0);
+#include "precision.h"
+#include "rng.h"
 
 // Usings
 
@@ -22,7 +20,7 @@ using std::sqrt;
 
 // Constants
 
-const double infinity = std::numeric_limits<double>::infinity();
+const real infinity = std::numeric_limits<real>::infinity();
 const double pi = 3.1415926535897932385;
 
 // Utility Functions
@@ -32,9 +30,8 @@ inline double degrees_to_radians(double degrees) {
 }
 inline double random_double() {
     // Returns a random real in [0,1).
-    return dist(mt);
-    
-    //return rand() / (RAND_MAX + 1.0);
+    //Drawn from this thread's own generator (rng.h). No sharing between threads.
+    return thread_rng().next_double();
 }
 
 inline double random_double(double min, double max) {
@@ -0,0 +1,236 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "color.h"
+#include "framebuffer.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+//Denoising: instead of throwing samples at the noise until it goes away, render a few and smooth out what's left.
+//
+//Smoothing on its own would smear the whole picture. What stops it is knowing where the real edges are, and for that
+//the camera records a few cheap things about the first thing each pixel sees (see camera::render_features): its
+//albedo, its normal and how far away it is. Those come out clean after a handful of camera rays, since nothing random
+//happens before the first hit. Mirrors and glass are looked through (to the first surface that isn't one) so what's
+//reflected in them keeps its edges too. Neighbours get averaged in only where all of them agree, so two spheres never bleed
+//into each other and neither does a sphere and the sky behind it.
+
+//First hit features of every pixel, averaged over a few of its camera rays. Rows top to bottom, like framebuffer.
+class feature_buffers {
+public:
+    int width  = 0;
+    int height = 0;
+    std::vector<float> albedo; // 3 per pixel. The material's color, or the background's where the rays escaped.
+    std::vector<float> normal; // 3 per pixel, facing the camera. Where the rays escaped, pointing back at it.
+    std::vector<float> depth;  // Distance to the first hit. 0 where the rays escaped.
+
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        albedo.assign(static_cast<size_t>(w) * h * 3, 0.0f);
+        normal.assign(static_cast<size_t>(w) * h * 3, 0.0f);
+        depth.assign(static_cast<size_t>(w) * h, 0.0f);
+    }
+
+    //One buffer as an image of its own (one sample per pixel) for save_image. `channels` is 3 or 1 (written as grey).
+    static framebuffer image(const std::vector<float>& values, int channels, int w, int h) {
+        framebuffer fb(w, h);
+        for (size_t p = 0; p < fb.pixel_count(); p++) {
+            for (int c = 0; c < 3; c++)
+                fb.rgb[3*p + c] = values[channels * p + (channels == 3 ? c : 0)];
+            fb.samples[p] = 1;
+        }
+        return fb;
+    }
+};
+
+struct denoise_settings {
+    int   iterations      = 4;     // Filter passes. Pass k looks 2^k pixels away, so 4 passes reach about 30 pixels.
+    float normal_power    = 16;    // How fast neighbours stop counting as their normals turn away. Higher is sharper,
+                                   // but a small sphere is all curve and would hardly get smoothed at all.
+    float depth_tolerance = 1;     // How much further than the slope of the surface predicts a neighbour may be.
+    float albedo_sigma    = 0.3f;  // How far apart two albedos can be and still mostly count as the same surface.
+    float noise_sigma     = 4;     // Neighbours further off in brightness than this many standard deviations of the
+                                   // noise are taken for real detail and left out. That's at 8 samples per pixel,
+                                   // it goes as 1/sqrt(samples) (see denoise_image).
+    float variance_scale  = 1;     // What the film's squares say a pixel's variance is, times this. Right for the
+                                   // independent sampler, the camera makes it 0.56 for the others.
+};
+
+//Denoise `film` into `out` with an edge-avoiding a-trous wavelet filter (Dammertz et al. 2010, with the variance
+//guided brightness test from Schied et al.'s SVGF). Each pass is a 5x5 blur whose taps are 2^pass pixels apart, so a
+//few cheap passes cover a wide area, and every tap is weighted down by how much its normal, depth, albedo and
+//brightness disagree with the pixel's. The noise level comes from the film's own luminance squares (what adaptive
+//sampling uses), so clean pixels barely move and noisy ones get smoothed hard.
+//
+//How many standard deviations count as noise shrinks as a pixel gets more samples. A few samples say little about
+//their own spread (the rare bright paths that make most of it haven't turned up yet), so the test has to be generous
+//there. With many, the estimate can be trusted and a generous test only blurs away real shading: at a fixed 4 the
+//filter made the original scene worse from 32 spp up.
+//
+//The squares give the variance of the mean as if the samples were independent. With stratified, Sobol or blue noise
+//samples the mean is better than that (on the original scene about 0.75 times the standard deviation from 16 spp up),
+//which is what variance_scale is for.
+//
+//The albedo is divided out first and multiplied back in at the end. What gets smoothed is only the lighting, so the
+//colors of neighbouring spheres stay crisp however hard the lighting gets blurred. `out` keeps the film's sample
+//counts, with color sums that average to the denoised color. Rows go out in parallel on `pool`.
+inline void denoise_image(const framebuffer& film, const feature_buffers& features, framebuffer& out,
+                          thread_pool& pool, const denoise_settings& settings = denoise_settings()) {
+    const int w = film.width, h = film.height;
+    const size_t n = static_cast<size_t>(w) * h;
+    const float floor = 0.01f; // Albedo below this would blow the noise up when divided out.
+
+    std::vector<float> lighting(3 * n), variance(n), albedo(3 * n), normal(3 * n), noise_sigma(n);
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            size_t p = static_cast<size_t>(j) * w + i;
+            auto f = film.index(i, j);
+            color mean = film.average(i, j);
+            for (int c = 0; c < 3; c++) {
+                albedo[3*p + c] = std::max(features.albedo[3*p + c], floor);
+                lighting[3*p + c] = static_cast<float>(mean[c]) / albedo[3*p + c];
+            }
+
+            // Variance of the pixel's mean, as seen after the albedo is divided out.
+            auto samples = film.samples[f];
+            double lum = luminance(mean);
+            double spread = samples > 1 ? std::max(0.0, double(film.lum_sq[f]) / samples - lum * lum) / samples : 1.0;
+            auto albedo_lum = std::max(static_cast<float>(luminance(color(albedo[3*p], albedo[3*p+1], albedo[3*p+2]))),
+                                       floor);
+            variance[p] = static_cast<float>(settings.variance_scale * spread / (albedo_lum * albedo_lum));
+            noise_sigma[p] = settings.noise_sigma * std::sqrt(8.0f / std::max(samples, 1u));
+
+            float length = std::sqrt(features.normal[3*p] * features.normal[3*p]
+                                     + features.normal[3*p + 1] * features.normal[3*p + 1]
+                                     + features.normal[3*p + 2] * features.normal[3*p + 2]);
+            for (int c = 0; c < 3; c++)
+                normal[3*p + c] = length > 0 ? features.normal[3*p + c] / length : 0.0f;
+            if (length <= 0)
+                normal[3*p + 2] = 1; // Any direction will do, as long as the pixel agrees with itself.
+        }
+    }
+
+    // How fast depth changes from one pixel to the next, so a tilted floor doesn't look like a pile of edges. The
+    // smaller of the two one sided differences, so a silhouette doesn't make its own pixels look steep.
+    std::vector<float> slope_x(n), slope_y(n);
+    const std::vector<float>& z = features.depth;
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            size_t p = static_cast<size_t>(j) * w + i;
+            auto smaller = [](float a, float b) { return std::fabs(a) < std::fabs(b) ? std::fabs(a) : std::fabs(b); };
+            float left = i > 0 ? z[p] - z[p - 1] : 1e30f, right = i + 1 < w ? z[p + 1] - z[p] : 1e30f;
+            float up = j > 0 ? z[p] - z[p - w] : 1e30f, down = j + 1 < h ? z[p + w] - z[p] : 1e30f;
+            slope_x[p] = w > 1 ? smaller(left, right) : 0.0f;
+            slope_y[p] = h > 1 ? smaller(up, down) : 0.0f;
+        }
+    }
+
+    static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+    std::vector<float> next_lighting(3 * n), next_variance(n), blurred_variance(n);
+    const float albedo_scale = 1 / (settings.albedo_sigma * settings.albedo_sigma);
+
+    for (int pass = 0; pass < settings.iterations; pass++) {
+        int step = 1 << pass;
+
+        // The brightness test uses the variance blurred over 3x3, a single pixel's estimate is itself noisy.
+        pool.parallel_for(h, [&](int j) {
+            for (int i = 0; i < w; i++) {
+                float sum = 0, weight = 0;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int x = i + dx, y = j + dy;
+                        if (x < 0 || x >= w || y < 0 || y >= h)
+                            continue;
+                        float k = kernel[2 + dx] * kernel[2 + dy];
+                        sum += k * variance[static_cast<size_t>(y) * w + x];
+                        weight += k;
+                    }
+                }
+                blurred_variance[static_cast<size_t>(j) * w + i] = sum / weight;
+            }
+        });
+
+        pool.parallel_for(h, [&](int j) {
+            for (int i = 0; i < w; i++) {
+                size_t p = static_cast<size_t>(j) * w + i;
+                const float* lp = &lighting[3*p];
+                float lum_p = 0.2126f * lp[0] + 0.7152f * lp[1] + 0.0722f * lp[2];
+                float noise = noise_sigma[p] * std::sqrt(blurred_variance[p]) + 1e-4f;
+
+                float sum[3] = {0, 0, 0}, sum_variance = 0, total = 0;
+                for (int ty = -2; ty <= 2; ty++) {
+                    int y = j + ty * step;
+                    if (y < 0 || y >= h)
+                        continue;
+                    for (int tx = -2; tx <= 2; tx++) {
+                        int x = i + tx * step;
+                        if (x < 0 || x >= w)
+                            continue;
+                        size_t q = static_cast<size_t>(y) * w + x;
+                        const float* lq = &lighting[3*q];
+
+                        float facing = normal[3*p] * normal[3*q] + normal[3*p + 1] * normal[3*q + 1]
+                                     + normal[3*p + 2] * normal[3*q + 2];
+                        if (facing <= 0)
+                            continue;
+
+                        float expected = std::fabs(slope_x[p] * (x - i)) + std::fabs(slope_y[p] * (y - j));
+                        float depth_gap = std::fabs(z[p] - z[q]);
+                        float depth_slack = settings.depth_tolerance * expected + 0.01f * std::max(z[p], z[q]) + 1e-6f;
+
+                        float albedo_gap = 0;
+                        for (int c = 0; c < 3; c++) {
+                            float d = albedo[3*p + c] - albedo[3*q + c];
+                            albedo_gap += d * d;
+                        }
+
+                        float lum_q = 0.2126f * lq[0] + 0.7152f * lq[1] + 0.0722f * lq[2];
+
+                        // The normal (facing^normal_power), depth, albedo and brightness weights multiplied
+                        // together, as one exp.
+                        float distance = depth_gap / depth_slack + albedo_gap * albedo_scale
+                                       + std::fabs(lum_p - lum_q) / noise;
+                        if (distance > 20) // Under a billionth. Skipped, and kept out of denormal territory.
+                            continue;
+                        if (facing < 1)
+                            distance -= settings.normal_power * std::log(facing);
+                        if (distance > 20)
+                            continue;
+                        float weight = kernel[tx + 2] * kernel[ty + 2] * std::exp(-distance);
+                        for (int c = 0; c < 3; c++)
+                            sum[c] += weight * lq[c];
+                        sum_variance += weight * weight * variance[q];
+                        total += weight;
+                    }
+                }
+                // The pixel itself always counts fully, so total is never 0.
+                for (int c = 0; c < 3; c++)
+                    next_lighting[3*p + c] = sum[c] / total;
+                next_variance[p] = sum_variance / (total * total);
+            }
+        });
+
+        std::swap(lighting, next_lighting);
+        std::swap(variance, next_variance);
+    }
+
+    out.resize(w, h);
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            size_t p = static_cast<size_t>(j) * w + i;
+            auto f = film.index(i, j);
+            auto to = out.index(i, j);
+            for (int c = 0; c < 3; c++)
+                out.rgb[3*to + c] = lighting[3*p + c] * albedo[3*p + c] * film.samples[f];
+            out.samples[to] = film.samples[f];
+            out.lum_sq[to] = film.lum_sq[f];
+        }
+    }
+}
+
+#endif //DENOISE_H
@@ -0,0 +1,364 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "common_constants.h"
+
+#include "camera.h"
+#include "framebuffer.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RT_HAS_PROCESSES 1
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#else
+#define RT_HAS_PROCESSES 0
+#endif
+
+//Rendering one image with several processes. render2 only goes as far as the threads of one process; this hands
+//regions of the image out to worker processes instead, each one with its own threads, and puts the pieces together.
+//
+//The coordinator (render_distributed) starts the workers itself with a command line, usually this same program
+//with --worker added, so every worker loads the same scene with the same settings. Each worker talks to the
+//coordinator over its stdin and stdout:
+//
+//  worker -> coordinator   render_hello, once the scene is built
+//  coordinator -> worker   render_job, a region to render (an empty one means stop)
+//  worker -> coordinator   the render_job again, then the region's framebuffer: rgb, samples, lum_sq
+//
+//Every sample is seeded by its pixel and index (see camera::sample_pixel), so a region comes out the same whichever
+//process renders it. Regions don't overlap and are added into an empty film, so the finished image is exactly what
+//render2 would have made, whatever order the pieces arrive in.
+//
+//Workers get one region at a time and the next as soon as they send one back, so faster workers do more. If a
+//worker dies (its pipe closes or it sends back something wrong) its region goes back on the pile for the others.
+//If they all die the coordinator renders what's left itself.
+
+//What a worker says when it's ready. The coordinator checks it's about to render the same image: the same scene
+//(camera::scene_hash, the same the checkpoint uses) with the same settings and the same random numbers.
+struct render_hello {
+    char magic[4];
+    int32_t width, height, samples_per_pixel, max_depth;
+    int32_t sampling;
+    uint64_t seed;
+    uint64_t scene_hash;
+};
+
+//Pixels [x0,x1) x [y0,y1).
+struct render_job {
+    int32_t x0, y0, x1, y1;
+};
+
+static const char render_hello_magic[4] = {'R', 'T', 'W', '2'};
+
+#if RT_HAS_PROCESSES
+
+//Pipes hand over what they have, not necessarily everything asked for, so keep going until it's all through.
+inline bool write_all(int fd, const void* data, size_t size) {
+    auto p = static_cast<const char*>(data);
+    while (size > 0) {
+        auto n = ::write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+//False if the other end closed before `size` bytes came.
+inline bool read_all(int fd, void* data, size_t size) {
+    auto p = static_cast<char*>(data);
+    while (size > 0) {
+        auto n = ::read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+inline bool write_region(int fd, const framebuffer& piece) {
+    return write_all(fd, piece.rgb.data(), piece.rgb.size() * sizeof(float))
+        && write_all(fd, piece.samples.data(), piece.samples.size() * sizeof(uint32_t))
+        && write_all(fd, piece.lum_sq.data(), piece.lum_sq.size() * sizeof(float));
+}
+
+//`piece` must already be the region's size.
+inline bool read_region(int fd, framebuffer& piece) {
+    return read_all(fd, piece.rgb.data(), piece.rgb.size() * sizeof(float))
+        && read_all(fd, piece.samples.data(), piece.samples.size() * sizeof(uint32_t))
+        && read_all(fd, piece.lum_sq.data(), piece.lum_sq.size() * sizeof(float));
+}
+
+//The worker's side. Build the scene and set up the camera exactly like the coordinator did, then call this with the
+//pipes (stdin and stdout when started by render_distributed). Renders regions as they come in and sends each one
+//back, until told to stop. Returns the exit code for main: 0 if told to stop, 1 if the coordinator went away.
+inline int serve_render_jobs(camera& cam, const hittable& world, int in_fd = 0, int out_fd = 1) {
+    cam.begin_frame();
+    const framebuffer& film = cam.frame();
+
+    render_hello hello;
+    std::memcpy(hello.magic, render_hello_magic, sizeof(hello.magic));
+    hello.width = film.width;
+    hello.height = film.height;
+    hello.samples_per_pixel = cam.samples_per_pixel;
+    hello.max_depth = cam.max_depth;
+    hello.sampling = static_cast<int32_t>(cam.sampling);
+    hello.seed = cam.seed;
+    hello.scene_hash = cam.scene_hash;
+    if (!write_all(out_fd, &hello, sizeof(hello)))
+        return 1;
+
+    render_job job;
+    while (read_all(in_fd, &job, sizeof(job))) {
+        if (job.x1 <= job.x0 || job.y1 <= job.y0)
+            return 0;
+        if (job.x0 < 0 || job.y0 < 0 || job.x1 > film.width || job.y1 > film.height)
+            return 1;
+        cam.render_region(job.x0, job.y0, job.x1, job.y1, world);
+        framebuffer piece = film.region(job.x0, job.y0, job.x1, job.y1);
+        if (!write_all(out_fd, &job, sizeof(job)) || !write_region(out_fd, piece))
+            return 1;
+    }
+    return 1;
+}
+
+//One running worker, from the coordinator's side.
+struct worker_process {
+    pid_t pid = -1;
+    int to = -1;    // Its stdin.
+    int from = -1;  // Its stdout.
+    int job = -1;   // The region it's rendering, or -1 when idle.
+    bool alive = false;
+};
+
+//Start `command` (run with execvp) with its stdin and stdout as pipes to us.
+inline bool start_worker(const std::vector<std::string>& command, worker_process& worker) {
+    // Everything the child needs is made before fork(): after it only exec-safe calls are allowed, and if some
+    // other thread holds the malloc lock at the time it stays locked forever in the child.
+    std::vector<char*> argv;
+    for (const auto& arg : command)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    int to_child[2], from_child[2];
+    if (::pipe(to_child) != 0)
+        return false;
+    if (::pipe(from_child) != 0) {
+        ::close(to_child[0]);
+        ::close(to_child[1]);
+        return false;
+    }
+    // Close on exec, or every later worker inherits the earlier workers' pipes and holds them open, and a dead
+    // worker's pipe would never read as closed.
+    for (int fd : {to_child[0], to_child[1], from_child[0], from_child[1]})
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    pid_t pid = ::fork();
+    if (pid < 0) {
+        for (int fd : {to_child[0], to_child[1], from_child[0], from_child[1]})
+            ::close(fd);
+        return false;
+    }
+    if (pid == 0) {
+        // dup2 clears close on exec on the copies, so only these two survive into the worker.
+        ::dup2(to_child[0], 0);
+        ::dup2(from_child[1], 1);
+        ::execvp(argv[0], argv.data());
+        ::_exit(127);
+    }
+
+    ::close(to_child[0]);
+    ::close(from_child[1]);
+    worker.pid = pid;
+    worker.to = to_child[1];
+    worker.from = from_child[0];
+    worker.job = -1;
+    worker.alive = true;
+    return true;
+}
+
+//Done with a worker, whether it finished or died. Killed first in case it's still running but talking nonsense.
+inline void retire_worker(worker_process& worker, bool kill_it) {
+    if (!worker.alive)
+        return;
+    if (kill_it)
+        ::kill(worker.pid, SIGKILL);
+    ::close(worker.to);
+    ::close(worker.from);
+    ::waitpid(worker.pid, nullptr, 0);
+    worker.alive = false;
+}
+
+//The coordinator's side: render the camera's image with worker_count copies of worker_command, in regions of
+//job_size x job_size pixels, and save it like render2 does. `world` must be the same scene the workers load; it's
+//only used here if every worker dies.
+inline void render_distributed(camera& cam, const hittable& world, const std::vector<std::string>& worker_command,
+                               int worker_count, int job_size = 64) {
+    cam.begin_frame();
+    const framebuffer& film = cam.frame();
+
+    std::vector<render_job> jobs;
+    for (int y = 0; y < film.height; y += job_size)
+        for (int x = 0; x < film.width; x += job_size)
+            jobs.push_back(render_job{x, y, std::min(x + job_size, film.width), std::min(y + job_size, film.height)});
+    std::deque<int> waiting;
+    for (int k = 0; k < static_cast<int>(jobs.size()); k++)
+        waiting.push_back(k);
+    size_t finished = 0;
+
+    // Writing to a worker that just died would otherwise kill us with SIGPIPE instead of failing the write.
+    auto old_sigpipe = std::signal(SIGPIPE, SIG_IGN);
+
+    std::vector<worker_process> workers(static_cast<size_t>(worker_count));
+    for (auto& worker : workers) {
+        if (!start_worker(worker_command, worker))
+            std::cerr << "Could not start a worker\n";
+    }
+
+    auto lost = [&](worker_process& worker, const char* why) {
+        std::cerr << "\nWorker " << worker.pid << ' ' << why << ", handing its work to the others\n";
+        if (worker.job >= 0)
+            waiting.push_front(worker.job);
+        retire_worker(worker, true);
+    };
+
+    auto hand_out = [&](worker_process& worker) {
+        worker.job = -1;
+        if (waiting.empty())
+            return;
+        worker.job = waiting.front();
+        waiting.pop_front();
+        if (!write_all(worker.to, &jobs[static_cast<size_t>(worker.job)], sizeof(render_job)))
+            lost(worker, "stopped listening");
+    };
+
+    // The workers load their scenes at the same time; each one is only waited for in turn here.
+    for (auto& worker : workers) {
+        if (!worker.alive)
+            continue;
+        render_hello hello;
+        if (!read_all(worker.from, &hello, sizeof(hello))) {
+            lost(worker, "exited before it was ready");
+            continue;
+        }
+        if (std::memcmp(hello.magic, render_hello_magic, sizeof(hello.magic)) != 0 || hello.width != film.width
+            || hello.height != film.height || hello.samples_per_pixel != cam.samples_per_pixel
+            || hello.max_depth != cam.max_depth || hello.sampling != static_cast<int32_t>(cam.sampling)
+            || hello.seed != cam.seed || hello.scene_hash != cam.scene_hash) {
+            lost(worker, "has a different scene or settings");
+            continue;
+        }
+        hand_out(worker);
+    }
+
+    std::vector<pollfd> polled;
+    std::vector<worker_process*> polled_workers;
+    framebuffer piece;
+    while (finished < jobs.size()) {
+        // Anyone idle picks up what a dead worker left behind.
+        for (auto& worker : workers) {
+            if (worker.alive && worker.job < 0 && !waiting.empty())
+                hand_out(worker);
+        }
+
+        polled.clear();
+        polled_workers.clear();
+        for (auto& worker : workers) {
+            if (worker.alive && worker.job >= 0) {
+                polled.push_back(pollfd{worker.from, POLLIN, 0});
+                polled_workers.push_back(&worker);
+            }
+        }
+        if (polled.empty())
+            break;
+        if (::poll(polled.data(), polled.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (size_t k = 0; k < polled.size(); k++) {
+            if (polled[k].revents == 0)
+                continue;
+            worker_process& worker = *polled_workers[k];
+            const render_job& job = jobs[static_cast<size_t>(worker.job)];
+            render_job echo;
+            if (!read_all(worker.from, &echo, sizeof(echo))) {
+                lost(worker, "died");
+                continue;
+            }
+            if (std::memcmp(&echo, &job, sizeof(job)) != 0) {
+                lost(worker, "sent back the wrong region");
+                continue;
+            }
+            piece.resize(job.x1 - job.x0, job.y1 - job.y0);
+            if (!read_region(worker.from, piece)) {
+                lost(worker, "died");
+                continue;
+            }
+            cam.add_region(job.x0, job.y0, piece);
+            finished++;
+            std::clog << "\rRegions remaining: " << (jobs.size() - finished) << ' ' << std::flush;
+            hand_out(worker);
+        }
+    }
+
+    if (finished < jobs.size()) {
+        std::cerr << "\nNo workers left, rendering the last " << (jobs.size() - finished) << " regions here\n";
+        for (auto& worker : workers) {
+            if (worker.alive && worker.job >= 0)
+                waiting.push_back(worker.job);
+        }
+        for (int k : waiting) {
+            const render_job& job = jobs[static_cast<size_t>(k)];
+            cam.render_region(job.x0, job.y0, job.x1, job.y1, world);
+        }
+    }
+
+    const render_job stop = {0, 0, 0, 0};
+    for (auto& worker : workers) {
+        if (worker.alive)
+            write_all(worker.to, &stop, sizeof(stop));
+        retire_worker(worker, false);
+    }
+    std::signal(SIGPIPE, old_sigpipe);
+
+    cam.finish_frame(world);
+    std::clog << "\rDone. Used render_distributed with " << worker_count << " workers          \n";
+}
+
+#else
+
+//No fork() or pipes here, so one process does it all.
+inline int serve_render_jobs(camera&, const hittable&, int = 0, int = 1) {
+    std::cerr << "Workers need fork() and pipes, which this platform doesn't have\n";
+    return 1;
+}
+
+inline void render_distributed(camera& cam, const hittable& world, const std::vector<std::string>&, int, int = 64) {
+    std::cerr << "Workers need fork() and pipes, which this platform doesn't have. Rendering here instead.\n";
+    cam.render2(world);
+}
+
+#endif //RT_HAS_PROCESSES
+
+#endif //DISTRIBUTED_H
@@ -0,0 +1,245 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "common_constants.h"
+
+#include "color.h"
+#include "image_reader.h"
+#include "sampler.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+//Environment lighting: an HDR photo of everything around a point, wrapped round the scene as its sky. A ray that
+//escapes picks up whatever the photo shows in its direction.
+//
+//The image is a latitude-longitude map (equirectangular, the usual layout for HDR panoramas). The middle of it looks
+//down -z, the top row straight up, and it goes round to +x at three quarters of the way across.
+//
+//Bouncing into the bright bits by chance is what makes an environment lit render noisy: a sun is a few pixels of a
+//big map holding most of its light. So the camera also sends a shadow ray in a direction picked from the map itself,
+//as often as each pixel is bright (camera::sample_lights), through alias tables (Walker, with Vose's way of building
+//them). Those take one random number per pick however big the map is: a row from one table, then a pixel from that
+//row's. The rows' tables don't depend on each other, so they're built in parallel on a thread pool.
+
+class environment_map {
+public:
+    //Load an image (see image_reader.h) to light the scene with. Its pixels are multiplied by `intensity` and the
+    //whole map turned `rotation` degrees around the y axis (turning the sun round to where it's wanted).
+    bool load(const std::string& path, double intensity, double rotation, thread_pool& pool, std::string& error) {
+        float_image image;
+        if (!load_float_image(path, image, error))
+            return false;
+        build(std::move(image), intensity, rotation, pool);
+        return true;
+    }
+
+    //The same from an image already in memory.
+    void build(float_image image, double intensity, double rotation, thread_pool& pool) {
+        width = image.width;
+        height = image.height;
+        texels = std::move(image.rgb);
+        for (auto& t : texels)
+            t = static_cast<float>(t * intensity);
+        double angle = degrees_to_radians(rotation);
+        turn_cos = std::cos(angle);
+        turn_sin = std::sin(angle);
+
+        // How likely each pixel is to be picked: its brightness times the solid angle it covers, which shrinks
+        // towards the poles as sin(theta). Rows first, each row's total for the table that picks the row.
+        std::vector<float> weights(static_cast<size_t>(width) * height);
+        std::vector<double> row_totals(height);
+        pool.parallel_for(height, [&](int j) {
+            double sin_theta = std::sin(pi * (j + 0.5) / height);
+            double total = 0;
+            for (int i = 0; i < width; i++) {
+                const float* t = texel(i, j);
+                double w = std::max(0.0, double(luminance(color(t[0], t[1], t[2])))) * sin_theta;
+                weights[static_cast<size_t>(j) * width + i] = static_cast<float>(w);
+                total += w;
+            }
+            row_totals[j] = total;
+        });
+
+        double total = 0;
+        for (double t : row_totals)
+            total += t;
+        sum = total;
+        rows.assign(height, alias_entry());
+        columns.assign(static_cast<size_t>(width) * height, alias_entry());
+        if (total <= 0)
+            return; // All black. Nothing to aim at, sample() always says no.
+
+        // A pixel's pdf over the image (as u, v in [0,1)^2) is its share of the total times the pixel count.
+        double pixel_scale = double(width) * height / total;
+        {
+            std::vector<double> scratch(row_totals);
+            std::vector<float> pdfs(height);
+            for (int j = 0; j < height; j++)
+                pdfs[j] = static_cast<float>(row_totals[j] / total * height);
+            build_alias(scratch.data(), pdfs.data(), height, rows.data());
+        }
+        pool.parallel_for(height, [&](int j) {
+            if (row_totals[j] <= 0)
+                return;
+            thread_local std::vector<double> scratch;
+            thread_local std::vector<float> pdfs;
+            scratch.resize(width);
+            pdfs.resize(width);
+            const float* w = &weights[static_cast<size_t>(j) * width];
+            for (int i = 0; i < width; i++) {
+                scratch[i] = w[i];
+                pdfs[i] = static_cast<float>(w[i] * pixel_scale);
+            }
+            build_alias(scratch.data(), pdfs.data(), width, &columns[static_cast<size_t>(j) * width]);
+        });
+    }
+
+    bool empty() const { return texels.empty(); }
+
+    //What the map shows in `direction`.
+    color lookup(const vec3& direction) const {
+        size_t p = pixel_of(direction);
+        const float* t = &texels[3 * p];
+        return color(t[0], t[1], t[2]);
+    }
+
+    //A direction picked as often as the map is bright there, with the light it shows and the pdf of picking it (per
+    //steradian). u.x picks the column and u.y the row. False if the map is black all over.
+    bool sample(sample2 u, vec3& direction, color& radiance, real& pdf) const {
+        if (sum <= 0)
+            return false;
+        double fy, fx;
+        float row_pdf, uv_pdf;
+        int j = pick(rows.data(), height, u.y, fy, row_pdf);
+        int i = pick(&columns[static_cast<size_t>(j) * width], width, u.x, fx, uv_pdf);
+        // Rounding in build_alias can leave a black pixel (or a black row's empty table) keeping its own slot.
+        if (uv_pdf <= 0)
+            return false;
+
+        // Anywhere in the pixel. What's left of each random number after picking with it is as good as a new one.
+        double theta = pi * (j + fy) / height;
+        double phi = 2 * pi * ((i + fx) / width - 0.5);
+        double sin_theta = std::sin(theta);
+        if (sin_theta <= 0)
+            return false;
+        vec3 local(sin_theta * std::sin(phi), std::cos(theta), -sin_theta * std::cos(phi));
+        direction = to_world(local);
+
+        // uv_pdf is over the image, which covers 2 pi by pi radians, squashed by sin(theta) into solid angle.
+        const float* t = texel(i, j);
+        radiance = color(t[0], t[1], t[2]);
+        pdf = static_cast<real>(uv_pdf / (2 * pi * pi * sin_theta));
+        return true;
+    }
+
+    //The pdf sample() has for `direction`. For weighting a bounce that flew off into the sky against it.
+    real pdf(const vec3& direction) const {
+        if (sum <= 0)
+            return 0;
+        vec3 local = to_local(direction);
+        double length = local.length();
+        double sin_theta = std::sqrt(std::max(0.0, 1 - (local.y() / length) * (local.y() / length)));
+        if (sin_theta <= 0)
+            return 0;
+        return static_cast<real>(columns[pixel_of(direction)].pdf / (2 * pi * pi * sin_theta));
+    }
+
+private:
+    //One slot of an alias table. Landing in slot k picks k with probability `keep` and `alias` otherwise. The pdfs
+    //of both sit in the slot as well, so a pick reads this and nothing else: 16 bytes, four to a cache line.
+    struct alias_entry {
+        float keep = 1;
+        uint32_t alias = 0;
+        float pdf = 0;       // Of slot k's own pixel (or row), as a density over the image.
+        float alias_pdf = 0; // Of the alias's.
+    };
+
+    int width = 0, height = 0;
+    std::vector<float> texels;         // 3 per pixel, rows top to bottom, already times the intensity.
+    std::vector<alias_entry> rows;     // Picks a row, by each row's share of the light.
+    std::vector<alias_entry> columns;  // Then a pixel within it: a table per row, one after the other.
+    double sum = 0;
+    double turn_cos = 1, turn_sin = 0;
+
+    const float* texel(int i, int j) const { return &texels[3 * (static_cast<size_t>(j) * width + i)]; }
+
+    //Vose's method: every slot gets filled to exactly the average, topping up the ones below it from the ones above.
+    //`weights` gets used up as it goes.
+    static void build_alias(double* weights, const float* pdfs, int n, alias_entry* table) {
+        double total = 0;
+        for (int k = 0; k < n; k++)
+            total += weights[k];
+        std::vector<int> small, large;
+        small.reserve(n);
+        large.reserve(n);
+        for (int k = 0; k < n; k++) {
+            weights[k] *= n / total;
+            (weights[k] < 1 ? small : large).push_back(k);
+        }
+        while (!small.empty() && !large.empty()) {
+            int less = small.back(), more = large.back();
+            small.pop_back();
+            table[less].keep = static_cast<float>(weights[less]);
+            table[less].alias = static_cast<uint32_t>(more);
+            weights[more] -= 1 - weights[less];
+            if (weights[more] < 1) {
+                large.pop_back();
+                small.push_back(more);
+            }
+        }
+        // Whatever's left is 1 give or take rounding.
+        for (int k : small)
+            table[k] = alias_entry{1, static_cast<uint32_t>(k)};
+        for (int k : large)
+            table[k] = alias_entry{1, static_cast<uint32_t>(k)};
+        for (int k = 0; k < n; k++) {
+            table[k].pdf = pdfs[k];
+            table[k].alias_pdf = pdfs[table[k].alias];
+        }
+    }
+
+    //Slot u * n of table, then the slot or its alias, with the pdf of whichever it was. `rest` is what's left of u,
+    //spread back over [0, 1).
+    static int pick(const alias_entry* table, int n, double u, double& rest, float& pdf) {
+        double x = u * n;
+        int k = std::min(static_cast<int>(x), n - 1);
+        double f = std::min(x - k, 1.0);
+        const alias_entry& e = table[k];
+        if (f < e.keep) {
+            rest = f / e.keep;
+            pdf = e.pdf;
+            return k;
+        }
+        rest = std::min((f - e.keep) / (1 - e.keep), 1.0);
+        pdf = e.alias_pdf;
+        return static_cast<int>(e.alias);
+    }
+
+    size_t pixel_of(const vec3& direction) const {
+        vec3 local = to_local(direction);
+        double length = local.length();
+        double y = std::clamp(local.y() / length, -1.0, 1.0);
+        double u = 0.5 + std::atan2(local.x(), -local.z()) / (2 * pi);
+        double v = std::acos(y) / pi;
+        int i = std::clamp(static_cast<int>(u * width), 0, width - 1);
+        int j = std::clamp(static_cast<int>(v * height), 0, height - 1);
+        return static_cast<size_t>(j) * width + i;
+    }
+
+    //The map is turned by `rotation` around y: world = turn(local).
+    vec3 to_world(const vec3& d) const {
+        return vec3(turn_cos * d.x() + turn_sin * d.z(), d.y(), -turn_sin * d.x() + turn_cos * d.z());
+    }
+
+    vec3 to_local(const vec3& d) const {
+        return vec3(turn_cos * d.x() - turn_sin * d.z(), d.y(), turn_sin * d.x() + turn_cos * d.z());
+    }
+};
+
+#endif //ENVIRONMENT_H
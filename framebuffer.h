@@ -0,0 +1,119 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "color.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+//Where rendered samples pile up. One contiguous block of floats, 3 per pixel, rows top to bottom.
+//Each pixel holds the SUM of its samples plus how many samples went into it, and the average is only worked out when
+//the image gets written. That way samples can keep being added later (more passes, more machines) without
+//anything having to un-average first.
+class framebuffer {
+public:
+    int width  = 0;
+    int height = 0;
+    std::vector<float>    rgb;     // Summed linear color.
+    std::vector<uint32_t> samples; // Number of samples summed into each pixel.
+    std::vector<float>    lum_sq;  // Sum of each sample's luminance squared. With rgb that gives the pixel's variance.
+    bool wrap_rows = false;        // Only `height` rows are kept and image row j lives in row j % height. See
+                                   // resize_wrapped().
+
+    framebuffer() {}
+    framebuffer(int w, int h) { resize(w, h); }
+
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        wrap_rows = false;
+        rgb.assign(static_cast<size_t>(w) * h * 3, 0.0f);
+        samples.assign(static_cast<size_t>(w) * h, 0);
+        lum_sq.assign(static_cast<size_t>(w) * h, 0.0f);
+    }
+
+    //Room for only `rows` rows of a taller image, reused round and round: whoever writes rows out clears them
+    //(clear_rows) before the rows `rows` further down land on top of them. Memory stays the same however tall the
+    //image is. For streaming (camera::stream_output).
+    void resize_wrapped(int w, int rows) {
+        width = w;
+        height = rows;
+        rgb.assign(static_cast<size_t>(w) * rows * 3, 0.0f);
+        samples.assign(static_cast<size_t>(w) * rows, 0);
+        lum_sq.assign(static_cast<size_t>(w) * rows, 0.0f);
+        rgb.shrink_to_fit();
+        samples.shrink_to_fit();
+        lum_sq.shrink_to_fit();
+        wrap_rows = true;
+    }
+
+    //Zero image rows [first, first + count).
+    void clear_rows(int first, int count) {
+        for (int j = first; j < first + count; j++) {
+            auto p = index(0, j);
+            std::fill_n(&rgb[3*p], 3 * width, 0.0f);
+            std::fill_n(&samples[p], width, 0);
+            std::fill_n(&lum_sq[p], width, 0.0f);
+        }
+    }
+
+    void clear() {
+        std::fill(rgb.begin(), rgb.end(), 0.0f);
+        std::fill(samples.begin(), samples.end(), 0);
+        std::fill(lum_sq.begin(), lum_sq.end(), 0.0f);
+    }
+
+    size_t pixel_count() const { return samples.size(); }
+
+    size_t index(int i, int j) const { return static_cast<size_t>(wrap_rows ? j % height : j) * width + i; }
+
+    //Add a sum of `count` samples to pixel i,j. sum_lum_sq is the sum of those samples' luminance squared.
+    void accumulate(int i, int j, const color& sum, uint32_t count, float sum_lum_sq) {
+        auto p = index(i, j);
+        rgb[3*p + 0] += static_cast<float>(sum.x());
+        rgb[3*p + 1] += static_cast<float>(sum.y());
+        rgb[3*p + 2] += static_cast<float>(sum.z());
+        samples[p] += count;
+        lum_sq[p] += sum_lum_sq;
+    }
+
+    //Pixels [x0,x1) x [y0,y1) as a framebuffer of their own.
+    framebuffer region(int x0, int y0, int x1, int y1) const {
+        framebuffer piece(x1 - x0, y1 - y0);
+        for (int j = y0; j < y1; j++) {
+            auto from = index(x0, j);
+            auto to = piece.index(0, j - y0);
+            std::copy_n(&rgb[3*from], 3 * piece.width, &piece.rgb[3*to]);
+            std::copy_n(&samples[from], piece.width, &piece.samples[to]);
+            std::copy_n(&lum_sq[from], piece.width, &piece.lum_sq[to]);
+        }
+        return piece;
+    }
+
+    //Add a region (see region()) back in with its top left corner at x0,y0.
+    void add(int x0, int y0, const framebuffer& piece) {
+        for (int j = 0; j < piece.height; j++) {
+            for (int i = 0; i < piece.width; i++) {
+                auto from = piece.index(i, j);
+                auto to = index(x0 + i, y0 + j);
+                for (int c = 0; c < 3; c++)
+                    rgb[3*to + c] += piece.rgb[3*from + c];
+                samples[to] += piece.samples[from];
+                lum_sq[to] += piece.lum_sq[from];
+            }
+        }
+    }
+
+    //The averaged (anti-aliased) linear color of pixel i,j.
+    color average(int i, int j) const {
+        auto p = index(i, j);
+        auto n = samples[p];
+        if (n == 0)
+            return color(0,0,0);
+        auto scale = 1.0 / n;
+        return color(rgb[3*p + 0] * scale, rgb[3*p + 1] * scale, rgb[3*p + 2] * scale);
+    }
+};
+
+#endif //FRAMEBUFFER_H
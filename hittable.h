@@ -3,6 +3,9 @@
 
 #include "ray.h"
 #include "common_constants.h"
+#include "aabb.h"
+
+#include <type_traits>
 
 class material;
 
@@ -10,8 +13,8 @@ class hit_record {
 public:
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat;
-    double t;
+    const material* mat; //Not owned. The scene's material_table keeps materials alive, so hits just point at them.
+    real t;
     bool front_face;
 
     void set_face_normal(const ray& r, const vec3& outward_normal) {
@@ -23,6 +26,10 @@ public:
     }
 };
 
+//hit_records get copied around on every intersection. A shared_ptr in here used to mean an atomic refcount bump
+//(on a cache line every thread shares) each time. Keep it plain data.
+static_assert(std::is_trivially_copyable<hit_record>::value, "hit_record should stay trivially copyable");
+
 class hittable {
 public:
     virtual ~hittable() = default;
@@ -30,6 +37,9 @@ public:
     //Instead of loading in two doubles to find out what two points define our ray we use the (now created) interval.h
     //class 'interval' to do so.
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
+
+    //The box that fully contains the object. The BVH sorts objects by these boxes.
+    virtual aabb bounding_box() const = 0;
 };
 
 #endif
\ No newline at end of file
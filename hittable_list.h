@@ -17,10 +17,11 @@ public:
     hittable_list() {}
     hittable_list(shared_ptr<hittable> object) { add(object); }
 
-    void clear() { objects.clear(); }
+    void clear() { objects.clear(); bbox = aabb(); }
 
     void add(shared_ptr<hittable> object) {
         objects.push_back(object);
+        bbox = aabb(bbox, object->bounding_box());
     }
 
     //We used to have two doubles to find out what two points define the ray. We use the (now created) interval.h
@@ -39,6 +40,11 @@ public:
         }
         return hit_anything;
     }
+
+    aabb bounding_box() const override { return bbox; }
+
+private:
+    aabb bbox;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,254 @@
+#ifndef IMAGE_READER_H
+#define IMAGE_READER_H
+
+#include "mapped_file.h"
+
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+//Reading HDR images back in, for environment maps (environment.h). The two float formats anything can write:
+//
+//  PFM    portable float map, what image_writer.h writes. Raw 32 bit floats, 3 channels ("PF") or grey ("Pf").
+//  RGBE   Radiance .hdr. 4 bytes a pixel (a shared exponent and three mantissas), usually run length encoded.
+//
+//Which one a file is goes by its first bytes, not its name. Like the other loaders these read straight out of a
+//mapped_file and return false with the reason in `error` if something's wrong.
+
+//Linear float color, 3 per pixel, rows top to bottom.
+struct float_image {
+    int width = 0;
+    int height = 0;
+    std::vector<float> rgb;
+};
+
+//Reads the whitespace separated words of a header one at a time.
+class header_reader {
+public:
+    header_reader(const char* begin, const char* end) : pos(begin), end(end) {}
+
+    std::string_view word() {
+        while (pos < end && is_space(*pos))
+            pos++;
+        const char* start = pos;
+        while (pos < end && !is_space(*pos))
+            pos++;
+        return std::string_view(start, static_cast<size_t>(pos - start));
+    }
+
+    bool integer(int& out) {
+        auto w = word();
+        auto result = std::from_chars(w.data(), w.data() + w.size(), out);
+        return !w.empty() && result.ec == std::errc() && result.ptr == w.data() + w.size();
+    }
+
+    bool number(double& out) {
+        auto w = word();
+        auto result = std::from_chars(w.data(), w.data() + w.size(), out);
+        return !w.empty() && result.ec == std::errc() && result.ptr == w.data() + w.size();
+    }
+
+    //The rest of the current line, not counting its end.
+    std::string_view line() {
+        const char* start = pos;
+        while (pos < end && *pos != '\n')
+            pos++;
+        std::string_view text(start, static_cast<size_t>(pos - start));
+        if (pos < end)
+            pos++;
+        return text;
+    }
+
+    //Past exactly one whitespace character, the one that ends a PFM header.
+    bool end_of_header() {
+        if (pos >= end || !is_space(*pos))
+            return false;
+        pos++;
+        return true;
+    }
+
+    const char* position() const { return pos; }
+
+private:
+    const char* pos;
+    const char* end;
+
+    static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+};
+
+inline bool parse_pfm(const char* data, size_t size, float_image& image, std::string& error) {
+    header_reader in(data, data + size);
+    auto magic = in.word();
+    int channels = magic == "PF" ? 3 : magic == "Pf" ? 1 : 0;
+    double scale;
+    if (channels == 0 || !in.integer(image.width) || !in.integer(image.height) || !in.number(scale)
+        || !in.end_of_header() || image.width <= 0 || image.height <= 0) {
+        error = "not a PFM file";
+        return false;
+    }
+
+    // Checked a row at a time: width * height * channels * 4 can be past what a size_t holds.
+    size_t row_bytes = static_cast<size_t>(image.width) * channels * sizeof(float);
+    const char* body = in.position();
+    if (static_cast<size_t>(data + size - body) / row_bytes < static_cast<size_t>(image.height)) {
+        error = "file is cut short";
+        return false;
+    }
+
+    // A negative scale means little endian, positive big endian. Rows are stored bottom to top.
+    uint16_t probe = 1;
+    uint8_t low_byte_first;
+    std::memcpy(&low_byte_first, &probe, 1);
+    bool swap = (scale < 0) != (low_byte_first == 1);
+    image.rgb.resize(static_cast<size_t>(image.width) * image.height * 3);
+    size_t row_values = static_cast<size_t>(image.width) * channels;
+    std::vector<uint32_t> row(row_values);
+    for (int j = 0; j < image.height; j++) {
+        std::memcpy(row.data(), body + (image.height - 1 - j) * row_values * sizeof(float), row_values * sizeof(float));
+        float* out = image.rgb.data() + static_cast<size_t>(j) * image.width * 3;
+        for (int i = 0; i < image.width; i++) {
+            for (int c = 0; c < 3; c++) {
+                uint32_t bits = row[static_cast<size_t>(i) * channels + (channels == 3 ? c : 0)];
+                if (swap)
+                    bits = (bits >> 24) | ((bits >> 8) & 0xff00) | ((bits << 8) & 0xff0000) | (bits << 24);
+                float value;
+                std::memcpy(&value, &bits, sizeof(value));
+                out[3*i + c] = std::isfinite(value) && value > 0 ? value : 0.0f; // No light out of NaNs.
+            }
+        }
+    }
+    return true;
+}
+
+//One scanline of RGBE pixels starting at p, into `row` (4 bytes a pixel). Handles all three ways a scanline can be
+//stored: flat, the old run length encoding (a 1,1,1 pixel repeats the one before), and the new one, where the line
+//starts 2,2 and then each of the four bytes of a pixel has its own runs. False if it runs off the end.
+inline bool read_rgbe_scanline(const uint8_t*& p, const uint8_t* end, int width, uint8_t* row) {
+    if (width >= 8 && width < 0x8000 && end - p >= 4 && p[0] == 2 && p[1] == 2 && ((p[2] << 8) | p[3]) == width) {
+        p += 4;
+        for (int c = 0; c < 4; c++) {
+            for (int i = 0; i < width;) {
+                if (p >= end)
+                    return false;
+                int count = *p++;
+                if (count > 128) {
+                    count -= 128;
+                    if (p >= end || count > width - i)
+                        return false;
+                    for (uint8_t value = *p++; count-- > 0; i++)
+                        row[4*i + c] = value;
+                } else {
+                    if (count == 0 || count > width - i || end - p < count)
+                        return false;
+                    for (; count-- > 0; i++)
+                        row[4*i + c] = *p++;
+                }
+            }
+        }
+        return true;
+    }
+
+    int shift = 0;
+    for (int i = 0; i < width;) {
+        if (end - p < 4)
+            return false;
+        if (p[0] == 1 && p[1] == 1 && p[2] == 1) {
+            // Each repeat in a row counts 256 times the one before, so a fourth would be past what an int holds
+            // (and any real line's width).
+            if (i == 0 || shift > 16)
+                return false;
+            int count = p[3] << shift;
+            if (count > width - i)
+                return false;
+            for (; count-- > 0; i++)
+                std::memcpy(row + 4*i, row + 4*(i - 1), 4);
+            shift += 8;
+        } else {
+            std::memcpy(row + 4*i, p, 4);
+            i++;
+            shift = 0;
+        }
+        p += 4;
+    }
+    return true;
+}
+
+//Most pixels parse_rgbe takes: 16384 x 8192, the biggest panoramas there are.
+constexpr size_t max_rgbe_pixels = size_t(1) << 27;
+
+inline bool parse_rgbe(const char* data, size_t size, float_image& image, std::string& error) {
+    header_reader in(data, data + size);
+    auto first = in.line();
+    if (first.substr(0, 2) != "#?") {
+        error = "not a Radiance HDR file";
+        return false;
+    }
+    // Header lines up to an empty one. Only the format matters: EXPOSURE and the like are ignored and the pixels
+    // taken as they're stored.
+    while (true) {
+        auto text = in.line();
+        if (text.empty() || text == "\r")
+            break;
+        if (text.substr(0, 7) == "FORMAT=" && text.substr(7, 15) != "32-bit_rle_rgbe") {
+            error = "only RGBE Radiance files are supported, not " + std::string(text.substr(7));
+            return false;
+        }
+    }
+    // Rows top to bottom, pixels left to right. The other orientations are allowed by the format but nobody uses
+    // them.
+    if (in.word() != "-Y" || !in.integer(image.height) || in.word() != "+X" || !in.integer(image.width)
+        || image.width <= 0 || image.height <= 0) {
+        error = "expected a '-Y height +X width' resolution line";
+        return false;
+    }
+    in.line();
+
+    // Every scanline takes at least 4 bytes, and no HDR map has more pixels than max_rgbe_pixels. Past that the
+    // size is made up, and resizing to it would be gigabytes (or bad_alloc) from a few bytes of file.
+    auto p = reinterpret_cast<const uint8_t*>(in.position());
+    auto end = reinterpret_cast<const uint8_t*>(data + size);
+    if (static_cast<size_t>(end - p) / 4 < static_cast<size_t>(image.height)
+        || static_cast<size_t>(image.width) * image.height > max_rgbe_pixels) {
+        error = "the resolution line doesn't fit the file";
+        return false;
+    }
+    image.rgb.resize(static_cast<size_t>(image.width) * image.height * 3);
+    std::vector<uint8_t> row(static_cast<size_t>(image.width) * 4);
+    for (int j = 0; j < image.height; j++) {
+        if (!read_rgbe_scanline(p, end, image.width, row.data())) {
+            error = "bad or cut short scanline " + std::to_string(j);
+            return false;
+        }
+        float* out = image.rgb.data() + static_cast<size_t>(j) * image.width * 3;
+        for (int i = 0; i < image.width; i++) {
+            const uint8_t* pixel = &row[4*i];
+            // Each mantissa byte is the middle of its range, times 2^exponent (stored with 128 added).
+            float scale = pixel[3] ? std::ldexp(1.0f, pixel[3] - (128 + 8)) : 0.0f;
+            for (int c = 0; c < 3; c++)
+                out[3*i + c] = pixel[3] ? (pixel[c] + 0.5f) * scale : 0.0f;
+        }
+    }
+    return true;
+}
+
+//Load a PFM or Radiance HDR file into `image`.
+inline bool load_float_image(const std::string& path, float_image& image, std::string& error) {
+    mapped_file file;
+    if (!file.open(path)) {
+        error = "can't open " + path;
+        return false;
+    }
+    bool rgbe = file.size() >= 2 && file.data()[0] == '#' && file.data()[1] == '?';
+    bool ok = rgbe ? parse_rgbe(file.data(), file.size(), image, error)
+                   : parse_pfm(file.data(), file.size(), image, error);
+    if (!ok)
+        error = path + ": " + error;
+    return ok;
+}
+
+#endif //IMAGE_READER_H
@@ -0,0 +1,250 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+//Turning the framebuffer into an actual file.
+//The old way was three std::to_string calls and some string gluing per pixel, then P3 text through std::cout. Now
+//the whole file gets built in memory as bytes and written in one go.
+
+//Divide each of `count` pixels by its sample count. Writes 3 floats per pixel of plain linear color into `dst`.
+inline void resolve_linear(const float* src, const uint32_t* samples, size_t count, float* dst) {
+    for (size_t p = 0; p < count; p++) {
+        auto n = samples[p];
+        float scale = n > 0 ? 1.0f / static_cast<float>(n) : 0.0f;
+        dst[3*p + 0] = src[3*p + 0] * scale;
+        dst[3*p + 1] = src[3*p + 1] * scale;
+        dst[3*p + 2] = src[3*p + 2] * scale;
+    }
+}
+
+inline void resolve_linear(const framebuffer& fb, std::vector<float>& out) {
+    out.resize(fb.rgb.size());
+    resolve_linear(fb.rgb.data(), fb.samples.data(), fb.pixel_count(), out.data());
+}
+
+//Gamma correct (linear_to_gamma, the square root) and squash down to 8 bits. Works on a flat array of floats, four
+//at a time with SSE where we have it. Every x86-64 compiler has SSE2 so that's nearly always.
+inline void gamma_quantize(const float* linear, size_t count, uint8_t* out) {
+    size_t k = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 top  = _mm_set1_ps(0.999f);
+    const __m128 full = _mm_set1_ps(256.0f);
+    for (; k + 4 <= count; k += 4) {
+        __m128 v = _mm_loadu_ps(linear + k);
+        v = _mm_sqrt_ps(_mm_max_ps(v, zero));          // linear_to_gamma
+        v = _mm_mul_ps(_mm_min_ps(v, top), full);       // clamp to [0, 0.999] and scale
+        __m128i q = _mm_cvttps_epi32(v);                // truncate like static_cast<int>
+        q = _mm_packs_epi32(q, q);
+        q = _mm_packus_epi16(q, q);
+        int packed = _mm_cvtsi128_si32(q);
+        std::memcpy(out + k, &packed, 4);
+    }
+#endif
+    for (; k < count; k++) {
+        float v = std::sqrt(std::max(linear[k], 0.0f));
+        out[k] = static_cast<uint8_t>(256.0f * std::min(v, 0.999f));
+    }
+}
+
+//A file format. encode() builds the complete file in memory, save_image() does the writing.
+class image_writer {
+public:
+    virtual ~image_writer() = default;
+    virtual std::vector<char> encode(const framebuffer& fb) const = 0;
+};
+
+//Binary PPM (P6). Same as the old P3 files but bytes instead of text, about a quarter the size.
+class ppm_writer : public image_writer {
+public:
+    std::vector<char> encode(const framebuffer& fb) const override {
+        std::string header = "P6\n" + std::to_string(fb.width) + ' ' + std::to_string(fb.height) + "\n255\n";
+
+        std::vector<float> linear;
+        resolve_linear(fb, linear);
+
+        std::vector<char> file(header.size() + linear.size());
+        std::memcpy(file.data(), header.data(), header.size());
+        gamma_quantize(linear.data(), linear.size(), reinterpret_cast<uint8_t*>(file.data() + header.size()));
+        return file;
+    }
+};
+
+//Portable float map (PFM). Keeps the linear HDR floats as they are, nothing clamped or gamma corrected.
+//A negative scale in the header means little endian, and rows go bottom to top.
+class pfm_writer : public image_writer {
+public:
+    std::vector<char> encode(const framebuffer& fb) const override {
+        std::string header = "PF\n" + std::to_string(fb.width) + ' ' + std::to_string(fb.height) + "\n-1.0\n";
+
+        std::vector<float> linear;
+        resolve_linear(fb, linear);
+
+        size_t row_bytes = static_cast<size_t>(fb.width) * 3 * sizeof(float);
+        std::vector<char> file(header.size() + row_bytes * fb.height);
+        std::memcpy(file.data(), header.data(), header.size());
+        char* body = file.data() + header.size();
+        for (int j = 0; j < fb.height; j++) {
+            const float* row = linear.data() + static_cast<size_t>(fb.height - 1 - j) * fb.width * 3;
+            std::memcpy(body + j * row_bytes, row, row_bytes);
+        }
+        return file;
+    }
+};
+
+//Debugging adaptive sampling: a binary PPM of how many samples each pixel got instead of its color. Black is none,
+//then blue through green to red at the most samples any pixel took.
+class sample_count_writer : public image_writer {
+public:
+    std::vector<char> encode(const framebuffer& fb) const override {
+        std::string header = "P6\n" + std::to_string(fb.width) + ' ' + std::to_string(fb.height) + "\n255\n";
+
+        uint32_t most = 1;
+        for (auto n : fb.samples)
+            most = std::max(most, n);
+
+        std::vector<char> file(header.size() + fb.pixel_count() * 3);
+        std::memcpy(file.data(), header.data(), header.size());
+        auto* out = reinterpret_cast<uint8_t*>(file.data() + header.size());
+        for (size_t p = 0; p < fb.pixel_count(); p++) {
+            float x = fb.samples[p] == 0 ? 0.0f : static_cast<float>(fb.samples[p]) / most;
+            float r = std::min(std::max(2*x - 1, 0.0f), 1.0f);
+            float g = std::min(std::max(1 - std::fabs(2*x - 1), 0.0f), 1.0f);
+            float b = fb.samples[p] == 0 ? 0.0f : std::min(std::max(1 - 2*x, 0.0f), 1.0f);
+            out[3*p + 0] = static_cast<uint8_t>(255 * r);
+            out[3*p + 1] = static_cast<uint8_t>(255 * g);
+            out[3*p + 2] = static_cast<uint8_t>(255 * b);
+        }
+        return file;
+    }
+};
+
+//Pick a writer from the file extension. ".pfm" is float, anything else is binary PPM.
+inline std::unique_ptr<image_writer> writer_for(const std::string& path) {
+    auto dot = path.rfind('.');
+    std::string ext = dot == std::string::npos ? "" : path.substr(dot);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+    if (ext == ".pfm")
+        return std::make_unique<pfm_writer>();
+    return std::make_unique<ppm_writer>();
+}
+
+//A binary PPM written a few rows at a time as they're finished, instead of in one go at the end (see
+//camera::stream_output). Only PPM: a PFM's rows go bottom to top, so none of it could go out before the last row.
+class ppm_stream {
+public:
+    ppm_stream() {}
+    ppm_stream(const ppm_stream&) = delete;
+    ppm_stream& operator=(const ppm_stream&) = delete;
+    ~ppm_stream() { close(); }
+
+    //"-" is stdout. False if the file can't be made.
+    bool open(const std::string& path, int width, int height) {
+        if (path == "-") {
+#ifdef _WIN32
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+            file = stdout;
+        } else {
+            file = std::fopen(path.c_str(), "wb");
+            if (!file)
+                return false;
+        }
+        std::string header = "P6\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n";
+        linear.resize(static_cast<size_t>(width) * 3);
+        bytes.resize(linear.size());
+        ok = std::fwrite(header.data(), 1, header.size(), file) == header.size();
+        return ok;
+    }
+
+    //Rows [first, first + count) of the image, from a framebuffer that may only hold some of its rows (see
+    //framebuffer::wrap_rows). Rows have to come in order, top to bottom.
+    bool write_rows(const framebuffer& fb, int first, int count) {
+        for (int j = first; j < first + count && ok; j++) {
+            auto p = fb.index(0, j);
+            resolve_linear(&fb.rgb[3*p], &fb.samples[p], static_cast<size_t>(fb.width), linear.data());
+            gamma_quantize(linear.data(), linear.size(), bytes.data());
+            ok = std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+        }
+        return ok;
+    }
+
+    //False if anything along the way failed to write.
+    bool close() {
+        if (!file)
+            return ok;
+        if (file == stdout)
+            ok = std::fflush(stdout) == 0 && ok;
+        else
+            ok = std::fclose(file) == 0 && ok;
+        file = nullptr;
+        return ok;
+    }
+
+private:
+    std::FILE* file = nullptr;
+    bool ok = false;
+    std::vector<float> linear;  // One row at a time.
+    std::vector<uint8_t> bytes;
+};
+
+//Whether output to `path` can be streamed with ppm_stream.
+inline bool can_stream_image(const std::string& path) {
+    return !path.empty() && dynamic_cast<const ppm_writer*>(writer_for(path).get()) != nullptr;
+}
+
+//Write bytes to a file in one go. "-" means stdout, for anyone still piping the output (./RayTracing - > image.ppm).
+inline bool write_file(const std::string& path, const std::vector<char>& bytes) {
+    if (path == "-") {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY); // Otherwise Windows "helpfully" turns \n into \r\n in our pixels.
+#endif
+        return std::fwrite(bytes.data(), 1, bytes.size(), stdout) == bytes.size() && std::fflush(stdout) == 0;
+    }
+
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    bool ok = std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    return std::fclose(file) == 0 && ok;
+}
+
+inline bool save_image(const framebuffer& fb, const std::string& path, const image_writer& writer) {
+    return write_file(path, writer.encode(fb));
+}
+
+inline bool save_image(const framebuffer& fb, const std::string& path) {
+    return save_image(fb, path, *writer_for(path));
+}
+
+//`path` with `suffix` put in front of its extension: "image.ppm" and "_albedo" make "image_albedo.ppm". No extension
+//and the suffix just goes on the end.
+inline std::string path_with_suffix(const std::string& path, const std::string& suffix) {
+    auto dot = path.find_last_of('.');
+    auto slash = path.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return path + suffix;
+    return path.substr(0, dot) + suffix + path.substr(dot);
+}
+
+#endif //IMAGE_WRITER_H
@@ -0,0 +1,136 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "common_constants.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "transform.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+//Instancing: the same geometry drawn many times, each copy moved, turned and scaled by its own transform. The
+//geometry (a mesh, a sphere, anything hittable) is stored once and every copy only costs a transform and a couple of
+//indices, so a forest of a million trees needs memory for one tree plus a small record per tree.
+//
+//Nothing is ever actually moved. The ray is moved into the object's own space instead (the inverse transform),
+//hits the untouched geometry there, and the hit comes back out. Only the inverse is kept: the hit point is found on
+//the original ray and normals need the inverse (transposed) anyway.
+
+//Hit `object` as seen through a transform. to_object is the inverse of the object's placement in the world. If mat
+//isn't null it replaces whatever material the object itself has.
+inline bool hit_transformed(const hittable& object, const transform& to_object, const material* mat,
+                            const ray& r, interval ray_t, hit_record& rec) {
+    // The direction isn't normalized afterwards so t means the same distance along both rays.
+    ray local(to_object.point(r.origin()), to_object.vector(r.direction()));
+    if (!object.hit(local, ray_t, rec))
+        return false;
+
+    rec.p = r.at(rec.t);
+    // The normal keeps its side: dot(inverse transpose * n, M * d) == dot(n, d), so front_face still holds.
+    rec.normal = unit_vector(to_object.normal_from_inverse(rec.normal));
+    if (mat)
+        rec.mat = mat;
+    return true;
+}
+
+//One placed copy of a shared object. Fine for a handful; for lots use instance_set.
+class instance : public hittable {
+public:
+    instance(std::shared_ptr<const hittable> _object, const transform& to_world, const material* _mat = nullptr)
+        : object(std::move(_object)), to_object(to_world.inverse()), mat(_mat)
+    {
+        bbox = to_world.box(object->bounding_box());
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        return hit_transformed(*object, to_object, mat, r, ray_t, rec);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+private:
+    std::shared_ptr<const hittable> object;
+    transform to_object;
+    const material* mat;
+    aabb bbox;
+};
+
+//Many placed copies of a few shared shapes, with a BVH over the copies. That's the top level of a two level
+//structure: the rays find their way to a few instances here, then each shape's own BVH (a triangle_mesh has one)
+//does the rest in the shape's space.
+//
+//add_shape() the geometry, add() the copies, build() once before rendering.
+class instance_set : public hittable {
+public:
+    uint32_t add_shape(std::shared_ptr<const hittable> shape) {
+        shape_boxes.push_back(shape->bounding_box());
+        shapes.push_back(std::move(shape));
+        return static_cast<uint32_t>(shapes.size() - 1);
+    }
+
+    void reserve(size_t n) {
+        instances.reserve(n);
+        boxes.reserve(n);
+    }
+
+    //Place a copy of shapes[shape]. The transform must be invertible (no zero scale).
+    void add(uint32_t shape, const transform& to_world, const material* mat = nullptr) {
+        instances.push_back(record{to_world.inverse(), shape, mat});
+        boxes.push_back(to_world.box(shape_boxes[shape]));
+    }
+
+    size_t size() const { return instances.size(); }
+    size_t shape_count() const { return shapes.size(); }
+
+    void build() {
+        // Instances are expensive to test (a transform and a whole BVH walk each) so leaves stay small.
+        tree.build(boxes, 2);
+
+        // Into leaf order, like triangle_mesh, so the leaves index the records directly.
+        std::vector<record> sorted;
+        sorted.reserve(instances.size());
+        for (int index : tree.prim_indices)
+            sorted.push_back(instances[static_cast<size_t>(index)]);
+        instances.swap(sorted);
+
+        tree.prim_indices.clear();
+        tree.prim_indices.shrink_to_fit();
+        boxes.clear();
+        boxes.shrink_to_fit();
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        return tree.traverse(r, ray_t, [&](int first, int count, interval& t) {
+            bool found = false;
+            for (int k = first; k < first + count; k++) {
+                const record& inst = instances[static_cast<size_t>(k)];
+                if (hit_transformed(*shapes[inst.shape], inst.to_object, inst.mat, r, t, rec)) {
+                    t.max = rec.t;
+                    found = true;
+                }
+            }
+            return found;
+        });
+    }
+
+    aabb bounding_box() const override { return tree.bounding_box(); }
+
+private:
+    struct record {
+        transform to_object;
+        uint32_t shape;
+        const material* mat;
+    };
+
+    std::vector<std::shared_ptr<const hittable>> shapes;
+    std::vector<aabb> shape_boxes;
+    std::vector<record> instances;
+    std::vector<aabb> boxes; // Only until build().
+    bvh_tree tree;
+};
+
+#endif //INSTANCE_H
@@ -1,27 +1,44 @@
 #ifndef INTERVAL_H
 #define INTERVAL_H
 
+#include "precision.h"
+
 class interval {
 public:
-    double min, max;
+    real min, max;
 
     interval() : min(+infinity), max(-infinity) {} // Default interval is empty
     //infinity is found in common_constants.h, which includes this file. In doing so we don't need to include
     //common_constants.h.
     
-    interval(double _min, double _max) : min(_min), max(_max) {}
+    interval(real _min, real _max) : min(_min), max(_max) {}
+
+    //The tightest interval that holds both of the given intervals. Used when merging bounding boxes.
+    interval(const interval& a, const interval& b)
+        : min(fmin(a.min, b.min)), max(fmax(a.max, b.max)) {}
+
+    real size() const {
+        return max - min;
+    }
+
+    //Pad the interval by delta (half on each side). Flat boxes break the slab test so this keeps them from being
+    //exactly zero width.
+    interval expand(real delta) const {
+        auto padding = delta/2;
+        return interval(min - padding, max + padding);
+    }
 
-    bool contains(double x) const {
+    bool contains(real x) const {
         return min <= x && x <= max;
     }
     
     //Does the variable 'x' fall between the min and max defined when we first created the interval.
-    bool surrounds(double x) const {
+    bool surrounds(real x) const {
         return min < x && x < max;
     }
     
     //Reduce whatever value we are looking at down to the limits of the interval.
-    double clamp(double x) const {
+    real clamp(real x) const {
         if (x < min) return min;
         if (x > max) return max;
         return x;
@@ -0,0 +1,161 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "common_constants.h"
+
+#include "color.h"
+#include "hittable.h"
+#include "material.h"
+#include "sampler.h"
+#include "sphere_set.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+//The lights in a scene, for aiming shadow rays at (next event estimation, see camera::sample_lights).
+//
+//A path that only finds light by bouncing into it finds a small bright lamp hardly ever, and when it does that one
+//sample is enormous: fireflies that take thousands of samples to average out. So at every diffuse bounce a light is
+//also picked and a ray sent straight at it. If nothing's in the way, its light counts then and there.
+//
+//Only spheres made of diffuse_light are in here. Anything else that glows (a mesh, an instance) still lights the
+//scene, just the slow way, by being bounced into.
+
+//Where a shadow ray should go to reach a light, and what it finds there if nothing's in the way.
+struct light_sample {
+    vec3 direction;   // Unit length.
+    real distance;    // To the light's surface along direction.
+    real pdf;         // Of picking this direction, per steradian, counting the odds of picking this light.
+    color emission;
+};
+
+class light_list {
+public:
+    //Sphere number `sphere` (counting sphere_set::add calls from 0) of `spheres` glows with `mat`. Spheres are read
+    //from the set each time, so a light moved by an animation is where it's drawn.
+    void add(const sphere_set& spheres, size_t sphere, real radius, const material* mat) {
+        set = &spheres;
+        lights.push_back(light{sphere, radius, mat});
+    }
+
+    //After the last add(). Brighter and bigger lights get picked more often: the odds go by how much light each one
+    //puts out (emission times surface area).
+    void build() {
+        cdf.resize(lights.size());
+        double total = 0;
+        for (size_t k = 0; k < lights.size(); k++) {
+            const light& l = lights[k];
+            total += std::max(double(luminance(l.mat->emitted())), 0.0) * l.radius * l.radius;
+            cdf[k] = total;
+        }
+        for (size_t k = 0; k < lights.size(); k++) {
+            // All black lights: pick any of them, none of them will add anything anyway.
+            cdf[k] = total > 0 ? cdf[k] / total : static_cast<double>(k + 1) / lights.size();
+            lights[k].odds = cdf[k] - (k > 0 ? cdf[k - 1] : 0.0);
+        }
+
+        by_material.clear();
+        for (size_t k = 0; k < lights.size(); k++)
+            by_material.emplace_back(lights[k].mat, static_cast<uint32_t>(k));
+        std::sort(by_material.begin(), by_material.end());
+    }
+
+    bool empty() const { return lights.empty(); }
+    size_t size() const { return lights.size(); }
+
+    //Pick a light and a direction towards it from `from`. `pick` chooses the light, `u` the direction: evenly over
+    //the cone of directions the light's sphere covers, so every direction sent out hits it. False if there's nothing
+    //to aim at (no lights, or `from` is inside the one picked).
+    bool sample(const point3& from, double pick, sample2 u, light_sample& out) const {
+        if (lights.empty())
+            return false;
+        size_t k = std::upper_bound(cdf.begin(), cdf.end(), pick) - cdf.begin();
+        if (k >= lights.size())
+            k = lights.size() - 1;
+        const light& l = lights[k];
+
+        point3 center = set->center(l.sphere);
+        vec3 to_center = center - from;
+        double distance_sq = to_center.length_squared();
+        double radius_sq = double(l.radius) * l.radius;
+        if (distance_sq <= radius_sq || l.odds <= 0)
+            return false;
+        double distance = std::sqrt(distance_sq);
+
+        // The cone: 1 - cos of its half angle, as sin^2 / (1 + cos) so it stays accurate for a lamp that's tiny and
+        // far away (where cos is 1 to within float precision). sin^2 of the angle drawn is worked out the same way.
+        double sin_sq_max = radius_sq / distance_sq;
+        double cos_max = std::sqrt(std::max(0.0, 1 - sin_sq_max));
+        double cap = sin_sq_max / (1 + cos_max);
+        double one_minus_cos = u.x * cap;
+        double sin_sq = one_minus_cos * (2 - one_minus_cos);
+        double cos_theta = 1 - one_minus_cos;
+        double sin_theta = std::sqrt(std::max(0.0, sin_sq));
+        double phi = 2 * pi * u.y;
+
+        vec3 w = to_center / distance;
+        vec3 a, b;
+        basis(w, a, b);
+        out.direction = unit_vector(sin_theta * std::cos(phi) * a + sin_theta * std::sin(phi) * b + cos_theta * w);
+        // The near crossing of the sphere along that direction.
+        double inside = std::sqrt(std::max(0.0, radius_sq - distance_sq * sin_sq));
+        out.distance = static_cast<real>(distance * cos_theta - inside);
+        out.pdf = static_cast<real>(l.odds / (2 * pi * cap));
+        out.emission = l.mat->emitted();
+        return true;
+    }
+
+    //The pdf sample() would have had for the direction from `from` to the light the hit `rec` landed on. 0 if that's
+    //not one of ours (something else glowing).
+    real pdf(const point3& from, const hit_record& rec) const {
+        auto range = std::equal_range(by_material.begin(), by_material.end(),
+                                      std::make_pair(rec.mat, uint32_t(0)),
+                                      [](const std::pair<const material*, uint32_t>& x,
+                                         const std::pair<const material*, uint32_t>& y) { return x.first < y.first; });
+        // Usually just the one sphere made of that material. If several are, the hit is on whichever one's surface
+        // it's on.
+        for (auto it = range.first; it != range.second; ++it) {
+            const light& l = lights[it->second];
+            point3 center = set->center(l.sphere);
+            real off = std::fabs((rec.p - center).length() - l.radius);
+            if (off > 1e-3 * l.radius + 1e-4)
+                continue;
+            double distance_sq = (center - from).length_squared();
+            double radius_sq = double(l.radius) * l.radius;
+            if (distance_sq <= radius_sq)
+                return 0;
+            double sin_sq_max = radius_sq / distance_sq;
+            double cap = sin_sq_max / (1 + std::sqrt(std::max(0.0, 1 - sin_sq_max)));
+            return static_cast<real>(l.odds / (2 * pi * cap));
+        }
+        return 0;
+    }
+
+private:
+    struct light {
+        size_t sphere;
+        real radius;
+        const material* mat;
+        double odds = 0;  // Of being picked.
+    };
+
+    const sphere_set* set = nullptr;
+    std::vector<light> lights;
+    std::vector<double> cdf;  // Odds of picking light k or one before it.
+    std::vector<std::pair<const material*, uint32_t>> by_material; // For pdf(): which lights a material is on.
+
+    //Two unit vectors at right angles to unit vector w and each other (Duff et al., "Building an Orthonormal Basis,
+    //Revisited").
+    static void basis(const vec3& w, vec3& a, vec3& b) {
+        double sign = std::copysign(1.0, double(w.z()));
+        double c = -1 / (sign + w.z());
+        double d = w.x() * w.y() * c;
+        a = vec3(1 + sign * w.x() * w.x() * c, sign * d, -sign * w.x());
+        b = vec3(d, sign + w.y() * w.y() * c, -w.y());
+    }
+};
+
+#endif //LIGHTS_H
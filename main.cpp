@@ -1,12 +1,20 @@
 #include "common_constants.h"
 
+#include "animation.h"
 #include "camera.h"
 #include "color.h"
+#include "distributed.h"
 #include "hittable_list.h"
 #include "material.h"
+#include "scene_file.h"
+#include "scenes.h"
 #include "sphere.h"
+#include "sphere_set.h"
 
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <string>
 #include <vector>
 #include <future>
 
@@ -17,51 +25,77 @@ int process(int value) {
     return value * value;
 }
 
-int main() {
+//Usage:
+//  RayTracing                       render the built in random spheres scene
+//  RayTracing scene.txt             render a scene file (or scene.rtsb, the binary kind). See scene_file.h.
+//  RayTracing mirror_pile           render another built in scene (scenes.h)
+//  RayTracing lit_spheres           a night scene lit by a few small lamps (diffuse_light spheres, see lights.h)
+//  RayTracing bouncing_spheres      an animation (as is any scene with a frames line): image_0000.ppm, ...
+//  RayTracing <scene> --save x.rtsb don't render, save the scene to a file instead (text unless it ends in .rtsb)
+//  RayTracing <scene> --workers 4   render with 4 worker processes (each this program with --worker added) as well
+//                                   as threads. See distributed.h.
+//  RayTracing <scene> --sampler sobol  where the samples' random numbers come from: independent (the default),
+//                                   stratified, sobol or blue_noise. See sampler.h.
+//  RayTracing <scene> --denoise      smooth the leftover noise out of the image at the end. See denoise.h.
+//  RayTracing <scene> --environment sky.hdr  light the scene with an HDR image (PFM or Radiance .hdr) instead of its
+//                                   own sky. See environment.h.
+int main(int argc, char** argv) {
+
+    std::string scene_name = "random_spheres";
+    std::string save_path;
+    std::string sampler_name = "independent";
+    int workers = 0;
+    bool worker = false;
+    bool denoise = false;
+    std::string environment;
+    for (int k = 1; k < argc; k++) {
+        std::string arg = argv[k];
+        if (arg == "--save" && k + 1 < argc)
+            save_path = argv[++k];
+        else if (arg == "--workers" && k + 1 < argc)
+            workers = std::atoi(argv[++k]);
+        else if (arg == "--worker")
+            worker = true;
+        else if (arg == "--sampler" && k + 1 < argc)
+            sampler_name = argv[++k];
+        else if (arg == "--denoise")
+            denoise = true;
+        else if (arg == "--environment" && k + 1 < argc)
+            environment = argv[++k];
+        else
+            scene_name = arg;
+    }
 
     // World
 
-    hittable_list world; //aka the scene we are rendering.
-
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground_material));
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
-
-            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                } else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = color::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                } else {
-                    // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-            }
+    //The scene as plain numbers. Either one of the built in ones or read from a file.
+    scene_description scene;
+    if (!builtin_scene(scene_name, scene)) {
+        std::string error;
+        auto start = std::chrono::steady_clock::now();
+        if (!load_scene(scene_name, scene, error)) {
+            std::cerr << error << '\n';
+            return 1;
         }
+        std::clog << "Loaded " << scene.spheres.size() << " spheres, " << scene.meshes.size() << " meshes and "
+                  << scene.instances.size() << " instances in "
+                  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+                  << " ms\n";
     }
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
-
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+    if (!environment.empty()) {
+        scene.environment = environment;
+        scene.environment_intensity = 1;
+        scene.environment_rotation = 0;
+    }
 
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    if (!save_path.empty()) {
+        if (!save_scene(save_path, scene)) {
+            std::cerr << "Could not write " << save_path << '\n';
+            return 1;
+        }
+        return 0;
+    }
 
     //I'm still not sure about OOP and all that encapsulation, inheritance, etc.
     //Because now if someone wants to know what my code is about they have to chase my definitions around
@@ -76,26 +110,57 @@ int main() {
 
     camera cam;
 
+    //Defaults. A scene file can override the image size, samples and depth.
     cam.aspect_ratio      = 16.0 / 9.0;
     cam.image_width       = 400;
     cam.samples_per_pixel = 20;
     cam.max_depth         = 50;
 
-    cam.vfov     = 20;
-    cam.position = point3(13,2,3);
-    cam.lookat   = point3(0,0,0);
-    cam.vup      = vec3(0,1,0);
+    cam.threads   = 0;  //0 uses every hardware thread. Set it lower to give the CPU some rest.
+    cam.tile_size = 32;
+    cam.wavefront = false; //true traces every tile a bounce at a time over big ray queues. Same image.
+    if (!parse_sampler_kind(sampler_name, cam.sampling)) { //sobol or blue_noise get less noise from the same samples.
+        std::cerr << "Unknown sampler " << sampler_name << '\n';
+        return 1;
+    }
+    
+    cam.light_sampling = true; //Shadow rays at the lights from every diffuse bounce. false leaves finding them to chance.
 
-    cam.defocus_angle = 0.6;
-    cam.focus_dist    = 10.0;
+    cam.adaptive_threshold = 0; //Try 0.005 with a high samples_per_pixel. Smooth areas stop early, noisy ones keep going.
+    
+    cam.output_file = "image.ppm"; //Binary PPM. Name it "image.pfm" to keep the raw float (HDR) values instead.
+    cam.stream_output = false; //true writes the PPM a band of tiles at a time while rendering. For huge images.
+    cam.denoise = denoise; //Few samples plus denoising looks like a lot of samples. cam.feature_file saves what it
+                           //goes by (albedo, normals, depth).
     
-    //render - No async used. The for loop colors lines one by one.
-    //render2 - Async (and therefore multiple threads) used. No limit to CPU usage. You WILL max out all your cores if use this method. Though it is fast.
-    //render3 - To Be Created. Divide the jobs into a limited number of batches. Give each their own thread. Won't be as fast as render2 but will give the CPU
-    //          some rest.
+    scene_objects world; //aka the scene we are rendering. Spheres, meshes, instances and materials, grouped by type.
+    std::string error;
+    if (!build_scene(scene, world, cam, error)) { //Also points the camera at the scene.
+        std::cerr << error << '\n';
+        return 1;
+    }
     
-    cam.render2(world); //render2 is asynchronously multi-threaded. It will max out your CPU on all cores as it did mine.
-                        //I was planning on dividing the image into jobs and creating a limited number of threads to handle
-                        //it, but haven't gotten around to it yet. It would be easy though.
+    //render - No threads used. The for loop colors lines one by one.
+    //render2 - Tiles handed out to a fixed pool of cam.threads worker threads. Idle threads steal tiles from busy ones.
+    //render_progressive - render2 in passes of cam.samples_per_pass samples. With cam.checkpoint_file set it saves its
+    //                     progress as it goes and picks up where it left off if it gets killed and run again.
+    
+    //A worker renders whatever regions the coordinator that started it asks for, and nothing else.
+    if (worker)
+        return serve_render_jobs(cam, world);
+
+    //An animation renders every frame with render2, moving the camera and spheres in between.
+    if (scene.frames > 0)
+        return render_animation(scene, world, cam) ? 0 : 1;
+
+    if (workers > 0) {
+        std::vector<std::string> command = {argv[0], scene_name, "--sampler", sampler_name, "--worker"};
+        if (!environment.empty()) {
+            command.push_back("--environment");
+            command.push_back(environment);
+        }
+        render_distributed(cam, world, command, workers);
+    } else
+        cam.render2(world);
     
 }
@@ -0,0 +1,173 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include "vec3.h"
+
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RT_HAS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define RT_HAS_MMAP 0
+#endif
+
+//Reading big input files (scenes, meshes) fast: map the whole thing into memory and pick through it in place.
+
+//A whole file in memory, read only. Memory mapped where we can (so the OS just pages it in as it's touched),
+//otherwise read in one go.
+class mapped_file {
+public:
+    mapped_file() {}
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+    ~mapped_file() { close(); }
+
+    bool open(const std::string& path) {
+        close();
+#if RT_HAS_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* p = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                ::close(fd);
+                mapped = p;
+                bytes = static_cast<const char*>(p);
+                length = static_cast<size_t>(info.st_size);
+                return true;
+            }
+        }
+        ::close(fd);
+#endif
+        // No mmap (or it failed, or the file is empty): read the old fashioned way.
+        std::FILE* file = std::fopen(path.c_str(), "rb");
+        if (!file)
+            return false;
+        char chunk[1 << 16];
+        size_t got;
+        while ((got = std::fread(chunk, 1, sizeof(chunk), file)) > 0)
+            copy.insert(copy.end(), chunk, chunk + got);
+        std::fclose(file);
+        bytes = copy.data();
+        length = copy.size();
+        return true;
+    }
+
+    void close() {
+#if RT_HAS_MMAP
+        if (mapped)
+            munmap(mapped, length);
+#endif
+        mapped = nullptr;
+        copy.clear();
+        bytes = nullptr;
+        length = 0;
+    }
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    void* mapped = nullptr;
+    std::vector<char> copy;
+    const char* bytes = nullptr;
+    size_t length = 0;
+};
+
+//Walks text in memory (a mapped_file, say) one line and one word at a time. Nothing gets copied out except the
+//numbers. Used for the scene files and OBJ meshes.
+class text_reader {
+public:
+    text_reader(const char* begin, const char* end) : pos(begin), end(end) {}
+
+    //Move to the start of the next line with something on it. False at the end of the file.
+    bool next_line() {
+        while (pos < end) {
+            skip_blanks();
+            if (pos < end && *pos == '#')
+                while (pos < end && *pos != '\n') pos++;
+            if (pos < end && (*pos == '\n' || *pos == '\r')) {
+                if (*pos == '\n') line++;
+                pos++;
+                continue;
+            }
+            return pos < end;
+        }
+        return false;
+    }
+
+    //The next word on this line, or an empty one at the end of the line.
+    std::string_view word() {
+        skip_blanks();
+        const char* start = pos;
+        while (pos < end && !is_blank(*pos) && *pos != '\n' && *pos != '\r' && *pos != '#')
+            pos++;
+        return std::string_view(start, static_cast<size_t>(pos - start));
+    }
+
+    bool number(double& out) {
+        auto w = word();
+        if (w.empty())
+            return false;
+        const char* first = w.data();
+        if (*first == '+') first++; // from_chars doesn't take a leading +.
+        auto result = std::from_chars(first, w.data() + w.size(), out);
+        return result.ec == std::errc() && result.ptr == w.data() + w.size();
+    }
+
+    //A whole number that fits an int. The range is checked first: casting NaN or 1e20 to int is undefined.
+    bool number(int& out) {
+        double d;
+        if (!number(d) || !(d >= std::numeric_limits<int>::min() && d <= std::numeric_limits<int>::max())
+            || d != std::trunc(d))
+            return false;
+        out = static_cast<int>(d);
+        return true;
+    }
+
+    bool vector(vec3& out) {
+        double x, y, z;
+        if (!number(x) || !number(y) || !number(z))
+            return false;
+        out = vec3(x, y, z);
+        return true;
+    }
+
+    //True if nothing but blanks or a comment is left on the line.
+    bool at_line_end() {
+        skip_blanks();
+        return pos >= end || *pos == '\n' || *pos == '\r' || *pos == '#';
+    }
+
+    //Skip whatever is left of this line, for lines we don't care about.
+    void skip_line() {
+        while (pos < end && *pos != '\n' && *pos != '\r')
+            pos++;
+    }
+
+    int line_number() const { return line; }
+    const char* position() const { return pos; }
+
+private:
+    const char* pos;
+    const char* end;
+    int line = 1;
+
+    static bool is_blank(char c) { return c == ' ' || c == '\t'; }
+    void skip_blanks() { while (pos < end && is_blank(*pos)) pos++; }
+};
+
+#endif //MAPPED_FILE_H
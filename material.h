@@ -3,27 +3,40 @@
 
 #include "common_constants.h"
 
+#include "arena.h"
+#include "sampler.h"
+
+#include <type_traits>
+#include <utility>
+#include <variant>
+
 class hit_record;
 
-class material {
-public:
-    virtual ~material() = default;
+//Which material class something is. The same order as the alternatives in material_variant, so a material's kind
+//is just its variant index.
+enum class material_kind { lambertian, metal, dielectric, diffuse_light };
+constexpr int material_kind_count = 4;
 
-    virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const = 0;
-};
+inline const char* material_kind_name(material_kind kind) {
+    switch (kind) {
+        case material_kind::lambertian: return "lambertian";
+        case material_kind::metal:      return "metal";
+        case material_kind::dielectric: return "dielectric";
+        case material_kind::diffuse_light: return "diffuse_light";
+    }
+    return "unknown";
+}
 
 //So Lambertian diffusion. Light doesn't reflect randomly, which is how we were doing it before.
 //Lambertian Diffusion gathers the reflections and makes them more inclined to reflect nearer to the surface normal
 //of whatever surface the ray had hit.
 
-class lambertian : public material {
+class lambertian {
 public:
     lambertian(const color& a) : albedo(a) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
-    const override {
-        auto scatter_direction = rec.normal + random_unit_vector();
+    bool scatter(const ray&, const hit_record& rec, color& attenuation, ray& scattered, sampler& s) const {
+        auto scatter_direction = rec.normal + s.get_direction();
 
         //Catch degenerate scatter direction
         //What's degenerate? If the random unit vector we generate is exactly opposite the normal vector, the two 
@@ -37,48 +50,98 @@ public:
         return true;
     }
 
+    //The surface's color, for the denoiser's feature buffers (denoise.h).
+    color surface_albedo() const { return albedo; }
+
+    //Whether what's seen in it is a sharp picture of something else (a mirror or glass) rather than its own surface.
+    bool is_specular() const { return false; }
+
+    //The light it gives off, from its front. Only lights give off any.
+    color emitted() const { return color(0,0,0); }
+
+    //Whether it's worth aiming shadow rays at the lights from here (see camera::sample_lights). Not for mirrors and
+    //glass: the one direction they send light is never going to be the one a shadow ray picked.
+    bool samples_lights() const { return true; }
+
+    //How likely scatter() is to send the ray off in `direction`, per steradian. With it, light arriving from
+    //`direction` reaches the camera attenuated by albedo * scatter_pdf (whatever scatter() would have done, the
+    //attenuation is what's left once its own pdf is divided out).
+    //normal + a random unit vector comes out cosine distributed, cos/pi.
+    real scatter_pdf(const ray&, const hit_record& rec, const vec3& direction) const {
+        auto cosine = dot(rec.normal, unit_vector(direction));
+        return cosine > 0 ? cosine / pi : 0;
+    }
+
 private:
     color albedo;
 };
 
-class metal : public material {
+class metal {
 public:
-    metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+    metal(const color& a, real f) : albedo(a), fuzz(f < 1 ? f : 1) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
-    const override {
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s) const {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = ray(rec.p, reflected + fuzz*random_unit_vector());
+        scattered = ray(rec.p, reflected + fuzz*s.get_direction());
         attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0);
     }
 
+    color surface_albedo() const { return albedo; }
+
+    bool is_specular() const { return fuzz < 0.1; }
+
+    color emitted() const { return color(0,0,0); }
+
+    bool samples_lights() const { return !is_specular(); }
+
+    //The direction is the mirror direction plus a random point on a sphere of radius fuzz around it. A direction d
+    //comes from the points where the line along d crosses that sphere, and each crossing at distance t counts
+    //t^2 / (4 pi fuzz |cos|) of them (the sphere's own 1/(4 pi fuzz^2), spread over the solid angle it looks like from
+    //the hit point).
+    real scatter_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        vec3 d = unit_vector(direction);
+        if (dot(d, rec.normal) <= 0 || fuzz <= 0)
+            return 0;
+        vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+        auto b = dot(d, reflected);
+        auto disc = b*b - (1 - fuzz*fuzz);
+        if (disc <= 0)
+            return 0;
+        auto root = std::sqrt(disc);
+        auto spread = 4 * pi * fuzz * std::fmax(root, real(1e-6));
+        real pdf = 0;
+        for (auto t : {b - root, b + root})
+            if (t > 0)
+                pdf += t*t / spread;
+        return pdf;
+    }
+
 private:
     color albedo;
-    double fuzz; //Fuzz? Yeah, just some lowered clarity in case I want the metal not to reflect light like a mirror.
+    real fuzz; //Fuzz? Yeah, just some lowered clarity in case I want the metal not to reflect light like a mirror.
 };
 
 //Dielectric? Like two electric? 
 //No.
 //Dielectric just means that the material in question refracts light. That's not its exact definition but it is what
 //we're looking for.
-class dielectric : public material {
+class dielectric {
 public:
-    dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+    dielectric(real index_of_refraction) : ir(index_of_refraction) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
-    const override {
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s) const {
         attenuation = color(1.0, 1.0, 1.0);
-        double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
+        real refraction_ratio = rec.front_face ? (1.0/ir) : ir;
 
         vec3 unit_direction = unit_vector(r_in.direction());
-        double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
-        double sin_theta = sqrt(1.0 - cos_theta*cos_theta);
+        real cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
+        real sin_theta = sqrt(1.0 - cos_theta*cos_theta);
         
         bool cannot_refract = refraction_ratio * sin_theta > 1.0;
         vec3 direction;
 
-        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > s.get_1d())
             direction = reflect(unit_direction, rec.normal);
         else
             direction = refract(unit_direction, rec.normal, refraction_ratio);
@@ -87,12 +150,24 @@ public:
         return true;
     }
 
+    //Glass doesn't tint anything.
+    color surface_albedo() const { return color(1.0, 1.0, 1.0); }
+
+    bool is_specular() const { return true; }
+
+    color emitted() const { return color(0,0,0); }
+
+    bool samples_lights() const { return false; }
+
+    //Only ever the one direction (well, two), so it can't be hit by chance: 0 everywhere.
+    real scatter_pdf(const ray&, const hit_record&, const vec3&) const { return 0; }
+
 private:
-    double ir; // Index of Refraction
+    real ir; // Index of Refraction
     
     //Real glass reflectivity varies by angle - look at a glass at a steep enough angle and it becomes a mirror.
     //The equation to find this is big and insane, but there is an approximation called the Schlick approximation.
-    static double reflectance(double cosine, double ref_idx) {
+    static real reflectance(real cosine, real ref_idx) {
         // Use Schlick's approximation for reflectance.
         auto r0 = (1-ref_idx) / (1+ref_idx);
         r0 = r0*r0;
@@ -100,4 +175,110 @@ private:
     }
 };
 
+//A light. Glows `emit` from the front (outside) of whatever it's on and doesn't reflect anything. Spheres made of it
+//go in the scene's light_list (lights.h), so every diffuse bounce in the scene aims a shadow ray at them.
+class diffuse_light {
+public:
+    diffuse_light(const color& emit) : emit(emit) {}
+
+    bool scatter(const ray&, const hit_record&, color&, ray&, sampler&) const {
+        return false;
+    }
+
+    //A light has no color of its own to take out for the denoiser, what it shows is all its own brightness.
+    color surface_albedo() const { return color(1.0, 1.0, 1.0); }
+
+    bool is_specular() const { return false; }
+
+    color emitted() const { return emit; }
+
+    bool samples_lights() const { return false; }
+
+    real scatter_pdf(const ray&, const hit_record&, const vec3&) const { return 0; }
+
+private:
+    color emit;
+};
+
+//The alternatives of material's variant, in material_kind order.
+using material_variant = std::variant<lambertian, metal, dielectric, diffuse_light>;
+
+//Any material. A closed set (a variant) rather than a base class with virtual functions: a bounce is one switch on
+//the type and the scatter() it lands in gets inlined, instead of an indirect call the CPU has to guess at through a
+//vtable pointer that's different for every sphere. Every material is the same size too, so a scene's materials sit
+//in one flat array. Adding a new kind of material means adding it to the variant (and to material_kind).
+class material {
+public:
+    template <typename T, typename = std::enable_if_t<!std::is_same<std::decay_t<T>, material>::value>>
+    material(T&& kind) : data(std::forward<T>(kind)) {}
+
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s) const {
+        return std::visit([&](const auto& m) { return m.scatter(r_in, rec, attenuation, scattered, s); }, data);
+    }
+
+    color surface_albedo() const {
+        return std::visit([](const auto& m) { return m.surface_albedo(); }, data);
+    }
+
+    bool is_specular() const {
+        return std::visit([](const auto& m) { return m.is_specular(); }, data);
+    }
+
+    color emitted() const {
+        return std::visit([](const auto& m) { return m.emitted(); }, data);
+    }
+
+    bool samples_lights() const {
+        return std::visit([](const auto& m) { return m.samples_lights(); }, data);
+    }
+
+    real scatter_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        return std::visit([&](const auto& m) { return m.scatter_pdf(r_in, rec, direction); }, data);
+    }
+
+    material_kind kind() const { return static_cast<material_kind>(data.index()); }
+
+    //The material as a T, when kind() says that's what it is. For code that has already sorted materials by kind
+    //(the wavefront renderer) and wants to call T's scatter() directly.
+    template <typename T>
+    const T& as() const { return *std::get_if<T>(&data); }
+
+private:
+    material_variant data;
+};
+
+//kind() is the variant index, so material_kind has to name the alternatives in the same order.
+static_assert(std::variant_size_v<material_variant> == material_kind_count,
+              "material_kind and material_variant must list the same materials");
+static_assert(std::is_same_v<std::variant_alternative_t<int(material_kind::lambertian), material_variant>, lambertian>,
+              "material_kind::lambertian is not material_variant's lambertian");
+static_assert(std::is_same_v<std::variant_alternative_t<int(material_kind::metal), material_variant>, metal>,
+              "material_kind::metal is not material_variant's metal");
+static_assert(std::is_same_v<std::variant_alternative_t<int(material_kind::dielectric), material_variant>, dielectric>,
+              "material_kind::dielectric is not material_variant's dielectric");
+static_assert(std::is_same_v<std::variant_alternative_t<int(material_kind::diffuse_light), material_variant>,
+                             diffuse_light>,
+              "material_kind::diffuse_light is not material_variant's diffuse_light");
+
+//Owns every material in a scene. Objects and hit_records only ever hold plain pointers to them, so none of the
+//render threads touch a reference count. Keep the table alive for as long as anything is being rendered.
+//
+//All materials are the one type now, so they live side by side in a single object_pool (arena.h).
+class material_table {
+public:
+    //Make a material of type T in the table. Something like: materials.add<lambertian>(color(0.5, 0.5, 0.5))
+    template <typename T, typename... Args>
+    const material* add(Args&&... args) {
+        return pool.make(T(std::forward<Args>(args)...));
+    }
+
+    //Room for n more materials in one chunk.
+    void reserve(size_t n) { pool.reserve(n); }
+
+    size_t size() const { return pool.size(); }
+
+private:
+    object_pool<material> pool;
+};
+
 #endif
\ No newline at end of file
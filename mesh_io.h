@@ -0,0 +1,394 @@
+#ifndef MESH_IO_H
+#define MESH_IO_H
+
+#include "mapped_file.h"
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//Loading triangle meshes from Wavefront OBJ and binary PLY files.
+//Both read the file in place out of a mapped_file, straight into the mesh's arrays, one pass. Only the geometry is
+//read (positions, normals, faces). Texture coordinates, groups, materials and colors are skipped. Polygons with
+//more than three corners are split into a fan of triangles.
+//
+//Like the scene loaders, these return false and say why in `error` if something's wrong with the file. They replace
+//whatever was in the mesh before.
+
+//One OBJ face corner: "v", "v/vt", "v//vn" or "v/vt/vn". Indices start at 1, and negative ones count back from
+//the last vertex read. Returns the 0 based indices, normal -1 if there isn't one.
+inline bool parse_obj_corner(std::string_view word, long vertex_count, long normal_count, long& v, long& vn) {
+    long parts[3] = {0, 0, 0};
+    const char* p = word.data();
+    const char* end = p + word.size();
+    for (int part = 0; part < 3; part++) {
+        const char* slash = std::find(p, end, '/');
+        if (slash > p) {
+            auto result = std::from_chars(p, slash, parts[part]);
+            if (result.ec != std::errc() || result.ptr != slash)
+                return false;
+        }
+        if (slash == end)
+            break;
+        p = slash + 1;
+    }
+
+    auto resolve = [](long index, long count) { return index < 0 ? count + index : index - 1; };
+    if (parts[0] == 0)
+        return false;
+    v = resolve(parts[0], vertex_count);
+    vn = parts[2] == 0 ? -1 : resolve(parts[2], normal_count);
+    return v >= 0 && v < vertex_count && (vn == -1 || vn < normal_count) && vn >= -1;
+}
+
+inline bool load_obj(const char* begin, const char* end, triangle_mesh& mesh, std::string& error) {
+    mesh = triangle_mesh();
+    text_reader in(begin, end);
+    bool all_corners_have_normals = true;
+    std::vector<uint32_t> face, face_normals; // One polygon's corners, reused for every face.
+
+    while (in.next_line()) {
+        auto keyword = in.word();
+        if (keyword == "v") {
+            vec3 p;
+            if (!in.vector(p)) {
+                error = "line " + std::to_string(in.line_number()) + ": bad vertex";
+                return false;
+            }
+            mesh.positions.push_back(p);
+            in.skip_line(); // Some files put a w or a vertex color after it.
+        } else if (keyword == "vn") {
+            vec3 n;
+            if (!in.vector(n)) {
+                error = "line " + std::to_string(in.line_number()) + ": bad normal";
+                return false;
+            }
+            mesh.normals.push_back(n);
+        } else if (keyword == "f") {
+            face.clear();
+            face_normals.clear();
+            for (auto word = in.word(); !word.empty(); word = in.word()) {
+                long v, vn;
+                if (!parse_obj_corner(word, static_cast<long>(mesh.positions.size()),
+                                      static_cast<long>(mesh.normals.size()), v, vn)) {
+                    error = "line " + std::to_string(in.line_number()) + ": bad face corner '" + std::string(word) + "'";
+                    return false;
+                }
+                face.push_back(static_cast<uint32_t>(v));
+                if (vn < 0)
+                    all_corners_have_normals = false;
+                face_normals.push_back(static_cast<uint32_t>(vn < 0 ? 0 : vn));
+            }
+            if (face.size() < 3) {
+                error = "line " + std::to_string(in.line_number()) + ": face with less than 3 corners";
+                return false;
+            }
+            for (size_t c = 1; c + 1 < face.size(); c++) {
+                mesh.indices.insert(mesh.indices.end(), {face[0], face[c], face[c + 1]});
+                mesh.normal_indices.insert(mesh.normal_indices.end(),
+                                           {face_normals[0], face_normals[c], face_normals[c + 1]});
+            }
+        } else {
+            in.skip_line(); // vt, o, g, s, usemtl, mtllib...
+        }
+    }
+
+    // Normals only mean something if every corner has one.
+    if (!all_corners_have_normals || mesh.normals.empty()) {
+        mesh.normals.clear();
+        mesh.normal_indices.clear();
+    }
+    return true;
+}
+
+//PLY property types and their sizes in bytes.
+enum class ply_type { int8, uint8, int16, uint16, int32, uint32, float32, float64, invalid };
+
+inline ply_type parse_ply_type(std::string_view name) {
+    if (name == "char" || name == "int8") return ply_type::int8;
+    if (name == "uchar" || name == "uint8") return ply_type::uint8;
+    if (name == "short" || name == "int16") return ply_type::int16;
+    if (name == "ushort" || name == "uint16") return ply_type::uint16;
+    if (name == "int" || name == "int32") return ply_type::int32;
+    if (name == "uint" || name == "uint32") return ply_type::uint32;
+    if (name == "float" || name == "float32") return ply_type::float32;
+    if (name == "double" || name == "float64") return ply_type::float64;
+    return ply_type::invalid;
+}
+
+inline size_t ply_size(ply_type type) {
+    switch (type) {
+        case ply_type::int8: case ply_type::uint8: return 1;
+        case ply_type::int16: case ply_type::uint16: return 2;
+        case ply_type::int32: case ply_type::uint32: case ply_type::float32: return 4;
+        case ply_type::float64: return 8;
+        default: return 0;
+    }
+}
+
+//Read one T at p, byte swapped if the file is the other endianness.
+template <typename T>
+T read_ply_raw(const char* p, bool swap) {
+    unsigned char bytes[sizeof(T)];
+    std::memcpy(bytes, p, sizeof(T));
+    if (swap)
+        std::reverse(bytes, bytes + sizeof(T));
+    T v;
+    std::memcpy(&v, bytes, sizeof(T));
+    return v;
+}
+
+//Read one value of `type` at p as a double. swap is for big endian files.
+inline double read_ply_value(const char* p, ply_type type, bool swap) {
+    switch (type) {
+        case ply_type::int8:    return read_ply_raw<int8_t>(p, swap);
+        case ply_type::uint8:   return read_ply_raw<uint8_t>(p, swap);
+        case ply_type::int16:   return read_ply_raw<int16_t>(p, swap);
+        case ply_type::uint16:  return read_ply_raw<uint16_t>(p, swap);
+        case ply_type::int32:   return read_ply_raw<int32_t>(p, swap);
+        case ply_type::uint32:  return read_ply_raw<uint32_t>(p, swap);
+        case ply_type::float32: return read_ply_raw<float>(p, swap);
+        case ply_type::float64: return read_ply_raw<double>(p, swap);
+        default: return 0;
+    }
+}
+
+//value as a count, if it is a whole number from 0 to `limit`. The cast on its own is undefined for NaN, negatives and
+//anything too big, and those are what a broken file would have in it.
+inline bool ply_count(double value, size_t limit, size_t& count) {
+    if (!(value >= 0 && value <= static_cast<double>(limit)) || value != std::floor(value))
+        return false;
+    count = static_cast<size_t>(value);
+    return true;
+}
+
+struct ply_property {
+    std::string name;
+    ply_type type = ply_type::invalid;       // The value type, or for a list the type of each item.
+    ply_type count_type = ply_type::invalid; // Only for lists: the type of the item count in front.
+    bool list = false;
+};
+
+struct ply_element {
+    std::string name;
+    size_t count = 0;
+    std::vector<ply_property> properties;
+};
+
+//Binary PLY, either byte order. Vertices need x, y, z (nx, ny, nz are used if they're there too), faces need a
+//vertex_indices (or vertex_index) list. Any other elements and properties are stepped over.
+inline bool load_ply(const char* begin, const char* end, triangle_mesh& mesh, std::string& error) {
+    mesh = triangle_mesh();
+    text_reader in(begin, end);
+    std::vector<ply_element> elements;
+    bool swap = false;
+
+    if (!in.next_line() || in.word() != "ply") {
+        error = "not a PLY file";
+        return false;
+    }
+
+    // The header is text, one line at a time, up to end_header.
+    const char* body = nullptr;
+    while (in.next_line()) {
+        auto keyword = in.word();
+        if (keyword == "format") {
+            auto format = in.word();
+            if (format == "binary_little_endian") {
+                swap = false;
+            } else if (format == "binary_big_endian") {
+                swap = true;
+            } else {
+                error = "only binary PLY files are supported, not " + std::string(format);
+                return false;
+            }
+            in.skip_line();
+        } else if (keyword == "element") {
+            ply_element element;
+            element.name = std::string(in.word());
+            // Never more rows than the file has bytes. The exact check is below, once the row size is known.
+            double count;
+            if (!in.number(count) || !ply_count(count, static_cast<size_t>(end - begin), element.count)) {
+                error = "bad element count in the header";
+                return false;
+            }
+            elements.push_back(element);
+        } else if (keyword == "property") {
+            if (elements.empty()) {
+                error = "property before any element";
+                return false;
+            }
+            ply_property property;
+            auto type = in.word();
+            if (type == "list") {
+                property.list = true;
+                property.count_type = parse_ply_type(in.word());
+                type = in.word();
+            }
+            property.type = parse_ply_type(type);
+            property.name = std::string(in.word());
+            if (property.type == ply_type::invalid || (property.list && property.count_type == ply_type::invalid)) {
+                error = "unknown property type in the header";
+                return false;
+            }
+            elements.back().properties.push_back(property);
+        } else if (keyword == "end_header") {
+            in.skip_line();
+            body = in.position();
+            // Binary data starts right after the header's newline.
+            if (body < end && *body == '\r') body++;
+            if (body < end && *body == '\n') body++;
+            break;
+        } else {
+            in.skip_line(); // comment, obj_info
+        }
+    }
+    if (!body) {
+        error = "no end_header";
+        return false;
+    }
+
+    const char* p = body;
+    auto need = [&](size_t bytes) {
+        if (static_cast<size_t>(end - p) < bytes) {
+            error = "file is cut short";
+            return false;
+        }
+        return true;
+    };
+
+    for (const auto& element : elements) {
+        bool is_vertex = element.name == "vertex";
+        bool is_face = element.name == "face";
+
+        // Where each interesting property sits, -1 if it isn't there.
+        int xyz[3] = {-1, -1, -1}, nxyz[3] = {-1, -1, -1}, face_list = -1;
+        for (int k = 0; k < static_cast<int>(element.properties.size()); k++) {
+            const auto& name = element.properties[k].name;
+            const char* axes[3] = {"x", "y", "z"};
+            const char* normal_axes[3] = {"nx", "ny", "nz"};
+            for (int a = 0; a < 3; a++) {
+                if (name == axes[a]) xyz[a] = k;
+                if (name == normal_axes[a]) nxyz[a] = k;
+            }
+            if (element.properties[k].list && (name == "vertex_indices" || name == "vertex_index"))
+                face_list = k;
+        }
+        if (is_vertex && (xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0)) {
+            error = "vertices without x, y and z";
+            return false;
+        }
+        bool has_normals = is_vertex && nxyz[0] >= 0 && nxyz[1] >= 0 && nxyz[2] >= 0;
+
+        // The smallest a row can be (every list empty), so a made up count fails here and not in reserve().
+        size_t row_size = 0;
+        for (const auto& property : element.properties)
+            row_size += ply_size(property.list ? property.count_type : property.type);
+        if (row_size > 0 && element.count > static_cast<size_t>(end - p) / row_size) {
+            error = "file is cut short";
+            return false;
+        }
+        if (is_vertex) {
+            mesh.positions.reserve(mesh.positions.size() + element.count);
+            if (has_normals)
+                mesh.normals.reserve(mesh.normals.size() + element.count);
+        }
+
+        std::vector<double> values(element.properties.size());
+        std::vector<uint32_t> face;
+
+        for (size_t row = 0; row < element.count; row++) {
+            for (int k = 0; k < static_cast<int>(element.properties.size()); k++) {
+                const auto& property = element.properties[k];
+                if (!property.list) {
+                    size_t size = ply_size(property.type);
+                    if (!need(size))
+                        return false;
+                    values[k] = read_ply_value(p, property.type, swap);
+                    p += size;
+                    continue;
+                }
+
+                size_t count_size = ply_size(property.count_type);
+                if (!need(count_size))
+                    return false;
+                size_t item_size = ply_size(property.type);
+                size_t items;
+                if (!ply_count(read_ply_value(p, property.count_type, swap), static_cast<size_t>(end - p), items)) {
+                    error = "bad list length";
+                    return false;
+                }
+                p += count_size;
+                if (!need(items * item_size))
+                    return false;
+
+                if (is_face && k == face_list) {
+                    face.clear();
+                    for (size_t item = 0; item < items; item++) {
+                        size_t index;
+                        if (!ply_count(read_ply_value(p + item * item_size, property.type, swap), UINT32_MAX, index)) {
+                            error = "a face uses a vertex that doesn't exist";
+                            return false;
+                        }
+                        face.push_back(static_cast<uint32_t>(index));
+                    }
+                    for (size_t c = 1; c + 1 < face.size(); c++)
+                        mesh.indices.insert(mesh.indices.end(), {face[0], face[c], face[c + 1]});
+                }
+                p += items * item_size;
+            }
+
+            if (is_vertex) {
+                mesh.positions.push_back(point3(values[xyz[0]], values[xyz[1]], values[xyz[2]]));
+                if (has_normals)
+                    mesh.normals.push_back(vec3(values[nxyz[0]], values[nxyz[1]], values[nxyz[2]]));
+            }
+        }
+    }
+
+    for (auto index : mesh.indices) {
+        if (index >= mesh.positions.size()) {
+            error = "a face uses a vertex that doesn't exist";
+            return false;
+        }
+    }
+    // PLY normals are per vertex, so they go through the same indices as the positions.
+    if (mesh.normals.size() != mesh.positions.size())
+        mesh.normals.clear();
+    mesh.normal_indices.clear();
+    return true;
+}
+
+//Load an OBJ or PLY file (going by the extension) into mesh. Call mesh.build() afterwards.
+inline bool load_mesh(const std::string& path, triangle_mesh& mesh, std::string& error) {
+    mapped_file file;
+    if (!file.open(path)) {
+        error = "can't open " + path;
+        return false;
+    }
+
+    auto dot = path.rfind('.');
+    std::string ext = dot == std::string::npos ? "" : path.substr(dot);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+
+    bool ok;
+    if (ext == ".obj") {
+        ok = load_obj(file.data(), file.data() + file.size(), mesh, error);
+    } else if (ext == ".ply") {
+        ok = load_ply(file.data(), file.data() + file.size(), mesh, error);
+    } else {
+        error = "don't know how to load " + ext + " meshes";
+        ok = false;
+    }
+    if (!ok)
+        error = path + ": " + error;
+    return ok;
+}
+
+#endif //MESH_IO_H
@@ -0,0 +1,14 @@
+#ifndef PRECISION_H
+#define PRECISION_H
+
+//The floating point type all the vector/ray/hit math is done in.
+//float is the default: it's half the memory traffic of double and twice as many lanes per SIMD register, and the
+//final image is 8 bits per channel anyway. Configure with -DRT_DOUBLE_PRECISION=ON to get the slower double
+//precision reference build back, e.g. to check how far a float render drifts from it.
+#ifdef RT_DOUBLE_PRECISION
+using real = double;
+#else
+using real = float;
+#endif
+
+#endif //PRECISION_H
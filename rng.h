@@ -0,0 +1,62 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+//PCG32 (pcg-random.org). 16 bytes of state, a multiply and a handful of shifts per number.
+//Each thread owns one (see thread_rng below) so render threads never touch each other's state. The old global
+//std::minstd_rand was shared by every thread: a data race, and the cache line it lived on bounced between cores on
+//every single random_double().
+class pcg32 {
+public:
+    pcg32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+    pcg32(uint64_t init_state, uint64_t init_seq) { seed(init_state, init_seq); }
+
+    //init_seq picks one of 2^63 independent streams, init_state the starting point in it.
+    void seed(uint64_t init_state, uint64_t init_seq) {
+        state = 0;
+        inc = (init_seq << 1u) | 1u;
+        next_uint();
+        state += init_state;
+        next_uint();
+    }
+
+    uint32_t next_uint() {
+        uint64_t old_state = state;
+        state = old_state * 6364136223846793005ULL + inc;
+        auto xorshifted = static_cast<uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+        auto rot = static_cast<uint32_t>(old_state >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31u));
+    }
+
+    // Returns a random real in [0,1).
+    double next_double() {
+        return next_uint() * (1.0 / 4294967296.0);
+    }
+
+    uint64_t state;
+    uint64_t inc;
+};
+
+//SplitMix64 finalizer. Scrambles the bits so neighbouring pixels/samples don't get neighbouring seeds.
+inline uint64_t mix_bits(uint64_t v) {
+    v += 0x9e3779b97f4a7c15ULL;
+    v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+    return v ^ (v >> 31);
+}
+
+//The generator random_double() and friends draw from. One per thread, so there is nothing to lock.
+inline pcg32& thread_rng() {
+    thread_local pcg32 rng;
+    return rng;
+}
+
+//Restart this thread's generator for one sample of one pixel. Every sample gets its own sequence that only depends
+//on (seed, pixel, sample), so an image comes out the same no matter how many threads rendered it or which thread
+//happened to pick up which tile.
+inline void seed_sample_rng(uint64_t seed, uint64_t pixel_index, uint64_t sample_index) {
+    thread_rng().seed(mix_bits(seed ^ mix_bits(sample_index)), mix_bits(pixel_index + mix_bits(seed)));
+}
+
+#endif //RNG_H
@@ -0,0 +1,842 @@
+//rt_bench: how fast is the renderer, in numbers that can be compared from one commit to the next.
+//
+//Renders the scenes in scenes.h at fixed settings and seeds, times the little pieces (sphere::hit, hittable_list::hit,
+//every material's scatter, the random helpers) on their own, checks how render2 scales with threads, how fast each
+//sampler converges and how much faster a scene lit by small lamps (or by the sun in an environment map) converges
+//with shadow rays than without.
+//Everything comes out as JSON on stdout so it can be saved and diffed or graphed over time.
+//
+//  rt_bench                   everything at the normal sizes
+//  rt_bench --quick           smaller images and fewer samples, for a quick look
+//  rt_bench --out bench.json  also write the JSON to a file
+//  rt_bench --precision-reference ref.pfm   render the precision check scene and save it (run the double build)
+//  rt_bench --precision-check ref.pfm       render it again and fail if it's too far from ref.pfm (run the float build)
+//
+//The last two are the check that the float build's image stays close to the double build's. Build twice (once with
+//-DRT_DOUBLE_PRECISION=ON), save the reference with the double one and check the float one against it. Same scene,
+//seed and samples, so what's left is rounding: see precision_check_bound.
+//
+//Renders are reproducible (every sample is seeded by its index), so "rays" and "image_hash" only change when the
+//renderer's output changes. If a speedup changes those, it changed the picture too.
+
+#include "common_constants.h"
+
+#include "camera.h"
+#include "denoise.h"
+#include "environment.h"
+#include "image_reader.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sampler.h"
+#include "scenes.h"
+#include "sphere.h"
+#include "sphere_set.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+//Wraps the world and counts every hit() call, which is one per ray (camera rays and every bounce). The counts are
+//spread over padded slots so threads aren't all fighting over one cache line while they're being timed.
+class ray_counter : public hittable {
+public:
+    explicit ray_counter(const hittable& world) : world(world) {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        slots[slot_index()].count.fetch_add(1, std::memory_order_relaxed);
+        return world.hit(r, ray_t, rec);
+    }
+
+    aabb bounding_box() const override { return world.bounding_box(); }
+
+    uint64_t total() const {
+        uint64_t sum = 0;
+        for (const auto& s : slots)
+            sum += s.count.load(std::memory_order_relaxed);
+        return sum;
+    }
+
+private:
+    static constexpr int slot_count = 64;
+    struct alignas(64) slot { std::atomic<uint64_t> count{0}; };
+
+    const hittable& world;
+    mutable slot slots[slot_count];
+
+    static int slot_index() {
+        static std::atomic<int> next{0};
+        thread_local int index = next++ % slot_count;
+        return index;
+    }
+};
+
+//FNV-1a over the film's sums and counts. Same hash, same image.
+static uint64_t hash_film(const framebuffer& fb) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    auto mix = [&h](const void* data, size_t bytes) {
+        auto* p = static_cast<const unsigned char*>(data);
+        for (size_t k = 0; k < bytes; k++) {
+            h ^= p[k];
+            h *= 0x100000001b3ULL;
+        }
+    };
+    mix(fb.rgb.data(), fb.rgb.size() * sizeof(float));
+    mix(fb.samples.data(), fb.samples.size() * sizeof(uint32_t));
+    return h;
+}
+
+//Just enough JSON writing for flat objects of numbers and strings inside arrays.
+class json_object {
+public:
+    json_object& add(const std::string& key, const std::string& value) {
+        return raw(key, '"' + value + '"');
+    }
+    json_object& add(const std::string& key, const char* value) { return add(key, std::string(value)); }
+    json_object& add(const std::string& key, bool value) { return raw(key, value ? "true" : "false"); }
+    json_object& add(const std::string& key, double value) {
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.6g", value);
+        return raw(key, buffer);
+    }
+    json_object& add(const std::string& key, uint64_t value) { return raw(key, std::to_string(value)); }
+    json_object& add(const std::string& key, int value) { return raw(key, std::to_string(value)); }
+
+    json_object& raw(const std::string& key, const std::string& value) {
+        text += (text.empty() ? "" : ", ") + ('"' + key + "\": ") + value;
+        return *this;
+    }
+
+    std::string str() const { return "{" + text + "}"; }
+
+private:
+    std::string text;
+};
+
+static std::string json_array(const std::vector<json_object>& items, const char* indent) {
+    std::string out = "[";
+    for (size_t k = 0; k < items.size(); k++)
+        out += std::string(k ? "," : "") + "\n" + indent + "  " + items[k].str();
+    return out + "\n" + indent + "]";
+}
+
+struct bench_settings {
+    int image_width = 400;
+    int samples_per_pixel = 16;
+    int repeats = 3;            // Every render and microbenchmark runs this many times and keeps the fastest.
+    size_t micro_calls = 2000000;
+    int convergence_max_spp = 64;
+    int convergence_reference_spp = 1024;
+};
+
+struct render_result {
+    double seconds = 0;
+    uint64_t rays = 0;
+    uint64_t image_hash = 0;
+    std::string stats;      // The render's stats.h counters as JSON, in a RT_ENABLE_STATS build.
+};
+
+//Render the world with render2 on `threads` threads, counting rays. Keeps the fastest of `repeats` runs.
+static render_result time_render(const hittable& world, const camera& setup, int threads, int repeats) {
+    render_result best;
+    for (int run = 0; run < repeats; run++) {
+        camera cam = setup; // A fresh camera, so a fresh pool with `threads` workers.
+        cam.threads = threads;
+        cam.output_file = "";
+        ray_counter counted(world);
+
+        auto start = bench_clock::now();
+        cam.render2(counted);
+        double seconds = seconds_since(start);
+
+        if (run == 0 || seconds < best.seconds)
+            best.seconds = seconds;
+        best.rays = counted.total();
+        best.image_hash = hash_film(cam.frame());
+#ifdef RT_ENABLE_STATS
+        best.stats = cam.stats().to_json();
+#endif
+    }
+    return best;
+}
+
+static camera bench_camera(const bench_settings& settings, int max_depth) {
+    camera cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = settings.image_width;
+    cam.samples_per_pixel = settings.samples_per_pixel;
+    cam.max_depth = max_depth;
+    cam.seed = 1;
+    return cam;
+}
+
+static json_object scene_json(const std::string& name, size_t spheres, const camera& cam, const render_result& r) {
+    json_object o;
+    o.add("name", name)
+     .add("spheres", static_cast<uint64_t>(spheres))
+     .add("width", cam.image_width)
+     .add("spp", cam.samples_per_pixel)
+     .add("max_depth", cam.max_depth)
+     .add("seconds", r.seconds)
+     .add("rays", r.rays)
+     .add("mrays_per_s", r.rays / r.seconds / 1e6)
+     .add("image_hash", std::to_string(r.image_hash));
+    if (!r.stats.empty())
+        o.raw("stats", r.stats);
+    return o;
+}
+
+static std::vector<json_object> bench_scenes(const bench_settings& settings, unsigned threads) {
+    std::vector<json_object> results;
+    std::string error; // The built in scenes have no meshes to fail loading.
+
+    for (int grid : {11, 22, 44}) {
+        auto scene = random_spheres(grid);
+        scene_objects world;
+        camera cam = bench_camera(settings, 50);
+        build_scene(scene, world, cam, error);
+        auto r = time_render(world, cam, static_cast<int>(threads), settings.repeats);
+        results.push_back(scene_json("random_spheres_" + std::to_string(grid), scene.spheres.size(), cam, r));
+        std::cerr << "  " << results.back().str() << '\n';
+    }
+
+    {
+        // The same render as random_spheres_11 through the wavefront path. Should have the same image_hash.
+        auto scene = random_spheres();
+        scene_objects world;
+        camera cam = bench_camera(settings, 50);
+        build_scene(scene, world, cam, error);
+        cam.wavefront = true;
+        auto r = time_render(world, cam, static_cast<int>(threads), settings.repeats);
+        results.push_back(scene_json("random_spheres_11_wavefront", scene.spheres.size(), cam, r));
+        std::cerr << "  " << results.back().str() << '\n';
+    }
+
+    {
+        auto scene = glass_spheres();
+        scene_objects world;
+        camera cam = bench_camera(settings, 50);
+        build_scene(scene, world, cam, error);
+        auto r = time_render(world, cam, static_cast<int>(threads), settings.repeats);
+        results.push_back(scene_json("glass_spheres", scene.spheres.size(), cam, r));
+        std::cerr << "  " << results.back().str() << '\n';
+    }
+
+    {
+        auto scene = mirror_pile();
+        scene_objects world;
+        camera cam = bench_camera(settings, 200);
+        build_scene(scene, world, cam, error);
+        auto r = time_render(world, cam, static_cast<int>(threads), settings.repeats);
+        results.push_back(scene_json("mirror_pile", scene.spheres.size(), cam, r));
+        std::cerr << "  " << results.back().str() << '\n';
+    }
+
+    {
+        // Every diffuse bounce also traces a shadow ray (lights.h), which the rays count includes.
+        auto scene = lit_spheres();
+        scene_objects world;
+        camera cam = bench_camera(settings, 50);
+        build_scene(scene, world, cam, error);
+        auto r = time_render(world, cam, static_cast<int>(threads), settings.repeats);
+        results.push_back(scene_json("lit_spheres", scene.spheres.size(), cam, r));
+        std::cerr << "  " << results.back().str() << '\n';
+    }
+
+    {
+        // 250k instances of one sphere. Counted as objects in the spheres field.
+        auto scene = forest(500);
+        scene_objects world;
+        camera cam = bench_camera(settings, 50);
+        build_scene(scene, world, cam, error);
+        auto r = time_render(world, cam, static_cast<int>(threads), settings.repeats);
+        results.push_back(scene_json("forest_500", scene.spheres.size() + scene.instances.size(), cam, r));
+        std::cerr << "  " << results.back().str() << '\n';
+    }
+    return results;
+}
+
+//The original scene with render2 on 1, 2, 4, ... threads up to every hardware thread.
+static std::vector<json_object> bench_scaling(const bench_settings& settings, unsigned hardware_threads) {
+    scene_objects world;
+    camera cam = bench_camera(settings, 50);
+    std::string error;
+    build_scene(random_spheres(), world, cam, error);
+
+    std::vector<unsigned> counts;
+    for (unsigned n = 1; n < hardware_threads; n *= 2)
+        counts.push_back(n);
+    counts.push_back(hardware_threads);
+
+    std::vector<json_object> results;
+    double single = 0;
+    for (auto n : counts) {
+        auto r = time_render(world, cam, static_cast<int>(n), settings.repeats);
+        if (n == 1)
+            single = r.seconds;
+        json_object o;
+        o.add("threads", static_cast<int>(n))
+         .add("seconds", r.seconds)
+         .add("mrays_per_s", r.rays / r.seconds / 1e6)
+         .add("speedup", single / r.seconds)
+         .add("efficiency", single / r.seconds / n);
+        results.push_back(o);
+        std::cerr << "  " << o.str() << '\n';
+    }
+    return results;
+}
+
+//How fast each sampler (sampler.h) gets to the right answer: the RMS error of the original scene at 1, 2, 4, ...
+//samples per pixel against a reference rendered with far more samples (and another seed, so its samples aren't the
+//same ones). Every render is denoised too (denoise.h), for the error after denoising ("rmse_denoised") and the time
+//it all took next to the reference's. Smaller images than the timed renders, the reference is most of the cost.
+//Every pixel's average color, channel by channel.
+static std::vector<double> film_mean(const framebuffer& fb) {
+    std::vector<double> values(fb.rgb.size());
+    for (size_t k = 0; k < values.size(); k++)
+        values[k] = fb.samples[k / 3] ? fb.rgb[k] / static_cast<double>(fb.samples[k / 3]) : 0.0;
+    return values;
+}
+
+//The same as the image file shows it: clamped to [0, 1] and gamma corrected.
+static std::vector<double> displayed(std::vector<double> values) {
+    for (auto& v : values)
+        v = linear_to_gamma(std::clamp(v, 0.0, 1.0));
+    return values;
+}
+
+static double rmse(const std::vector<double>& image, const std::vector<double>& reference) {
+    double sum = 0;
+    for (size_t k = 0; k < image.size(); k++)
+        sum += (image[k] - reference[k]) * (image[k] - reference[k]);
+    return std::sqrt(sum / image.size());
+}
+
+static std::vector<json_object> bench_convergence(const bench_settings& settings) {
+    scene_objects world;
+    camera setup = bench_camera(settings, 50);
+    setup.image_width = settings.image_width / 4;
+    std::string error;
+    build_scene(random_spheres(), world, setup, error);
+
+    std::vector<json_object> results;
+    camera cam = setup;
+    cam.output_file = "";
+    cam.sampling = sampler_kind::sobol;
+    cam.samples_per_pixel = settings.convergence_reference_spp;
+    cam.seed = 12345;
+    auto start = bench_clock::now();
+    cam.render2(world);
+    results.push_back(json_object().add("sampler", "reference").add("spp", cam.samples_per_pixel)
+                                   .add("seconds", seconds_since(start)));
+    std::cerr << "  " << results.back().str() << '\n';
+    auto reference = film_mean(cam.frame());
+
+    for (auto kind : {sampler_kind::independent, sampler_kind::stratified, sampler_kind::sobol,
+                      sampler_kind::blue_noise}) {
+        for (int spp = 1; spp <= settings.convergence_max_spp; spp *= 2) {
+            cam = setup;
+            cam.output_file = "";
+            cam.sampling = kind;
+            cam.samples_per_pixel = spp;
+            cam.denoise = true;
+            start = bench_clock::now();
+            cam.render2(world);
+            double seconds = seconds_since(start);
+
+            json_object o;
+            o.add("sampler", sampler_kind_name(kind))
+             .add("spp", spp)
+             .add("rmse", rmse(film_mean(cam.frame()), reference))
+             .add("rmse_denoised", rmse(film_mean(cam.image()), reference))
+             .add("seconds", seconds);
+            results.push_back(o);
+            std::cerr << "  " << o.str() << '\n';
+        }
+    }
+    return results;
+}
+
+//The same for light sampling (camera::sample_lights): the night scene lit by small lamps, with shadow rays and
+//without ("bsdf", the lamps only found by bouncing into them), against a reference that used them. Without, the error
+//hardly moves over this range: most pixels have yet to see a lamp at all. The error is of the image as displayed:
+//in linear values the edges of the lamps themselves (200 times brighter than white) would be most of it.
+static std::vector<json_object> bench_lights(const bench_settings& settings) {
+    scene_objects world;
+    camera setup = bench_camera(settings, 50);
+    setup.image_width = settings.image_width / 4;
+    setup.output_file = "";
+    std::string error;
+    build_scene(lit_spheres(), world, setup, error);
+
+    std::vector<json_object> results;
+    camera cam = setup;
+    cam.samples_per_pixel = settings.convergence_reference_spp;
+    cam.seed = 12345;
+    auto start = bench_clock::now();
+    cam.render2(world);
+    results.push_back(json_object().add("lighting", "reference").add("spp", cam.samples_per_pixel)
+                                   .add("seconds", seconds_since(start)));
+    std::cerr << "  " << results.back().str() << '\n';
+    auto reference = displayed(film_mean(cam.frame()));
+
+    for (bool light_sampling : {true, false}) {
+        for (int spp = 1; spp <= settings.convergence_max_spp; spp *= 2) {
+            cam = setup;
+            cam.light_sampling = light_sampling;
+            cam.samples_per_pixel = spp;
+            start = bench_clock::now();
+            cam.render2(world);
+            double seconds = seconds_since(start);
+
+            json_object o;
+            o.add("lighting", light_sampling ? "nee_mis" : "bsdf")
+             .add("spp", spp)
+             .add("rmse", rmse(displayed(film_mean(cam.frame())), reference))
+             .add("seconds", seconds);
+            results.push_back(o);
+            std::cerr << "  " << o.str() << '\n';
+        }
+    }
+    return results;
+}
+
+//A made up HDR sky, width x height: a blue gradient down to the horizon, grey ground below it and a sun 30 degrees
+//up that's a couple of degrees across and gives off most of the light. What environment maps are like and what makes
+//them hard: nearly all the light in a few hundredths of a percent of the pixels.
+static float_image sun_sky(int width, int height) {
+    float_image image;
+    image.width = width;
+    image.height = height;
+    image.rgb.resize(static_cast<size_t>(width) * height * 3);
+    vec3 sun = unit_vector(vec3(0.6, std::tan(degrees_to_radians(30.0)), 0.8));
+    double sun_cos = std::cos(degrees_to_radians(1.2));
+    for (int j = 0; j < height; j++) {
+        double theta = pi * (j + 0.5) / height;
+        for (int i = 0; i < width; i++) {
+            double phi = 2 * pi * ((i + 0.5) / width - 0.5);
+            vec3 d(std::sin(theta) * std::sin(phi), std::cos(theta), -std::sin(theta) * std::cos(phi));
+            color c = d.y() > 0 ? (1 - d.y()) * color(0.7, 0.8, 1.0) + d.y() * color(0.2, 0.35, 0.8)
+                                : color(0.25, 0.25, 0.25);
+            if (dot(d, sun) > sun_cos)
+                c = color(4000, 3600, 3000);
+            float* out = &image.rgb[3 * (static_cast<size_t>(j) * width + i)];
+            for (int k = 0; k < 3; k++)
+                out[k] = static_cast<float>(c[k]);
+        }
+    }
+    return image;
+}
+
+//The same for the original scene lit by sun_sky (environment.h) instead of its gradient, with shadow rays at the
+//environment and without ("bsdf": the sun only found by bouncing into it). First, how long the alias tables take to
+//build for a big map, on one thread and on all of them. The error is measured on the image as displayed: the sun's
+//glints in the metal spheres are thousands of times brighter than anything else, and would swamp it otherwise.
+static std::vector<json_object> bench_environment(const bench_settings& settings, unsigned threads) {
+    std::vector<json_object> results;
+    {
+        float_image big = sun_sky(4096, 2048);
+        for (unsigned n : {1u, threads}) {
+            thread_pool pool(n);
+            double best = 0;
+            for (int run = 0; run < settings.repeats; run++) {
+                environment_map map;
+                float_image copy = big;
+                auto start = bench_clock::now();
+                map.build(std::move(copy), 1, 0, pool);
+                double seconds = seconds_since(start);
+                if (run == 0 || seconds < best)
+                    best = seconds;
+            }
+            results.push_back(json_object().add("lighting", "build").add("width", big.width)
+                                           .add("height", big.height).add("threads", static_cast<int>(n))
+                                           .add("seconds", best));
+            std::cerr << "  " << results.back().str() << '\n';
+            if (threads == 1)
+                break;
+        }
+    }
+
+    environment_map sky;
+    {
+        thread_pool pool(threads);
+        sky.build(sun_sky(1024, 512), 1, 0, pool);
+    }
+    scene_objects world;
+    camera setup = bench_camera(settings, 50);
+    setup.image_width = settings.image_width / 4;
+    setup.output_file = "";
+    std::string error;
+    build_scene(random_spheres(), world, setup, error);
+    setup.environment = &sky;
+
+    camera cam = setup;
+    cam.samples_per_pixel = settings.convergence_reference_spp;
+    cam.seed = 12345;
+    auto start = bench_clock::now();
+    cam.render2(world);
+    results.push_back(json_object().add("lighting", "reference").add("spp", cam.samples_per_pixel)
+                                   .add("seconds", seconds_since(start)));
+    std::cerr << "  " << results.back().str() << '\n';
+    auto reference = displayed(film_mean(cam.frame()));
+
+    for (bool light_sampling : {true, false}) {
+        for (int spp = 1; spp <= settings.convergence_max_spp; spp *= 2) {
+            cam = setup;
+            cam.light_sampling = light_sampling;
+            cam.samples_per_pixel = spp;
+            start = bench_clock::now();
+            cam.render2(world);
+            double seconds = seconds_since(start);
+
+            json_object o;
+            o.add("lighting", light_sampling ? "nee_mis" : "bsdf")
+             .add("spp", spp)
+             .add("rmse", rmse(displayed(film_mean(cam.frame())), reference))
+             .add("seconds", seconds);
+            results.push_back(o);
+            std::cerr << "  " << o.str() << '\n';
+        }
+    }
+    return results;
+}
+
+//The image the precision check renders: the original scene, small, at a fixed seed and sample count.
+static framebuffer render_precision_scene() {
+    scene_objects world;
+    camera cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 200;
+    cam.samples_per_pixel = 32;
+    cam.max_depth = 50;
+    cam.seed = 1;
+    cam.output_file = "";
+    std::string error;
+    build_scene(random_spheres(), world, cam, error);
+    cam.render2(world);
+    return cam.frame();
+}
+
+//How far the float build may be from the double one: RMS error of the displayed image (clamped and gamma corrected)
+//in 8 bit levels. They trace the same paths with the same random numbers, but now and then rounding sends a path off
+//a different way, and each one of those is a sample's worth of noise in its pixel. Measured at about 1 level; twice
+//that means something got less precise than it should be.
+static const double precision_check_bound = 2.0;
+
+static int precision_reference(const std::string& path) {
+    if (!save_image(render_precision_scene(), path)) {
+        std::cerr << "Could not write " << path << '\n';
+        return 1;
+    }
+    std::cerr << "Saved the " << (sizeof(real) == sizeof(float) ? "float" : "double") << " build's image to " << path
+              << '\n';
+    return 0;
+}
+
+static int precision_check(const std::string& path) {
+    float_image reference;
+    std::string error;
+    if (!load_float_image(path, reference, error)) {
+        std::cerr << error << '\n';
+        return 1;
+    }
+    framebuffer fb = render_precision_scene();
+    if (reference.width != fb.width || reference.height != fb.height) {
+        std::cerr << path << " isn't the precision check's image (wrong size)\n";
+        return 1;
+    }
+    std::vector<double> expected(reference.rgb.begin(), reference.rgb.end());
+    double error_levels = 255 * rmse(displayed(film_mean(fb)), displayed(expected));
+    bool pass = error_levels <= precision_check_bound;
+    std::cout << json_object().add("real", sizeof(real) == sizeof(float) ? "float" : "double")
+                              .add("rmse_levels", error_levels).add("bound", precision_check_bound)
+                              .add("pass", pass).str() << '\n';
+    return pass ? 0 : 1;
+}
+
+//Whatever the timed code computes gets added in here so the compiler can't throw it away.
+static volatile double sink;
+
+//Run body(k) for k in [0, calls), keep the fastest of `repeats` runs and return nanoseconds per call.
+template <typename Body>
+static double ns_per_call(size_t calls, int repeats, Body body) {
+    double best = 0;
+    for (int run = 0; run < repeats; run++) {
+        double total = 0;
+        auto start = bench_clock::now();
+        for (size_t k = 0; k < calls; k++)
+            total += body(k);
+        double ns = seconds_since(start) * 1e9 / calls;
+        sink = sink + total;
+        if (run == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+//Rays from a shell around the origin aimed somewhere near it, so some hit a unit sphere at the origin and some miss.
+static std::vector<ray> make_rays(size_t count) {
+    std::vector<ray> rays;
+    rays.reserve(count);
+    for (size_t k = 0; k < count; k++) {
+        point3 origin = 5 * random_unit_vector();
+        point3 target = vec3::random(-1.5, 1.5);
+        rays.push_back(ray(origin, target - origin));
+    }
+    return rays;
+}
+
+static json_object micro_json(const std::string& name, double ns) {
+    json_object o;
+    o.add("name", name).add("ns_per_call", ns);
+    return o;
+}
+
+static std::vector<json_object> bench_micro(const bench_settings& settings) {
+    std::vector<json_object> results;
+    auto report = [&](json_object o) {
+        std::cerr << "  " << o.str() << '\n';
+        results.push_back(o);
+    };
+
+    thread_rng() = pcg32();
+    const size_t ray_count = 4096; // A power of two, so k % ray_count is cheap. Small enough to stay in cache.
+    auto rays = make_rays(ray_count);
+    auto calls = settings.micro_calls;
+    auto repeats = settings.repeats;
+
+    material_table materials;
+    auto gray = materials.add<lambertian>(color(0.5, 0.5, 0.5));
+
+    sphere single(point3(0,0,0), 1, gray);
+    report(micro_json("sphere::hit", ns_per_call(calls, repeats, [&](size_t k) {
+        hit_record rec;
+        return single.hit(rays[k % ray_count], interval(0.001, infinity), rec) ? rec.t : 0.0;
+    })));
+
+    //A plain list is a loop over every object, so ns per intersection is the cost of one sphere test through the
+    //virtual call.
+    const int list_size = 64;
+    hittable_list list;
+    for (int k = 0; k < list_size; k++)
+        list.add(make_shared<sphere>(point3(vec3::random(-1.5, 1.5)), random_double(0.05, 0.3), gray));
+    double list_ns = ns_per_call(calls / list_size * 4, repeats, [&](size_t k) {
+        hit_record rec;
+        return list.hit(rays[k % ray_count], interval(0.001, infinity), rec) ? rec.t : 0.0;
+    });
+    report(micro_json("hittable_list::hit", list_ns).add("objects", list_size)
+                                                     .add("ns_per_intersection", list_ns / list_size));
+
+    //The whole original scene through its BVH, both ways.
+    {
+        auto scene = random_spheres();
+        sphere_set world;
+        camera cam;
+        build_spheres(scene, build_materials(scene, materials), world);
+        apply_camera(scene, cam);
+        thread_rng() = pcg32();
+        std::vector<ray> scene_rays;
+        for (size_t k = 0; k < ray_count; k++) {
+            point3 origin = cam.position + vec3::random(-0.5, 0.5);
+            point3 target = point3(random_double(-11, 11), random_double(0, 1), random_double(-11, 11));
+            scene_rays.push_back(ray(origin, target - origin));
+        }
+        for (bool simd : {true, false}) {
+            if (simd && !cpu_has_avx2())
+                continue;
+            world.use_simd(simd);
+            report(micro_json(simd ? "sphere_set::hit (avx2)" : "sphere_set::hit (scalar)",
+                              ns_per_call(calls, repeats, [&](size_t k) {
+                hit_record rec;
+                return world.hit(scene_rays[k % ray_count], interval(0.001, infinity), rec) ? rec.t : 0.0;
+            })).add("spheres", static_cast<uint64_t>(world.size())));
+        }
+    }
+
+    //What moving spheres costs an animation before any rendering: a new sphere_set built from scratch every frame,
+    //or every sphere moved in place and the BVH refit (see animation.h).
+    {
+        auto scene = random_spheres(44);
+        auto made = build_materials(scene, materials);
+        auto spheres = static_cast<uint64_t>(scene.spheres.size());
+        report(micro_json("sphere_set::build", ns_per_call(1, repeats, [&](size_t) {
+            sphere_set fresh;
+            build_spheres(scene, made, fresh);
+            return static_cast<double>(fresh.size());
+        })).add("spheres", spheres));
+
+        sphere_set world;
+        build_spheres(scene, made, world);
+        int frame = 0;
+        report(micro_json("sphere_set::move + refit", ns_per_call(1, repeats, [&](size_t) {
+            vec3 bounce(0, 0.01 * (++frame % 2), 0);
+            for (size_t k = 0; k < scene.spheres.size(); k++)
+                world.move(k, scene.spheres[k].center + bounce);
+            world.refit();
+            return static_cast<double>(world.size());
+        })).add("spheres", spheres));
+    }
+
+    //Scatter off real hit points on the unit sphere, from outside (and for glass, the same points from inside too).
+    std::vector<std::pair<ray, hit_record>> hits;
+    for (const auto& r : rays) {
+        hit_record rec;
+        if (single.hit(r, interval(0.001, infinity), rec))
+            hits.push_back({r, rec});
+    }
+    size_t hit_count = hits.size();
+
+    auto time_scatter = [&](const char* name, const material* mat) {
+        report(micro_json(name, ns_per_call(calls, repeats, [&](size_t k) {
+            const auto& h = hits[k % hit_count];
+            color attenuation;
+            ray scattered;
+            sampler numbers;
+            bool ok = mat->scatter(h.first, h.second, attenuation, scattered, numbers);
+            return ok ? scattered.direction().x() : 0.0;
+        })));
+    };
+    time_scatter("lambertian::scatter", materials.add<lambertian>(color(0.5, 0.5, 0.5)));
+    time_scatter("metal::scatter", materials.add<metal>(color(0.8, 0.8, 0.8), 0.3));
+    time_scatter("dielectric::scatter", materials.add<dielectric>(1.5));
+
+    //What a real render does: the next hit's material is a coin toss, so which scatter runs is too. Mixed like the
+    //original scene, 80% lambertian, 15% metal, 5% glass.
+    std::vector<const material*> mixed;
+    for (int k = 0; k < 1024; k++) {
+        auto choose = random_double();
+        if (choose < 0.8)
+            mixed.push_back(materials.add<lambertian>(color::random()));
+        else if (choose < 0.95)
+            mixed.push_back(materials.add<metal>(color::random(0.5, 1), random_double(0, 0.5)));
+        else
+            mixed.push_back(materials.add<dielectric>(1.5));
+    }
+    report(micro_json("material::scatter (mixed)", ns_per_call(calls, repeats, [&](size_t k) {
+        const auto& h = hits[k % hit_count];
+        color attenuation;
+        ray scattered;
+        sampler numbers;
+        bool ok = mixed[(k * 7919) % mixed.size()]->scatter(h.first, h.second, attenuation, scattered, numbers);
+        return ok ? scattered.direction().x() : 0.0;
+    })));
+
+    //Picking a direction from a 2048 x 1024 environment map: two alias table lookups, whatever the map. Then the
+    //pdf of a direction, what every bounce that escapes asks for.
+    environment_map sky;
+    {
+        thread_pool pool;
+        sky.build(sun_sky(2048, 1024), 1, 0, pool);
+    }
+    report(micro_json("environment_map::sample", ns_per_call(calls, repeats, [&](size_t) {
+        vec3 direction;
+        color radiance;
+        real pdf;
+        return sky.sample(sample2{random_double(), random_double()}, direction, radiance, pdf) ? pdf : 0.0;
+    })));
+    report(micro_json("environment_map::pdf", ns_per_call(calls, repeats, [&](size_t k) {
+        return sky.pdf(rays[k % ray_count].direction());
+    })));
+
+    report(micro_json("random_double", ns_per_call(calls, repeats, [](size_t) {
+        return random_double();
+    })));
+    report(micro_json("random_unit_vector", ns_per_call(calls, repeats, [](size_t) {
+        return random_unit_vector().x();
+    })));
+    report(micro_json("random_in_unit_disk", ns_per_call(calls, repeats, [](size_t) {
+        return random_in_unit_disk().x();
+    })));
+    report(micro_json("random_on_hemisphere", ns_per_call(calls, repeats, [&](size_t k) {
+        return random_on_hemisphere(hits[k % hit_count].second.normal).x();
+    })));
+    return results;
+}
+
+int main(int argc, char** argv) {
+    bench_settings settings;
+    std::string out_path;
+    for (int k = 1; k < argc; k++) {
+        if (std::strcmp(argv[k], "--quick") == 0) {
+            settings.image_width = 200;
+            settings.samples_per_pixel = 4;
+            settings.repeats = 1;
+            settings.micro_calls = 200000;
+            settings.convergence_max_spp = 16;
+            settings.convergence_reference_spp = 256;
+        } else if (std::strcmp(argv[k], "--out") == 0 && k + 1 < argc) {
+            out_path = argv[++k];
+        } else if (std::strcmp(argv[k], "--precision-reference") == 0 && k + 1 < argc) {
+            std::clog.rdbuf(nullptr);
+            return precision_reference(argv[k + 1]);
+        } else if (std::strcmp(argv[k], "--precision-check") == 0 && k + 1 < argc) {
+            std::clog.rdbuf(nullptr);
+            return precision_check(argv[k + 1]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--quick] [--out file.json] [--precision-reference file.pfm]"
+                      << " [--precision-check file.pfm]\n";
+            return 1;
+        }
+    }
+
+    unsigned hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    //render2's tile countdown would only get in the way here. Silence std::clog and report progress on std::cerr.
+    auto* clog_buffer = std::clog.rdbuf(nullptr);
+
+    std::cerr << "microbenchmarks\n";
+    auto micro = bench_micro(settings);
+    std::cerr << "scenes\n";
+    auto scenes = bench_scenes(settings, hardware_threads);
+    std::cerr << "thread scaling\n";
+    auto scaling = bench_scaling(settings, hardware_threads);
+    std::cerr << "sampler convergence\n";
+    auto convergence = bench_convergence(settings);
+    std::cerr << "light sampling\n";
+    auto lights = bench_lights(settings);
+    std::cerr << "environment lighting\n";
+    auto environment = bench_environment(settings, hardware_threads);
+
+    std::clog.rdbuf(clog_buffer);
+    std::clog.clear();
+
+    json_object build;
+    build.add("real", sizeof(real) == sizeof(float) ? "float" : "double")
+         .add("avx2", cpu_has_avx2())
+#ifdef RT_ENABLE_STATS
+         .add("stats", true)
+#else
+         .add("stats", false)
+#endif
+         .add("hardware_threads", static_cast<int>(hardware_threads))
+         .add("image_width", settings.image_width)
+         .add("spp", settings.samples_per_pixel)
+         .add("repeats", settings.repeats);
+
+    std::string json = "{\n  \"build\": " + build.str() + ",\n"
+                     + "  \"micro\": " + json_array(micro, "  ") + ",\n"
+                     + "  \"scenes\": " + json_array(scenes, "  ") + ",\n"
+                     + "  \"scaling\": " + json_array(scaling, "  ") + ",\n"
+                     + "  \"convergence\": " + json_array(convergence, "  ") + ",\n"
+                     + "  \"lights\": " + json_array(lights, "  ") + ",\n"
+                     + "  \"environment\": " + json_array(environment, "  ") + "\n}\n";
+
+    std::cout << json;
+    if (!out_path.empty() && !write_file(out_path, std::vector<char>(json.begin(), json.end()))) {
+        std::cerr << "Could not write " << out_path << '\n';
+        return 1;
+    }
+    return 0;
+}
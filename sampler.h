@@ -0,0 +1,354 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "common_constants.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//Where a sample's random numbers come from.
+//
+//A sample of a pixel is an integral over a lot of dimensions at once: where in the pixel (2), where on the lens (2),
+//then which way each bounce goes (2), whether Russian roulette keeps the path (1), which light a shadow ray goes to
+//and where on it (3) and where a shadow ray at the environment map goes (2). Plain random numbers land in clumps and
+//leave holes, so at a few samples per pixel most of the noise is just bad luck about where they fell. The other
+//samplers spread each pixel's samples out evenly over every one of those dimensions instead, so the same number of
+//samples gets a lot closer to the answer.
+//
+//To make that work every dimension always means the same thing: the pixel is 0-1, the lens 2-3, and bounce b gets
+//4 + 8b and 4 + 8b + 1 for scatter(), 4 + 8b + 2 for roulette, 4 + 8b + 3 to 4 + 8b + 5 for the shadow ray at a
+//light and 4 + 8b + 6 and 4 + 8b + 7 for the one at the environment, whatever the bounces before it used. The camera
+//calls start_bounce / start_roulette / start_light / start_environment to get there.
+//
+//  independent  the plain per sample PCG numbers (rng.h). Draws exactly what the renderer always drew, so the image
+//               is the same as before samplers were a thing.
+//  stratified   jittered strata: sqrt(spp) x sqrt(spp) cells in 2D, spp cells in 1D, shuffled per pixel and per
+//               dimension so the dimensions don't line up with each other.
+//  sobol        Sobol points, shuffled and Owen scrambled per pixel and per pair of dimensions (Burley, "Practical
+//               Hash-based Owen Scrambling"). Well spread at any prefix of samples, so adaptive and progressive
+//               renders get the benefit too.
+//  blue_noise   the same Sobol points in every pixel, shifted by a blue noise tile (Georgiev and Fajardo). What error
+//               is left at low spp is spread like blue noise, fine grained rather than blotchy, which looks a lot
+//               cleaner for the same error.
+//
+//A closed set switched on per number rather than a base class with virtual functions, like material.
+enum class sampler_kind { independent, stratified, sobol, blue_noise };
+
+inline const char* sampler_kind_name(sampler_kind kind) {
+    switch (kind) {
+        case sampler_kind::independent: return "independent";
+        case sampler_kind::stratified:  return "stratified";
+        case sampler_kind::sobol:       return "sobol";
+        case sampler_kind::blue_noise:  return "blue_noise";
+    }
+    return "unknown";
+}
+
+//The sampler called `name`. False if there's no such sampler.
+inline bool parse_sampler_kind(const std::string& name, sampler_kind& kind) {
+    for (auto k : {sampler_kind::independent, sampler_kind::stratified,
+                   sampler_kind::sobol, sampler_kind::blue_noise}) {
+        if (name == sampler_kind_name(k)) {
+            kind = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct sample2 {
+    double x, y;
+};
+
+//The bits of x the other way round.
+inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+//Owen scrambling of a 32 bit fixed point number in [0,1) (Laine and Karras' hash, with Burley's constants). Each
+//bit gets flipped or not depending only on the bits above it, so points that were evenly spread still are.
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+//The second dimension of the Sobol sequence (the first is just reverse_bits(index)), as 32 bit fixed point.
+inline uint32_t sobol_second(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            result ^= v;
+    return result;
+}
+
+//Element i of a random permutation of [0, count) picked by `seed`, without making the permutation (Kensler,
+//"Correlated Multi-Jittered Sampling").
+inline uint32_t permute(uint32_t i, uint32_t count, uint32_t seed) {
+    uint32_t w = count - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893du;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3fu;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= count);
+    return (i + seed) % count;
+}
+
+//A 64x64 tile of blue noise: every value from 0 to 1 once, and each one as far as it can be from the ones close to
+//it in value. Made with Ulichney's void and cluster method the first time it's asked for (tens of milliseconds) and
+//the same every time. Indexed [y * 64 + x].
+constexpr int blue_noise_size = 64;
+
+inline std::vector<float> make_blue_noise_tile() {
+    const int n = blue_noise_size, size = n * n;
+    const double sigma = 1.5;
+
+    // How much a point at (dx, dy) crowds its neighbour, wrapping round at the edges so the tile repeats seamlessly.
+    std::vector<double> kernel(size);
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) {
+            int dx = std::min(x, n - x), dy = std::min(y, n - y);
+            kernel[y * n + x] = std::exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+        }
+    }
+
+    std::vector<uint8_t> on(size, 0);
+    std::vector<double> energy(size, 0);
+    auto place = [&](int p, bool set) {
+        on[p] = set;
+        int px = p % n, py = p / n;
+        double sign = set ? 1 : -1;
+        for (int y = 0; y < n; y++)
+            for (int x = 0; x < n; x++)
+                energy[y * n + x] += sign * kernel[((y - py) & (n - 1)) * n + ((x - px) & (n - 1))];
+    };
+    auto tightest_cluster = [&] {
+        int best = -1;
+        for (int p = 0; p < size; p++)
+            if (on[p] && (best < 0 || energy[p] > energy[best]))
+                best = p;
+        return best;
+    };
+    auto largest_void = [&] {
+        int best = -1;
+        for (int p = 0; p < size; p++)
+            if (!on[p] && (best < 0 || energy[p] < energy[best]))
+                best = p;
+        return best;
+    };
+
+    // A tenth of the points at random, then shuffled about until they're evenly spread: the point in the tightest
+    // cluster moves to the largest void until it's already there.
+    pcg32 rng(0x626c7565u, 0x6e6f697365u);
+    int initial = size / 10;
+    for (int placed = 0; placed < initial;) {
+        int p = static_cast<int>(rng.next_uint() % size);
+        if (!on[p]) {
+            place(p, true);
+            placed++;
+        }
+    }
+    while (true) {
+        int cluster = tightest_cluster();
+        place(cluster, false);
+        int hole = largest_void();
+        place(hole, true);
+        if (hole == cluster)
+            break;
+    }
+
+    // Ranks: take the initial points away tightest cluster first (the last ranks below `initial`), then fill the
+    // rest in largest void first.
+    std::vector<int> rank(size);
+    auto initial_on = on;
+    auto initial_energy = energy;
+    for (int r = initial - 1; r >= 0; r--) {
+        int cluster = tightest_cluster();
+        place(cluster, false);
+        rank[cluster] = r;
+    }
+    on = initial_on;
+    energy = initial_energy;
+    for (int r = initial; r < size; r++) {
+        int hole = largest_void();
+        place(hole, true);
+        rank[hole] = r;
+    }
+
+    std::vector<float> tile(size);
+    for (int p = 0; p < size; p++)
+        tile[p] = static_cast<float>((rank[p] + 0.5) / size);
+    return tile;
+}
+
+inline const std::vector<float>& blue_noise_tile() {
+    static const std::vector<float> tile = make_blue_noise_tile();
+    return tile;
+}
+
+//The random numbers for one sample of one pixel. Start it, then take numbers from it in the order they're used.
+//Small and copyable, so a wavefront path carries its own.
+class sampler {
+public:
+    sampler_kind kind = sampler_kind::independent;
+
+    //Start sample `index` (of `count`) of pixel (x, y). Also reseeds this thread's generator exactly as
+    //seed_sample_rng does, which is where the independent sampler's numbers come from.
+    void start(sampler_kind k, uint64_t seed, int x, int y, uint64_t pixel_index, uint32_t index, uint32_t count) {
+        seed_sample_rng(seed, pixel_index, index);
+        kind = k;
+        px = static_cast<uint32_t>(x);
+        py = static_cast<uint32_t>(y);
+        sample = index;
+        samples = count > 0 ? count : 1;
+        dimension = 0;
+        // Blue noise uses one set of points for the whole image, the others a set per pixel.
+        scramble = kind == sampler_kind::blue_noise ? mix_bits(seed) : mix_bits(seed ^ mix_bits(pixel_index));
+    }
+
+    void start_bounce(int bounce) { dimension = 4 + 8 * static_cast<uint32_t>(bounce); }
+    void start_roulette(int bounce) { dimension = 4 + 8 * static_cast<uint32_t>(bounce) + 2; }
+    void start_light(int bounce) { dimension = 4 + 8 * static_cast<uint32_t>(bounce) + 3; }
+    void start_environment(int bounce) { dimension = 4 + 8 * static_cast<uint32_t>(bounce) + 6; }
+
+    double get_1d() {
+        uint32_t d = dimension++;
+        switch (kind) {
+            case sampler_kind::independent:
+                return random_double();
+            case sampler_kind::stratified: {
+                uint32_t stratum = permute(sample % samples, samples, hash32(d, 0));
+                return (stratum + jitter(d, 0)) / samples;
+            }
+            case sampler_kind::sobol:
+                return to_unit(sobol(d, 0));
+            case sampler_kind::blue_noise:
+                return shift(to_unit(sobol(d, 0)), d, 0);
+        }
+        return 0;
+    }
+
+    sample2 get_2d() {
+        uint32_t d = dimension;
+        dimension += 2;
+        switch (kind) {
+            case sampler_kind::independent: {
+                // In this order: x then y, like pixel_sample_square always drew them.
+                double x = random_double();
+                double y = random_double();
+                return {x, y};
+            }
+            case sampler_kind::stratified: {
+                auto side = static_cast<uint32_t>(std::sqrt(static_cast<double>(samples)));
+                uint32_t cells = side * side;
+                if (sample >= cells) // Samples past the last whole square of strata just land anywhere.
+                    return {jitter(d, 0), jitter(d, 1)};
+                uint32_t cell = permute(sample, cells, hash32(d, 0));
+                return {(cell % side + jitter(d, 0)) / side, (cell / side + jitter(d, 1)) / side};
+            }
+            case sampler_kind::sobol:
+                return {to_unit(sobol(d, 0)), to_unit(sobol(d, 1))};
+            case sampler_kind::blue_noise:
+                return {shift(to_unit(sobol(d, 0)), d, 0), shift(to_unit(sobol(d, 1)), d, 1)};
+        }
+        return {0, 0};
+    }
+
+    //A direction, evenly over the sphere (random_unit_vector).
+    vec3 get_direction() {
+        if (kind == sampler_kind::independent)
+            return random_unit_vector();
+        sample2 u = get_2d();
+        auto z = 1 - 2 * u.x;
+        auto r = std::sqrt(std::fmax(0.0, 1 - z * z));
+        auto phi = 2 * pi * u.y;
+        return vec3(r * std::cos(phi), r * std::sin(phi), z);
+    }
+
+    //A point in the unit disk (random_in_unit_disk). Shirley and Chiu's concentric map, which keeps points that were
+    //spread evenly over the square spread evenly over the disk.
+    vec3 get_disk() {
+        if (kind == sampler_kind::independent)
+            return random_in_unit_disk();
+        sample2 u = get_2d();
+        auto a = 2 * u.x - 1, b = 2 * u.y - 1;
+        if (a == 0 && b == 0)
+            return vec3(0, 0, 0);
+        double r, theta;
+        if (std::fabs(a) > std::fabs(b)) {
+            r = a;
+            theta = (pi / 4) * (b / a);
+        } else {
+            r = b;
+            theta = (pi / 2) - (pi / 4) * (a / b);
+        }
+        return vec3(r * std::cos(theta), r * std::sin(theta), 0);
+    }
+
+private:
+    uint64_t scramble = 0;
+    uint32_t px = 0, py = 0;
+    uint32_t sample = 0, samples = 1;
+    uint32_t dimension = 0;
+
+    uint32_t hash32(uint32_t d, uint32_t salt) const {
+        return static_cast<uint32_t>(mix_bits(scramble ^ mix_bits((static_cast<uint64_t>(d) << 8) | salt)) >> 32);
+    }
+
+    double jitter(uint32_t d, uint32_t axis) const {
+        uint64_t bits = mix_bits(hash32(d, 2 + axis) ^ (static_cast<uint64_t>(sample) << 32));
+        return (bits >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    static double to_unit(uint32_t x) { return x * (1.0 / 4294967296.0); }
+
+    //Coordinate `axis` of this sample's point in the Sobol set for dimension pair d: the sample index shuffled, then
+    //each coordinate Owen scrambled, all with seeds of their own.
+    uint32_t sobol(uint32_t d, uint32_t axis) const {
+        uint32_t index = nested_uniform_scramble(sample, hash32(d, 4));
+        uint32_t x = axis == 0 ? reverse_bits(index) : sobol_second(index);
+        return nested_uniform_scramble(x, hash32(d, 5 + axis));
+    }
+
+    //u moved round by this pixel's blue noise value (from a different spot in the tile for every dimension).
+    double shift(double u, uint32_t d, uint32_t axis) const {
+        uint32_t offset = hash32(d, 8 + axis);
+        uint32_t x = (px + offset) % blue_noise_size;
+        uint32_t y = (py + (offset >> 16)) % blue_noise_size;
+        u += blue_noise_tile()[y * blue_noise_size + x];
+        return u >= 1 ? u - 1 : u;
+    }
+};
+
+#endif //SAMPLER_H
@@ -0,0 +1,1048 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "common_constants.h"
+
+#include "camera.h"
+#include "color.h"
+#include "image_writer.h"
+#include "instance.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "mesh_io.h"
+#include "scene_objects.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "triangle_mesh.h"
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+//Scenes as files instead of code in main(), so changing the scene doesn't mean recompiling.
+//
+//A scene is loaded into a scene_description (plain numbers, materials referred to by index) and then
+//build_scene() turns that into the real objects (a scene_objects: one sphere_set for all the spheres, a triangle_mesh
+//per mesh, an instance_set), materials and camera settings. The built in scenes in
+//scenes.h make scene_descriptions too, which is how they can be saved to a file.
+//
+//Two formats:
+//
+//Text (anything not ending in .rtsb). One thing per line, # starts a comment, blank lines are fine:
+//
+//  image 400 1.7778                     width, aspect ratio
+//  samples 20                           samples per pixel
+//  max_depth 50
+//  camera 13 2 3  0 0 0  0 1 0  20      position, look at, up, vertical fov in degrees
+//  lens 0.6 10                          defocus angle, focus distance
+//  material ground lambertian 0.5 0.5 0.5
+//  material steel metal 0.7 0.6 0.5 0.1 albedo, fuzz
+//  material glass dielectric 1.5        index of refraction
+//  material lamp diffuse_light 20 18 15 a light: what it gives off (well over 1 for a small bright one)
+//  sky 0.05                             how bright the sky is, 0 for black (the lights are all there is)
+//  environment sky.hdr 2 90             an HDR image (PFM or Radiance .hdr, relative to the scene file) for the sky
+//                                       instead, then optionally how bright and how far round the y axis in degrees
+//  sphere 0 -1000 0 1000 ground         center, radius, material name (defined above it)
+//  mesh bunny.ply steel                 OBJ or binary PLY file (relative to the scene file), material name
+//  shape tree tree.obj                  a mesh that is only drawn through instances, by name
+//  instance tree 5 0 2  0 45 0  1 2 1 bark   position, rotation around x y z in degrees, scale, material name
+//  frames 48 24                         an animation: frame count, frames per second
+//  key_camera 0.5  13 2 3  0 0 0  20 10 time in seconds, position, look at, vertical fov, focus distance
+//  key_sphere 3 0.5  4 1 0              sphere number (counting sphere lines from 0), time, center
+//
+//Every instance of a shape shares the one copy of it in memory. The shape called sphere is always there: a sphere of
+//radius 1 at the origin (scale it unevenly for ellipsoids).
+//
+//image/samples/max_depth are optional. Leave them out and whatever the camera is already set to stays.
+//
+//Without a frames line it's a still. With one, the camera and spheres move between their keys (see animation.h);
+//anything without keys stays where the rest of the file put it.
+//
+//Binary (.rtsb). The same thing laid out so loading is a handful of memcpys out of a memory mapped file, no
+//parsing. For scenes with millions of spheres. Little endian, everything 4 byte aligned:
+//
+//  rtsb_header
+//  material_count x rtsb_material
+//  sphere_count floats of center x, then center y, center z, radius, then sphere_count uint32 material indices
+//  mesh_count x (uint32 material, uint32 path length, the path padded with zeros to a multiple of 4 bytes)
+//  uint32 shape_count, uint32 instance_count, then shape_count x (uint32 path length, the path padded the same way,
+//  an empty path being the unit sphere), then instance_count x rtsb_instance. Only in version 2 (RTSCENE2) files
+//  and later.
+//  uint32 frame_count, uint32 camera key count, uint32 sphere key count, float fps, then the camera keys as
+//  rtsb_camera_key and the sphere keys as rtsb_sphere_key. Only in version 3 and later.
+//  float sky brightness. Only in version 4 and later.
+//  environment map path (padded the same way, empty for none), float intensity, float rotation. Only in version 5.
+//
+//Sphere positions are stored as float, even in the double precision build.
+
+struct material_desc {
+    material_kind kind = material_kind::lambertian;
+    color albedo = color(0.5, 0.5, 0.5); // lambertian and metal, and what a diffuse_light gives off
+    real fuzz = 0;                        // metal
+    real ir = 1.5;                        // dielectric
+};
+
+struct sphere_desc {
+    point3 center;
+    real radius;
+    uint32_t material;
+};
+
+struct mesh_desc {
+    std::string path; // An OBJ or PLY file.
+    uint32_t material;
+};
+
+struct instance_desc {
+    uint32_t shape;    // Into scene_description::shapes.
+    point3 position;
+    vec3 rotation;     // Degrees around x, then y, then z. See transform::place.
+    vec3 scale;
+    uint32_t material;
+};
+
+//Where the camera is at `time` seconds into an animation. Only position, look at, fov and focus distance move.
+struct camera_key {
+    double time;
+    point3 position;
+    point3 lookat;
+    double vfov;
+    double focus_dist;
+};
+
+//Where sphere number `sphere` (into scene_description::spheres) is at `time` seconds into an animation.
+struct sphere_key {
+    uint32_t sphere;
+    double time;
+    point3 center;
+};
+
+struct scene_description {
+    //Render settings. 0 means the scene doesn't say and the camera keeps its own.
+    int image_width = 0;
+    double aspect_ratio = 0;
+    int samples_per_pixel = 0;
+    int max_depth = 0;
+
+    //The view. Always applied.
+    double vfov = 90;
+    point3 position = point3(0,0,0);
+    point3 lookat   = point3(0,0,-1);
+    vec3   vup      = vec3(0,1,0);
+    double defocus_angle = 0;
+    double focus_dist = 10;
+
+    double sky = 1; // Brightness of the sky (camera::sky).
+    std::string environment;           // An HDR image for the sky instead (see environment.h). Empty for none.
+    double environment_intensity = 1;
+    double environment_rotation = 0;   // Degrees around y.
+
+    std::vector<material_desc> materials;
+    std::vector<sphere_desc> spheres;
+    std::vector<mesh_desc> meshes;
+    std::vector<std::string> shapes; // Mesh files for instances. An empty path is the unit sphere.
+    std::vector<instance_desc> instances;
+
+    //Animation. frames == 0 is a still image and the keys are ignored.
+    int frames = 0;
+    double fps = 24;
+    std::vector<camera_key> camera_keys;
+    std::vector<sphere_key> sphere_keys;
+
+    uint32_t lambertian(const color& albedo) {
+        material_desc m;
+        m.kind = material_kind::lambertian;
+        m.albedo = albedo;
+        return add_material(m);
+    }
+
+    uint32_t metal(const color& albedo, real fuzz) {
+        material_desc m;
+        m.kind = material_kind::metal;
+        m.albedo = albedo;
+        m.fuzz = fuzz;
+        return add_material(m);
+    }
+
+    uint32_t dielectric(real ir) {
+        material_desc m;
+        m.kind = material_kind::dielectric;
+        m.ir = ir;
+        return add_material(m);
+    }
+
+    uint32_t diffuse_light(const color& emit) {
+        material_desc m;
+        m.kind = material_kind::diffuse_light;
+        m.albedo = emit;
+        return add_material(m);
+    }
+
+    uint32_t add_material(const material_desc& m) {
+        materials.push_back(m);
+        return static_cast<uint32_t>(materials.size() - 1);
+    }
+
+    void sphere(const point3& center, real radius, uint32_t material) {
+        spheres.push_back(sphere_desc{center, radius, material});
+    }
+
+    void mesh(const std::string& path, uint32_t material) {
+        meshes.push_back(mesh_desc{path, material});
+    }
+
+    uint32_t shape(const std::string& path) {
+        shapes.push_back(path);
+        return static_cast<uint32_t>(shapes.size() - 1);
+    }
+
+    void instance(uint32_t shape, const point3& position, const vec3& rotation, const vec3& scale, uint32_t material) {
+        instances.push_back(instance_desc{shape, position, rotation, scale, material});
+    }
+
+    void key_camera(double time, const point3& at, const point3& look, double fov, double focus) {
+        camera_keys.push_back(camera_key{time, at, look, fov, focus});
+    }
+
+    void key_sphere(uint32_t sphere, double time, const point3& center) {
+        sphere_keys.push_back(sphere_key{sphere, time, center});
+    }
+};
+
+//Make the real materials for a scene. Element k is scene.materials[k].
+inline std::vector<const material*> build_materials(const scene_description& scene, material_table& materials) {
+    materials.reserve(scene.materials.size());
+
+    std::vector<const material*> made;
+    made.reserve(scene.materials.size());
+    for (const auto& m : scene.materials) {
+        switch (m.kind) {
+            case material_kind::lambertian: made.push_back(materials.add<lambertian>(m.albedo)); break;
+            case material_kind::metal:      made.push_back(materials.add<metal>(m.albedo, m.fuzz)); break;
+            case material_kind::dielectric: made.push_back(materials.add<dielectric>(m.ir)); break;
+            case material_kind::diffuse_light: made.push_back(materials.add<diffuse_light>(m.albedo)); break;
+        }
+    }
+    return made;
+}
+
+//Put all of a scene's spheres in one sphere_set and build its BVH.
+inline void build_spheres(const scene_description& scene, const std::vector<const material*>& made,
+                          sphere_set& spheres) {
+    spheres.reserve(spheres.size() + scene.spheres.size());
+    for (const auto& s : scene.spheres)
+        spheres.add(s.center, s.radius, made[s.material]);
+    spheres.build();
+}
+
+//Every sphere made of a diffuse_light goes in `lights`, for the camera to aim shadow rays at.
+inline void build_lights(const scene_description& scene, const std::vector<const material*>& made,
+                         const sphere_set& spheres, light_list& lights) {
+    size_t first = spheres.size() - scene.spheres.size(); // build_spheres added them after any already there.
+    for (size_t k = 0; k < scene.spheres.size(); k++) {
+        const auto& s = scene.spheres[k];
+        if (scene.materials[s.material].kind == material_kind::diffuse_light)
+            lights.add(spheres, first + k, s.radius, made[s.material]);
+    }
+    lights.build();
+}
+
+inline void apply_camera(const scene_description& scene, camera& cam) {
+    if (scene.image_width > 0)       cam.image_width = scene.image_width;
+    if (scene.aspect_ratio > 0)      cam.aspect_ratio = scene.aspect_ratio;
+    if (scene.samples_per_pixel > 0) cam.samples_per_pixel = scene.samples_per_pixel;
+    if (scene.max_depth > 0)         cam.max_depth = scene.max_depth;
+
+    cam.vfov     = scene.vfov;
+    cam.position = scene.position;
+    cam.lookat   = scene.lookat;
+    cam.vup      = scene.vup;
+
+    cam.defocus_angle = scene.defocus_angle;
+    cam.focus_dist    = scene.focus_dist;
+
+    cam.sky = scene.sky;
+}
+
+inline uint64_t scene_hash(const scene_description& scene);
+
+//Make everything in a scene into `world` (empty to start with): its materials, the spheres, each mesh loaded and
+//built, the instances, the light list and the environment map. Then point the camera at it (and at the lights). False
+//(and why in `error`) if a mesh or the environment map wouldn't load.
+inline bool build_scene(const scene_description& scene, scene_objects& world, camera& cam, std::string& error) {
+    auto made = build_materials(scene, world.materials);
+    build_spheres(scene, made, world.spheres);
+    build_lights(scene, made, world.spheres, world.lights);
+
+    world.meshes.resize(scene.meshes.size());
+    for (size_t k = 0; k < scene.meshes.size(); k++) {
+        auto& mesh = world.meshes[k];
+        if (!load_mesh(scene.meshes[k].path, mesh, error))
+            return false;
+        mesh.mat = made[scene.meshes[k].material];
+        mesh.build();
+    }
+
+    if (!scene.instances.empty()) {
+        for (const auto& path : scene.shapes) {
+            if (path.empty()) {
+                world.instances.add_shape(make_shared<sphere>(point3(0,0,0), 1, nullptr));
+                continue;
+            }
+            auto mesh = make_shared<triangle_mesh>();
+            if (!load_mesh(path, *mesh, error))
+                return false;
+            mesh->build();
+            world.instances.add_shape(mesh);
+        }
+        world.instances.reserve(scene.instances.size());
+        for (const auto& i : scene.instances)
+            world.instances.add(i.shape, transform::place(i.position, i.rotation, i.scale), made[i.material]);
+        world.instances.build();
+    }
+
+    if (!scene.environment.empty()) {
+        // The alias tables are built a row at a time in parallel. This pool is only for that, render makes its own.
+        thread_pool pool(cam.threads > 0 ? static_cast<unsigned>(cam.threads) : 0);
+        if (!world.environment.load(scene.environment, scene.environment_intensity, scene.environment_rotation, pool,
+                                    error))
+            return false;
+    }
+
+    apply_camera(scene, cam);
+    cam.lights = world.lights.empty() ? nullptr : &world.lights;
+    cam.environment = world.environment.empty() ? nullptr : &world.environment;
+    cam.scene_hash = scene_hash(scene);
+    return true;
+}
+
+inline bool parse_scene_text(const char* begin, const char* end, scene_description& scene, std::string& error) {
+    text_reader in(begin, end);
+
+    //Material names point straight into the text, which stays put while we parse. Spheres nearly always use the
+    //material defined just before them (generated scenes give every sphere its own), so that one is checked first.
+    //The map only gets filled in the first time a sphere wants some other one. A map of a million names costs
+    //seconds to build, so a scene that never needs it shouldn't pay for it.
+    std::vector<std::string_view> material_names;
+    std::unordered_map<std::string_view, uint32_t> names;
+    size_t names_indexed = 0;
+    auto find_material = [&](std::string_view name, uint32_t& material) {
+        if (!material_names.empty() && name == material_names.back()) {
+            material = static_cast<uint32_t>(material_names.size() - 1);
+            return true;
+        }
+        for (; names_indexed < material_names.size(); names_indexed++)
+            names[material_names[names_indexed]] = static_cast<uint32_t>(names_indexed);
+        auto found = names.find(name);
+        if (found == names.end())
+            return false;
+        material = found->second;
+        return true;
+    };
+
+    //Shapes are few, so a plain list. "sphere" is there from the start and only added to the scene when used.
+    std::vector<std::string_view> shape_names;
+    std::vector<uint32_t> shape_index;
+    auto find_shape = [&](std::string_view name, uint32_t& shape) {
+        for (size_t k = shape_names.size(); k-- > 0;) {
+            if (shape_names[k] == name) {
+                shape = shape_index[k];
+                return true;
+            }
+        }
+        if (name != "sphere")
+            return false;
+        shape_names.push_back(name);
+        shape_index.push_back(scene.shape(""));
+        shape = shape_index.back();
+        return true;
+    };
+
+    //Sphere keys count the spheres in this file.
+    size_t first_sphere = scene.spheres.size();
+
+    auto fail = [&](const std::string& what) {
+        error = "line " + std::to_string(in.line_number()) + ": " + what;
+        return false;
+    };
+
+    while (in.next_line()) {
+        auto keyword = in.word();
+        bool ok = true;
+
+        if (keyword == "sphere") {
+            // By far the most common line, so it goes first.
+            vec3 center;
+            double radius;
+            ok = in.vector(center) && in.number(radius);
+            if (ok) {
+                auto name = in.word();
+                uint32_t material;
+                if (!find_material(name, material))
+                    return fail("unknown material '" + std::string(name) + "'");
+                scene.sphere(center, static_cast<real>(radius), material);
+            }
+        } else if (keyword == "material") {
+            auto name = in.word();
+            auto kind = in.word();
+            material_desc m;
+            if (kind == "lambertian") {
+                m.kind = material_kind::lambertian;
+                ok = in.vector(m.albedo);
+            } else if (kind == "metal") {
+                double fuzz;
+                m.kind = material_kind::metal;
+                ok = in.vector(m.albedo) && in.number(fuzz);
+                m.fuzz = static_cast<real>(fuzz);
+            } else if (kind == "dielectric") {
+                double ir;
+                m.kind = material_kind::dielectric;
+                ok = in.number(ir);
+                m.ir = static_cast<real>(ir);
+            } else if (kind == "diffuse_light") {
+                m.kind = material_kind::diffuse_light;
+                ok = in.vector(m.albedo);
+            } else {
+                return fail("unknown material type '" + std::string(kind) + "'");
+            }
+            if (name.empty())
+                return fail("material needs a name");
+            if (ok) {
+                scene.add_material(m);
+                material_names.push_back(name);
+            }
+        } else if (keyword == "image") {
+            ok = in.number(scene.image_width) && in.number(scene.aspect_ratio);
+        } else if (keyword == "samples") {
+            ok = in.number(scene.samples_per_pixel);
+        } else if (keyword == "max_depth") {
+            ok = in.number(scene.max_depth);
+        } else if (keyword == "camera") {
+            ok = in.vector(scene.position) && in.vector(scene.lookat) && in.vector(scene.vup) && in.number(scene.vfov);
+        } else if (keyword == "lens") {
+            ok = in.number(scene.defocus_angle) && in.number(scene.focus_dist);
+        } else if (keyword == "sky") {
+            ok = in.number(scene.sky);
+        } else if (keyword == "environment") {
+            auto path = in.word();
+            if (path.empty())
+                return fail("environment needs a file");
+            scene.environment = std::string(path);
+            scene.environment_intensity = 1;
+            scene.environment_rotation = 0;
+            ok = in.at_line_end()
+                 || (in.number(scene.environment_intensity)
+                     && (in.at_line_end() || in.number(scene.environment_rotation)));
+        } else if (keyword == "instance") {
+            auto name = in.word();
+            point3 position;
+            vec3 rotation, scale;
+            ok = in.vector(position) && in.vector(rotation) && in.vector(scale);
+            if (ok) {
+                uint32_t shape, material;
+                if (!find_shape(name, shape))
+                    return fail("unknown shape '" + std::string(name) + "'");
+                auto material_name = in.word();
+                if (!find_material(material_name, material))
+                    return fail("unknown material '" + std::string(material_name) + "'");
+                if (scale.x() == 0 || scale.y() == 0 || scale.z() == 0)
+                    return fail("an instance can't be scaled to 0");
+                scene.instance(shape, position, rotation, scale, material);
+            }
+        } else if (keyword == "shape") {
+            auto name = in.word();
+            auto path = in.word();
+            if (name.empty() || path.empty())
+                return fail("shape needs a name and a file");
+            shape_names.push_back(name);
+            shape_index.push_back(scene.shape(std::string(path)));
+        } else if (keyword == "mesh") {
+            auto path = in.word();
+            auto name = in.word();
+            uint32_t material;
+            if (path.empty())
+                return fail("mesh needs a file");
+            if (!find_material(name, material))
+                return fail("unknown material '" + std::string(name) + "'");
+            scene.mesh(std::string(path), material);
+        } else if (keyword == "frames") {
+            ok = in.number(scene.frames) && in.number(scene.fps);
+            if (ok && (scene.frames < 0 || !(scene.fps > 0)))
+                return fail("frames needs a frame count and a frame rate above 0");
+        } else if (keyword == "key_camera") {
+            camera_key key;
+            ok = in.number(key.time) && in.vector(key.position) && in.vector(key.lookat) && in.number(key.vfov)
+                 && in.number(key.focus_dist);
+            if (ok)
+                scene.camera_keys.push_back(key);
+        } else if (keyword == "key_sphere") {
+            int sphere;
+            double time;
+            point3 center;
+            ok = in.number(sphere) && in.number(time) && in.vector(center);
+            if (ok && (sphere < 0 || first_sphere + static_cast<size_t>(sphere) >= scene.spheres.size()))
+                return fail("there's no sphere " + std::to_string(sphere) + " (yet)");
+            if (ok)
+                scene.key_sphere(static_cast<uint32_t>(first_sphere + sphere), time, center);
+        } else {
+            return fail("unknown keyword '" + std::string(keyword) + "'");
+        }
+
+        if (!ok)
+            return fail("bad or missing number after '" + std::string(keyword) + "'");
+        if (!in.at_line_end())
+            return fail("unexpected '" + std::string(in.word()) + "'");
+    }
+    return true;
+}
+
+//Version 1 (no instances), 2 (no animation), 3 (no sky) and 4 (no environment map) files still load. Everything is
+//written as version 5.
+static const char rtsb_magic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '5'};
+
+struct rtsb_header {
+    char     magic[8];
+    uint32_t material_count;
+    uint32_t sphere_count;
+    int32_t  image_width, samples_per_pixel, max_depth;
+    uint32_t mesh_count;      // Was always 0 before meshes, so older files still read fine.
+    float    aspect_ratio, vfov, defocus_angle, focus_dist;
+    float    position[3], lookat[3], vup[3];
+};
+
+struct rtsb_material {
+    uint32_t kind;
+    float albedo[3];
+    float fuzz;
+    float ir;
+};
+
+struct rtsb_instance {
+    uint32_t shape, material;
+    float position[3], rotation[3], scale[3];
+};
+
+struct rtsb_camera_key {
+    float time, position[3], lookat[3], vfov, focus_dist;
+};
+
+struct rtsb_sphere_key {
+    uint32_t sphere;
+    float time, center[3];
+};
+
+//Length prefixed, zero padded to 4 bytes. False if it runs off the end.
+inline bool read_rtsb_string(const char*& p, const char* end, std::string& s) {
+    uint32_t length;
+    if (static_cast<size_t>(end - p) < sizeof(length))
+        return false;
+    std::memcpy(&length, p, sizeof(length));
+    p += sizeof(length);
+    size_t padded = (static_cast<size_t>(length) + 3) & ~size_t(3);
+    if (static_cast<size_t>(end - p) < padded)
+        return false;
+    s.assign(p, length);
+    p += padded;
+    return true;
+}
+
+inline size_t rtsb_string_size(const std::string& s) {
+    return sizeof(uint32_t) + ((s.size() + 3) & ~size_t(3));
+}
+
+inline char* write_rtsb_string(char* out, const std::string& s) {
+    uint32_t length = static_cast<uint32_t>(s.size());
+    std::memcpy(out, &length, sizeof(length));
+    std::memcpy(out + sizeof(length), s.data(), s.size()); // The padding is already zero.
+    return out + rtsb_string_size(s);
+}
+
+inline bool parse_scene_binary(const char* data, size_t size, scene_description& scene, std::string& error) {
+    rtsb_header h;
+    if (size < sizeof(h)) {
+        error = "too short to be a scene";
+        return false;
+    }
+    std::memcpy(&h, data, sizeof(h));
+    if (std::memcmp(h.magic, rtsb_magic, sizeof(rtsb_magic) - 1) != 0 || h.magic[7] < '1' || h.magic[7] > '5') {
+        error = "not a binary scene";
+        return false;
+    }
+    int version = h.magic[7] - '0';
+
+    size_t n = h.sphere_count;
+    size_t needed = sizeof(h) + h.material_count * sizeof(rtsb_material) + n * (4 * sizeof(float) + sizeof(uint32_t));
+    if (size < needed) {
+        error = "file is cut short";
+        return false;
+    }
+
+    scene.image_width = h.image_width;
+    scene.samples_per_pixel = h.samples_per_pixel;
+    scene.max_depth = h.max_depth;
+    scene.aspect_ratio = h.aspect_ratio;
+    scene.vfov = h.vfov;
+    scene.defocus_angle = h.defocus_angle;
+    scene.focus_dist = h.focus_dist;
+    scene.position = point3(h.position[0], h.position[1], h.position[2]);
+    scene.lookat = point3(h.lookat[0], h.lookat[1], h.lookat[2]);
+    scene.vup = vec3(h.vup[0], h.vup[1], h.vup[2]);
+
+    const char* p = data + sizeof(h);
+    scene.materials.resize(h.material_count);
+    for (auto& m : scene.materials) {
+        rtsb_material raw;
+        std::memcpy(&raw, p, sizeof(raw));
+        p += sizeof(raw);
+        if (raw.kind >= static_cast<uint32_t>(material_kind_count)) {
+            error = "unknown material type";
+            return false;
+        }
+        m.kind = static_cast<material_kind>(raw.kind);
+        m.albedo = color(raw.albedo[0], raw.albedo[1], raw.albedo[2]);
+        m.fuzz = raw.fuzz;
+        m.ir = raw.ir;
+    }
+
+    // Straight out of the mapping into the arrays, then into the scene. memcpy because the mapping isn't promised
+    // to be aligned for floats if the file came from somewhere odd.
+    std::vector<float> column(n);
+    std::vector<uint32_t> mat(n);
+    size_t first = scene.spheres.size();
+    scene.spheres.resize(first + n);
+    for (int axis = 0; axis < 4; axis++) {
+        std::memcpy(column.data(), p, n * sizeof(float));
+        p += n * sizeof(float);
+        for (size_t k = 0; k < n; k++) {
+            auto& s = scene.spheres[first + k];
+            if (axis < 3)
+                s.center[axis] = column[k];
+            else
+                s.radius = column[k];
+        }
+    }
+    std::memcpy(mat.data(), p, n * sizeof(uint32_t));
+    p += n * sizeof(uint32_t);
+    for (size_t k = 0; k < n; k++) {
+        if (mat[k] >= h.material_count) {
+            error = "sphere " + std::to_string(k) + " uses a material that doesn't exist";
+            return false;
+        }
+        scene.spheres[first + k].material = mat[k];
+    }
+
+    const char* end = data + size;
+    for (uint32_t k = 0; k < h.mesh_count; k++) {
+        uint32_t material;
+        std::string path;
+        if (static_cast<size_t>(end - p) < sizeof(material)) {
+            error = "file is cut short";
+            return false;
+        }
+        std::memcpy(&material, p, sizeof(material));
+        p += sizeof(material);
+        if (!read_rtsb_string(p, end, path)) {
+            error = "file is cut short";
+            return false;
+        }
+        if (material >= h.material_count) {
+            error = "mesh " + std::to_string(k) + " uses a material that doesn't exist";
+            return false;
+        }
+        scene.mesh(path, material);
+    }
+    if (version < 2)
+        return true;
+
+    uint32_t counts[2]; // shapes, instances
+    if (static_cast<size_t>(end - p) < sizeof(counts)) {
+        error = "file is cut short";
+        return false;
+    }
+    std::memcpy(counts, p, sizeof(counts));
+    p += sizeof(counts);
+
+    uint32_t first_shape = static_cast<uint32_t>(scene.shapes.size());
+    for (uint32_t k = 0; k < counts[0]; k++) {
+        std::string path;
+        if (!read_rtsb_string(p, end, path)) {
+            error = "file is cut short";
+            return false;
+        }
+        scene.shape(path);
+    }
+
+    if (static_cast<size_t>(end - p) < counts[1] * sizeof(rtsb_instance)) {
+        error = "file is cut short";
+        return false;
+    }
+    scene.instances.reserve(scene.instances.size() + counts[1]);
+    for (uint32_t k = 0; k < counts[1]; k++) {
+        rtsb_instance raw;
+        std::memcpy(&raw, p, sizeof(raw));
+        p += sizeof(raw);
+        if (raw.shape >= counts[0] || raw.material >= h.material_count) {
+            error = "instance " + std::to_string(k) + " uses a shape or material that doesn't exist";
+            return false;
+        }
+        if (raw.scale[0] == 0 || raw.scale[1] == 0 || raw.scale[2] == 0) {
+            error = "instance " + std::to_string(k) + " is scaled to 0";
+            return false;
+        }
+        scene.instance(first_shape + raw.shape, point3(raw.position[0], raw.position[1], raw.position[2]),
+                       vec3(raw.rotation[0], raw.rotation[1], raw.rotation[2]),
+                       vec3(raw.scale[0], raw.scale[1], raw.scale[2]), raw.material);
+    }
+    if (version < 3)
+        return true;
+
+    uint32_t animation[3]; // frames, camera keys, sphere keys
+    float fps;
+    if (static_cast<size_t>(end - p) < sizeof(animation) + sizeof(fps)) {
+        error = "file is cut short";
+        return false;
+    }
+    std::memcpy(animation, p, sizeof(animation));
+    p += sizeof(animation);
+    std::memcpy(&fps, p, sizeof(fps));
+    p += sizeof(fps);
+    size_t key_bytes = animation[1] * sizeof(rtsb_camera_key) + animation[2] * sizeof(rtsb_sphere_key);
+    if (static_cast<size_t>(end - p) < key_bytes) {
+        error = "file is cut short";
+        return false;
+    }
+    // The same limits as the text format's frames line. !(fps > 0) catches NaN as well.
+    if (animation[0] > static_cast<uint32_t>(std::numeric_limits<int>::max()) || !(fps > 0)) {
+        error = "frames needs a frame count and a frame rate above 0";
+        return false;
+    }
+    scene.frames = static_cast<int>(animation[0]);
+    scene.fps = fps;
+    for (uint32_t k = 0; k < animation[1]; k++) {
+        rtsb_camera_key raw;
+        std::memcpy(&raw, p, sizeof(raw));
+        p += sizeof(raw);
+        scene.key_camera(raw.time, point3(raw.position[0], raw.position[1], raw.position[2]),
+                         point3(raw.lookat[0], raw.lookat[1], raw.lookat[2]), raw.vfov, raw.focus_dist);
+    }
+    for (uint32_t k = 0; k < animation[2]; k++) {
+        rtsb_sphere_key raw;
+        std::memcpy(&raw, p, sizeof(raw));
+        p += sizeof(raw);
+        if (raw.sphere >= n) {
+            error = "sphere key " + std::to_string(k) + " moves a sphere that doesn't exist";
+            return false;
+        }
+        scene.key_sphere(static_cast<uint32_t>(first + raw.sphere), raw.time,
+                         point3(raw.center[0], raw.center[1], raw.center[2]));
+    }
+    if (version < 4)
+        return true;
+
+    float sky;
+    if (static_cast<size_t>(end - p) < sizeof(sky)) {
+        error = "file is cut short";
+        return false;
+    }
+    std::memcpy(&sky, p, sizeof(sky));
+    p += sizeof(sky);
+    scene.sky = sky;
+    if (version < 5)
+        return true;
+
+    float environment[2];
+    if (!read_rtsb_string(p, end, scene.environment) || static_cast<size_t>(end - p) < sizeof(environment)) {
+        error = "file is cut short";
+        return false;
+    }
+    std::memcpy(environment, p, sizeof(environment));
+    p += sizeof(environment);
+    scene.environment_intensity = environment[0];
+    scene.environment_rotation = environment[1];
+    return true;
+}
+
+inline bool is_binary_scene_path(const std::string& path) {
+    return path.size() >= 5 && path.compare(path.size() - 5, 5, ".rtsb") == 0;
+}
+
+//Load a scene file (text or binary, going by the extension). On failure returns false and says why in `error`.
+inline bool load_scene(const std::string& path, scene_description& scene, std::string& error) {
+    mapped_file file;
+    if (!file.open(path)) {
+        error = "can't open " + path;
+        return false;
+    }
+    size_t first_mesh = scene.meshes.size();
+    size_t first_shape = scene.shapes.size();
+    std::string environment = scene.environment;
+    bool ok = is_binary_scene_path(path)
+              ? parse_scene_binary(file.data(), file.size(), scene, error)
+              : parse_scene_text(file.data(), file.data() + file.size(), scene, error);
+    if (!ok) {
+        error = path + ": " + error;
+        return false;
+    }
+
+    //Mesh and image files are relative to the scene file, not to wherever the renderer was started from.
+    auto slash = path.find_last_of('/');
+    if (slash != std::string::npos) {
+        for (size_t k = first_mesh; k < scene.meshes.size(); k++) {
+            auto& m = scene.meshes[k];
+            if (!m.path.empty() && m.path[0] != '/')
+                m.path = path.substr(0, slash + 1) + m.path;
+        }
+        for (size_t k = first_shape; k < scene.shapes.size(); k++) {
+            auto& s = scene.shapes[k];
+            if (!s.empty() && s[0] != '/')
+                s = path.substr(0, slash + 1) + s;
+        }
+        if (scene.environment != environment && !scene.environment.empty() && scene.environment[0] != '/')
+            scene.environment = path.substr(0, slash + 1) + scene.environment;
+    }
+    return true;
+}
+
+inline std::vector<char> encode_scene_binary(const scene_description& scene) {
+    rtsb_header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, rtsb_magic, sizeof(rtsb_magic));
+    h.material_count = static_cast<uint32_t>(scene.materials.size());
+    h.sphere_count = static_cast<uint32_t>(scene.spheres.size());
+    h.image_width = scene.image_width;
+    h.samples_per_pixel = scene.samples_per_pixel;
+    h.max_depth = scene.max_depth;
+    h.mesh_count = static_cast<uint32_t>(scene.meshes.size());
+    h.aspect_ratio = static_cast<float>(scene.aspect_ratio);
+    h.vfov = static_cast<float>(scene.vfov);
+    h.defocus_angle = static_cast<float>(scene.defocus_angle);
+    h.focus_dist = static_cast<float>(scene.focus_dist);
+    for (int k = 0; k < 3; k++) {
+        h.position[k] = static_cast<float>(scene.position[k]);
+        h.lookat[k] = static_cast<float>(scene.lookat[k]);
+        h.vup[k] = static_cast<float>(scene.vup[k]);
+    }
+
+    size_t n = scene.spheres.size();
+    size_t extra_bytes = 2 * sizeof(uint32_t) + scene.instances.size() * sizeof(rtsb_instance)
+                         + 3 * sizeof(uint32_t) + sizeof(float) + scene.camera_keys.size() * sizeof(rtsb_camera_key)
+                         + scene.sphere_keys.size() * sizeof(rtsb_sphere_key) + sizeof(float)
+                         + rtsb_string_size(scene.environment) + 2 * sizeof(float);
+    for (const auto& m : scene.meshes)
+        extra_bytes += sizeof(uint32_t) + rtsb_string_size(m.path);
+    for (const auto& s : scene.shapes)
+        extra_bytes += rtsb_string_size(s);
+    std::vector<char> bytes(sizeof(h) + scene.materials.size() * sizeof(rtsb_material)
+                            + n * (4 * sizeof(float) + sizeof(uint32_t)) + extra_bytes);
+    char* out = bytes.data();
+    std::memcpy(out, &h, sizeof(h));
+    out += sizeof(h);
+
+    for (const auto& m : scene.materials) {
+        rtsb_material raw;
+        raw.kind = static_cast<uint32_t>(m.kind);
+        for (int k = 0; k < 3; k++)
+            raw.albedo[k] = static_cast<float>(m.albedo[k]);
+        raw.fuzz = static_cast<float>(m.fuzz);
+        raw.ir = static_cast<float>(m.ir);
+        std::memcpy(out, &raw, sizeof(raw));
+        out += sizeof(raw);
+    }
+
+    for (int axis = 0; axis < 4; axis++) {
+        for (const auto& s : scene.spheres) {
+            float v = static_cast<float>(axis < 3 ? s.center[axis] : s.radius);
+            std::memcpy(out, &v, sizeof(v));
+            out += sizeof(v);
+        }
+    }
+    for (const auto& s : scene.spheres) {
+        std::memcpy(out, &s.material, sizeof(s.material));
+        out += sizeof(s.material);
+    }
+    for (const auto& m : scene.meshes) {
+        std::memcpy(out, &m.material, sizeof(m.material));
+        out = write_rtsb_string(out + sizeof(m.material), m.path);
+    }
+
+    uint32_t counts[2] = {static_cast<uint32_t>(scene.shapes.size()), static_cast<uint32_t>(scene.instances.size())};
+    std::memcpy(out, counts, sizeof(counts));
+    out += sizeof(counts);
+    for (const auto& s : scene.shapes)
+        out = write_rtsb_string(out, s);
+    for (const auto& i : scene.instances) {
+        rtsb_instance raw;
+        raw.shape = i.shape;
+        raw.material = i.material;
+        for (int k = 0; k < 3; k++) {
+            raw.position[k] = static_cast<float>(i.position[k]);
+            raw.rotation[k] = static_cast<float>(i.rotation[k]);
+            raw.scale[k] = static_cast<float>(i.scale[k]);
+        }
+        std::memcpy(out, &raw, sizeof(raw));
+        out += sizeof(raw);
+    }
+
+    uint32_t animation[3] = {static_cast<uint32_t>(scene.frames), static_cast<uint32_t>(scene.camera_keys.size()),
+                             static_cast<uint32_t>(scene.sphere_keys.size())};
+    float fps = static_cast<float>(scene.fps);
+    std::memcpy(out, animation, sizeof(animation));
+    out += sizeof(animation);
+    std::memcpy(out, &fps, sizeof(fps));
+    out += sizeof(fps);
+    for (const auto& key : scene.camera_keys) {
+        rtsb_camera_key raw;
+        raw.time = static_cast<float>(key.time);
+        for (int k = 0; k < 3; k++) {
+            raw.position[k] = static_cast<float>(key.position[k]);
+            raw.lookat[k] = static_cast<float>(key.lookat[k]);
+        }
+        raw.vfov = static_cast<float>(key.vfov);
+        raw.focus_dist = static_cast<float>(key.focus_dist);
+        std::memcpy(out, &raw, sizeof(raw));
+        out += sizeof(raw);
+    }
+    for (const auto& key : scene.sphere_keys) {
+        rtsb_sphere_key raw;
+        raw.sphere = key.sphere;
+        raw.time = static_cast<float>(key.time);
+        for (int k = 0; k < 3; k++)
+            raw.center[k] = static_cast<float>(key.center[k]);
+        std::memcpy(out, &raw, sizeof(raw));
+        out += sizeof(raw);
+    }
+    float sky = static_cast<float>(scene.sky);
+    std::memcpy(out, &sky, sizeof(sky));
+    out = write_rtsb_string(out + sizeof(sky), scene.environment);
+    float environment[2] = {static_cast<float>(scene.environment_intensity),
+                            static_cast<float>(scene.environment_rotation)};
+    std::memcpy(out, environment, sizeof(environment));
+    return bytes;
+}
+
+//A fingerprint of everything in a scene but its samples per pixel (asking for more of those is how a render gets
+//carried on, see camera::render_progressive), for telling one scene's checkpoints from another's. FNV-1a over the
+//binary file the scene would save as. Mesh and image files count by name only.
+inline uint64_t scene_hash(const scene_description& scene) {
+    std::vector<char> bytes = encode_scene_binary(scene);
+    std::memset(bytes.data() + offsetof(rtsb_header, samples_per_pixel), 0, sizeof(int32_t));
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : bytes) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+//Writes numbers the shortest way that still reads back to exactly the same float (or double).
+class scene_text_writer {
+public:
+    std::string text;
+
+    scene_text_writer& word(const std::string& w) {
+        separate();
+        text += w;
+        return *this;
+    }
+
+    template <typename T>
+    scene_text_writer& number(T value) {
+        separate();
+        char buffer[32];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        text.append(buffer, result.ptr);
+        return *this;
+    }
+
+    scene_text_writer& vector(const vec3& v) { return number(v.x()).number(v.y()).number(v.z()); }
+
+    void end_line() { text += '\n'; }
+
+private:
+    void separate() {
+        if (!text.empty() && text.back() != '\n')
+            text += ' ';
+    }
+};
+
+inline std::vector<char> encode_scene_text(const scene_description& scene) {
+    scene_text_writer out;
+    if (scene.image_width > 0) {
+        out.word("image").number(scene.image_width).number(scene.aspect_ratio).end_line();
+    }
+    if (scene.samples_per_pixel > 0)
+        out.word("samples").number(scene.samples_per_pixel).end_line();
+    if (scene.max_depth > 0)
+        out.word("max_depth").number(scene.max_depth).end_line();
+    out.word("camera").vector(scene.position).vector(scene.lookat).vector(scene.vup).number(scene.vfov).end_line();
+    out.word("lens").number(scene.defocus_angle).number(scene.focus_dist).end_line();
+    if (scene.sky != 1)
+        out.word("sky").number(scene.sky).end_line();
+    if (!scene.environment.empty()) {
+        out.word("environment").word(scene.environment).number(scene.environment_intensity)
+           .number(scene.environment_rotation).end_line();
+    }
+    out.end_line();
+
+    //Each material goes right before the first sphere that uses it. The reader looks the last material up without
+    //touching its name map, so with most spheres having their own material this is what keeps big scenes fast.
+    std::vector<bool> written(scene.materials.size(), false);
+    auto write_material = [&](uint32_t k) {
+        const auto& m = scene.materials[k];
+        out.word("material").word("m" + std::to_string(k)).word(material_kind_name(m.kind));
+        switch (m.kind) {
+            case material_kind::lambertian: out.vector(m.albedo); break;
+            case material_kind::metal:      out.vector(m.albedo).number(m.fuzz); break;
+            case material_kind::dielectric: out.number(m.ir); break;
+            case material_kind::diffuse_light: out.vector(m.albedo); break;
+        }
+        out.end_line();
+        written[k] = true;
+    };
+
+    for (const auto& s : scene.spheres) {
+        if (!written[s.material])
+            write_material(s.material);
+        out.word("sphere").vector(s.center).number(s.radius).word("m" + std::to_string(s.material)).end_line();
+    }
+    for (uint32_t k = 0; k < scene.materials.size(); k++)
+        if (!written[k])
+            write_material(k);
+    for (const auto& m : scene.meshes)
+        out.word("mesh").word(m.path).word("m" + std::to_string(m.material)).end_line();
+
+    auto shape_name = [&](uint32_t k) { return scene.shapes[k].empty() ? std::string("sphere") : "s" + std::to_string(k); };
+    for (uint32_t k = 0; k < scene.shapes.size(); k++)
+        if (!scene.shapes[k].empty())
+            out.word("shape").word(shape_name(k)).word(scene.shapes[k]).end_line();
+    for (const auto& i : scene.instances) {
+        out.word("instance").word(shape_name(i.shape)).vector(i.position).vector(i.rotation).vector(i.scale)
+           .word("m" + std::to_string(i.material)).end_line();
+    }
+
+    if (scene.frames > 0) {
+        out.end_line();
+        out.word("frames").number(scene.frames).number(scene.fps).end_line();
+    }
+    for (const auto& key : scene.camera_keys) {
+        out.word("key_camera").number(key.time).vector(key.position).vector(key.lookat).number(key.vfov)
+           .number(key.focus_dist).end_line();
+    }
+    for (const auto& key : scene.sphere_keys)
+        out.word("key_sphere").number(key.sphere).number(key.time).vector(key.center).end_line();
+    return std::vector<char>(out.text.begin(), out.text.end());
+}
+
+//Save a scene, binary if the name ends in .rtsb and text otherwise.
+inline bool save_scene(const std::string& path, const scene_description& scene) {
+    return write_file(path, is_binary_scene_path(path) ? encode_scene_binary(scene) : encode_scene_text(scene));
+}
+
+#endif //SCENE_FILE_H
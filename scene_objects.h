@@ -0,0 +1,60 @@
+#ifndef SCENE_OBJECTS_H
+#define SCENE_OBJECTS_H
+
+#include "common_constants.h"
+
+#include "environment.h"
+#include "hittable.h"
+#include "instance.h"
+#include "lights.h"
+#include "material.h"
+#include "sphere_set.h"
+#include "triangle_mesh.h"
+
+#include <vector>
+
+//Everything a scene turns into, stored by type. Every sphere in one packed sphere_set, the meshes side by side in
+//one vector, every instance in one instance_set, and the materials they all point at in one material_table. The lights
+//are a list on the side, pointing into the sphere_set, and so is the environment map if the scene has one.
+//
+//This replaces a hittable_list of shared_ptrs as the world. hit() asks each group straight out: no list of pointers
+//to chase, no reference counts, and the calls are on known types so there's no virtual call to get to them either.
+//One object also means the whole scene goes away in one go (a few dozen frees rather than one per object).
+//build_scene() in scene_file.h fills one in.
+class scene_objects : public hittable {
+public:
+    material_table materials;
+    sphere_set spheres;
+    std::vector<triangle_mesh> meshes;
+    instance_set instances;
+    light_list lights; // The spheres in `spheres` that glow.
+    environment_map environment; // The sky, if it's an image. Not part of hit(), rays that escape find it.
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        bool hit_anything = false;
+
+        if (spheres.hit(r, ray_t, rec)) {
+            hit_anything = true;
+            ray_t.max = rec.t;
+        }
+        for (const auto& mesh : meshes) {
+            if (mesh.hit(r, ray_t, rec)) {
+                hit_anything = true;
+                ray_t.max = rec.t;
+            }
+        }
+        if (instances.hit(r, ray_t, rec))
+            hit_anything = true;
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override {
+        aabb box(spheres.bounding_box(), instances.bounding_box());
+        for (const auto& mesh : meshes)
+            box = aabb(box, mesh.bounding_box());
+        return box;
+    }
+};
+
+#endif //SCENE_OBJECTS_H
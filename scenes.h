@@ -0,0 +1,275 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "common_constants.h"
+
+#include "color.h"
+#include "scene_file.h"
+
+#include <cmath>
+#include <string>
+
+//The built in scenes, out of main() so the benchmark (rt_bench.cpp) renders exactly the same ones.
+//Each one returns a scene_description (see scene_file.h): turn it into something renderable with build_scene(), or
+//write it out with save_scene(). The resolution, sample count and so on are left to whoever is rendering. They all
+//start the random numbers from the same place, so a scene is identical every time.
+
+//The cover of Ray Tracing in One Weekend. Three big spheres and a field of small random ones. grid is how far the
+//field goes in each direction: 11 is the original (about 480 spheres), every doubling is about 4x the spheres.
+inline scene_description random_spheres(int grid = 11) {
+    scene_description scene;
+    thread_rng() = pcg32();
+
+    auto ground_material = scene.lambertian(color(0.5, 0.5, 0.5));
+    scene.sphere(point3(0,-1000,0), 1000, ground_material);
+
+    for (int a = -grid; a < grid; a++) {
+        for (int b = -grid; b < grid; b++) {
+            auto choose_mat = random_double();
+            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                uint32_t sphere_material;
+
+                if (choose_mat < 0.8) {
+                    // diffuse
+                    auto albedo = color::random() * color::random();
+                    sphere_material = scene.lambertian(albedo);
+                    scene.sphere(center, 0.2, sphere_material);
+                } else if (choose_mat < 0.95) {
+                    // metal
+                    auto albedo = color::random(0.5, 1);
+                    auto fuzz = random_double(0, 0.5);
+                    sphere_material = scene.metal(albedo, fuzz);
+                    scene.sphere(center, 0.2, sphere_material);
+                } else {
+                    // glass
+                    sphere_material = scene.dielectric(1.5);
+                    scene.sphere(center, 0.2, sphere_material);
+                }
+            }
+        }
+    }
+
+    auto material1 = scene.dielectric(1.5);
+    scene.sphere(point3(0, 1, 0), 1.0, material1);
+
+    auto material2 = scene.lambertian(color(0.4, 0.2, 0.1));
+    scene.sphere(point3(-4, 1, 0), 1.0, material2);
+
+    auto material3 = scene.metal(color(0.7, 0.6, 0.5), 0.0);
+    scene.sphere(point3(4, 1, 0), 1.0, material3);
+
+    scene.vfov     = 20;
+    scene.position = point3(13,2,3);
+    scene.lookat   = point3(0,0,0);
+    scene.vup      = vec3(0,1,0);
+
+    scene.defocus_angle = 0.6;
+    scene.focus_dist    = 10.0;
+    return scene;
+}
+
+//Nearly everything is glass. Glass never absorbs anything so paths only end by escaping, which makes for long paths
+//and lots of random_double() calls in dielectric::scatter.
+inline scene_description glass_spheres() {
+    scene_description scene;
+    thread_rng() = pcg32();
+
+    scene.sphere(point3(0,-1000,0), 1000, scene.lambertian(color(0.5, 0.5, 0.5)));
+
+    for (int a = -8; a < 8; a++) {
+        for (int b = -8; b < 8; b++) {
+            auto radius = random_double(0.2, 0.45);
+            point3 center(a + 0.5*random_double(), radius, b + 0.5*random_double());
+            if (random_double() < 0.9)
+                scene.sphere(center, radius, scene.dielectric(random_double(1.3, 1.8)));
+            else
+                scene.sphere(center, radius, scene.metal(color::random(0.7, 1), 0.0));
+        }
+    }
+    scene.sphere(point3(0, 1.5, 0), 1.5, scene.dielectric(1.5));
+
+    scene.vfov     = 30;
+    scene.position = point3(10,4,6);
+    scene.lookat   = point3(0,0.5,0);
+    scene.vup      = vec3(0,1,0);
+
+    scene.defocus_angle = 0;
+    scene.focus_dist    = 10.0;
+    return scene;
+}
+
+//A pile of mirrors and bright diffuse spheres packed close together and looked at from up close. Rays bounce around
+//in between them a long time before they get out, so this one is all about the depth loop (and Russian roulette).
+inline scene_description mirror_pile() {
+    scene_description scene;
+    thread_rng() = pcg32();
+
+    scene.sphere(point3(0,-1000,0), 1000, scene.metal(color(0.9, 0.9, 0.9), 0.02));
+
+    for (int x = -6; x <= 6; x++) {
+        for (int y = 0; y < 3; y++) {
+            for (int z = -6; z <= 6; z++) {
+                point3 center(2.0*x, 0.9 + 1.8*y, 2.0*z);
+                if (random_double() < 0.7) {
+                    auto albedo = color::random(0.85, 1); // Separate lines so the random numbers come in a set order.
+                    auto fuzz = random_double(0, 0.05);
+                    scene.sphere(center, 0.9, scene.metal(albedo, fuzz));
+                } else {
+                    scene.sphere(center, 0.9, scene.lambertian(color::random(0.8, 0.95)));
+                }
+            }
+        }
+    }
+
+    scene.vfov     = 50;
+    scene.position = point3(1,3,14);
+    scene.lookat   = point3(0,1.5,0);
+    scene.vup      = vec3(0,1,0);
+
+    scene.defocus_angle = 0;
+    scene.focus_dist    = 10.0;
+    return scene;
+}
+
+//Night time: the sky is off and the only light comes from a few small lamps hanging over a field of spheres. Each
+//lamp covers a tiny part of the sky seen from anywhere, so a path that has to bounce into one hardly ever does. This
+//is the scene for next event estimation (camera::sample_lights): without it, it's fireflies for thousands of samples.
+inline scene_description lit_spheres() {
+    scene_description scene;
+    thread_rng() = pcg32();
+    scene.sky = 0;
+
+    scene.sphere(point3(0,-1000,0), 1000, scene.lambertian(color(0.5, 0.5, 0.5)));
+
+    for (int a = -6; a < 6; a++) {
+        for (int b = -6; b < 6; b++) {
+            auto choose_mat = random_double();
+            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+            if (choose_mat < 0.7) {
+                auto albedo = color::random() * color::random();
+                scene.sphere(center, 0.2, scene.lambertian(albedo));
+            } else if (choose_mat < 0.9) {
+                auto albedo = color::random(0.5, 1);
+                auto fuzz = random_double(0.1, 0.5);
+                scene.sphere(center, 0.2, scene.metal(albedo, fuzz));
+            } else {
+                scene.sphere(center, 0.2, scene.dielectric(1.5));
+            }
+        }
+    }
+
+    scene.sphere(point3(0, 1, 0), 1.0, scene.dielectric(1.5));
+    scene.sphere(point3(-4, 1, 0), 1.0, scene.lambertian(color(0.4, 0.2, 0.1)));
+    scene.sphere(point3(4, 1, 0), 1.0, scene.metal(color(0.7, 0.6, 0.5), 0.2));
+
+    // The lamps: small and bright, warm ones and a cold one.
+    scene.sphere(point3(-2, 2.5, 1.5), 0.1, scene.diffuse_light(color(200, 150, 100)));
+    scene.sphere(point3(2, 2.2, -1.5), 0.1, scene.diffuse_light(color(200, 150, 100)));
+    scene.sphere(point3(6, 1.5, 2.5), 0.08, scene.diffuse_light(color(100, 130, 260)));
+
+    scene.vfov     = 25;
+    scene.position = point3(13,3,3);
+    scene.lookat   = point3(0,0.5,0);
+    scene.vup      = vec3(0,1,0);
+
+    scene.defocus_angle = 0;
+    scene.focus_dist    = 10.0;
+    return scene;
+}
+
+//side x side trees on a plain, a million by default. Every tree is an instance of the one unit sphere, stretched
+//into a tall ellipsoid, tilted a little and turned, sharing a handful of materials. Memory is a small record per
+//tree, not a sphere and a material each.
+inline scene_description forest(int side = 1000) {
+    scene_description scene;
+    thread_rng() = pcg32();
+
+    scene.sphere(point3(0,-10000,0), 10000, scene.lambertian(color(0.45, 0.4, 0.3)));
+
+    uint32_t greens[8];
+    for (auto& g : greens) {
+        auto albedo = color(random_double(0.05, 0.2), random_double(0.3, 0.6), random_double(0.05, 0.2));
+        g = scene.lambertian(albedo);
+    }
+
+    auto tree = scene.shape(""); // The unit sphere.
+    scene.instances.reserve(static_cast<size_t>(side) * side);
+    for (int x = 0; x < side; x++) {
+        for (int z = 0; z < side; z++) {
+            auto radius = random_double(0.3, 0.6);
+            auto height = random_double(1.0, 2.5);
+            auto px = 2.0*(x - side/2) + random_double(-0.5, 0.5);
+            auto pz = -2.0*z + random_double(-0.5, 0.5);
+            auto tilt = random_double(-8, 8);
+            auto turn = random_double(0, 360);
+            auto material = greens[static_cast<int>(random_double(0, 8)) & 7];
+            scene.instance(tree, point3(px, height, pz), vec3(tilt, turn, 0), vec3(radius, height, radius), material);
+        }
+    }
+
+    scene.vfov     = 40;
+    scene.position = point3(0,12,14);
+    scene.lookat   = point3(0,0,-20);
+    scene.vup      = vec3(0,1,0);
+
+    scene.defocus_angle = 0;
+    scene.focus_dist    = 10.0;
+    return scene;
+}
+
+//random_spheres as a short animation: the camera swings round the field while the three big spheres and every
+//tenth small one bounce. The spheres get a key every frame (a bounce isn't a straight line), the camera only a few
+//and the curve through them does the rest.
+inline scene_description bouncing_spheres(int frames = 48, double fps = 24) {
+    scene_description scene = random_spheres();
+    scene.frames = frames;
+    scene.fps = fps;
+
+    double length = frames / fps;
+    for (int k = 0; k <= 4; k++) {
+        double time = length * k / 4;
+        double angle = degrees_to_radians(13 + 12.0 * k);
+        scene.key_camera(time, point3(13.34 * std::cos(angle), 2 + 0.5 * k, 13.34 * std::sin(angle)),
+                         point3(0, 0.5, 0), 20, 10);
+    }
+
+    // Everything but the ground (sphere 0). The three big ones are at the end.
+    uint32_t count = static_cast<uint32_t>(scene.spheres.size());
+    for (uint32_t k = 1; k < count; k++) {
+        bool big = k + 3 >= count;
+        if (!big && k % 10 != 0)
+            continue;
+        point3 rest = scene.spheres[k].center;
+        double height = big ? 1.2 : 0.6;
+        double phase = 0.37 * k;
+        for (int frame = 0; frame <= frames; frame++) {
+            double time = frame / fps;
+            double bounce = height * std::fabs(std::sin(2 * pi * time / length * 2 + phase));
+            scene.key_sphere(k, time, rest + vec3(0, bounce, 0));
+        }
+    }
+    return scene;
+}
+
+//A built in scene by name, for the command line. False if there's no such scene.
+inline bool builtin_scene(const std::string& name, scene_description& scene) {
+    if (name == "random_spheres")
+        scene = random_spheres();
+    else if (name == "glass_spheres")
+        scene = glass_spheres();
+    else if (name == "mirror_pile")
+        scene = mirror_pile();
+    else if (name == "forest")
+        scene = forest();
+    else if (name == "bouncing_spheres")
+        scene = bouncing_spheres();
+    else if (name == "lit_spheres")
+        scene = lit_spheres();
+    else
+        return false;
+    return true;
+}
+
+#endif //SCENES_H
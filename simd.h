@@ -0,0 +1,139 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "precision.h"
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+//Bits and pieces for the hand vectorized kernels.
+//The program is built for plain x86-64 (SSE2) so it runs anywhere. AVX2 code paths are compiled separately with
+//RT_TARGET_AVX2 on the function and only get called after cpu_has_avx2() says the CPU can run them.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RT_X86 1
+#include <immintrin.h>
+#else
+#define RT_X86 0
+#endif
+
+#if RT_X86 && (defined(__GNUC__) || defined(__clang__))
+#define RT_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define RT_TARGET_AVX2 // MSVC lets you use any intrinsic without telling it first.
+#endif
+
+#if RT_X86 && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+//Asks the CPU (CPUID) if it has AVX2. Also needs the OS to save the wide registers on a context switch, which
+//__builtin_cpu_supports checks for us. On MSVC we check XGETBV by hand.
+inline bool cpu_has_avx2() {
+#if RT_X86 && (defined(__GNUC__) || defined(__clang__))
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+#elif RT_X86 && defined(_MSC_VER)
+    static const bool has = [] {
+        int info[4];
+        __cpuid(info, 1);
+        bool os_saves_ymm = (info[2] & (1 << 27)) && ((_xgetbv(0) & 6) == 6);
+        bool avx = info[2] & (1 << 28);
+        __cpuidex(info, 7, 0);
+        return os_saves_ymm && avx && (info[1] & (1 << 5));
+    }();
+    return has;
+#else
+    return false;
+#endif
+}
+
+//One AVX2 register of `real`s: 8 floats, or 4 doubles in the double precision build. The kernels are written against
+//these thin wrappers so the same code serves both. They carry the AVX2 target too so they inline into AVX2 kernels.
+#if RT_X86
+#ifdef RT_DOUBLE_PRECISION
+using simd_real = __m256d;
+constexpr int simd_width = 4;
+
+RT_TARGET_AVX2 inline simd_real simd_set1(real x) { return _mm256_set1_pd(x); }
+RT_TARGET_AVX2 inline simd_real simd_zero() { return _mm256_setzero_pd(); }
+RT_TARGET_AVX2 inline simd_real simd_lane_index() { return _mm256_set_pd(3, 2, 1, 0); }
+RT_TARGET_AVX2 inline simd_real simd_load(const real* p) { return _mm256_load_pd(p); }
+RT_TARGET_AVX2 inline simd_real simd_loadu(const real* p) { return _mm256_loadu_pd(p); }
+RT_TARGET_AVX2 inline void simd_store(real* p, simd_real v) { _mm256_store_pd(p, v); }
+RT_TARGET_AVX2 inline simd_real simd_add(simd_real a, simd_real b) { return _mm256_add_pd(a, b); }
+RT_TARGET_AVX2 inline simd_real simd_sub(simd_real a, simd_real b) { return _mm256_sub_pd(a, b); }
+RT_TARGET_AVX2 inline simd_real simd_mul(simd_real a, simd_real b) { return _mm256_mul_pd(a, b); }
+RT_TARGET_AVX2 inline simd_real simd_div(simd_real a, simd_real b) { return _mm256_div_pd(a, b); }
+RT_TARGET_AVX2 inline simd_real simd_sqrt(simd_real a) { return _mm256_sqrt_pd(a); }
+RT_TARGET_AVX2 inline simd_real simd_min(simd_real a, simd_real b) { return _mm256_min_pd(a, b); }
+RT_TARGET_AVX2 inline simd_real simd_max(simd_real a, simd_real b) { return _mm256_max_pd(a, b); }
+RT_TARGET_AVX2 inline simd_real simd_lt(simd_real a, simd_real b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+RT_TARGET_AVX2 inline simd_real simd_gt(simd_real a, simd_real b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+RT_TARGET_AVX2 inline simd_real simd_ge(simd_real a, simd_real b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+RT_TARGET_AVX2 inline simd_real simd_and(simd_real a, simd_real b) { return _mm256_and_pd(a, b); }
+RT_TARGET_AVX2 inline simd_real simd_or(simd_real a, simd_real b) { return _mm256_or_pd(a, b); }
+RT_TARGET_AVX2 inline simd_real simd_select(simd_real mask, simd_real if_true, simd_real if_false) {
+    return _mm256_blendv_pd(if_false, if_true, mask);
+}
+RT_TARGET_AVX2 inline int simd_mask(simd_real mask) { return _mm256_movemask_pd(mask); }
+#else
+using simd_real = __m256;
+constexpr int simd_width = 8;
+
+RT_TARGET_AVX2 inline simd_real simd_set1(real x) { return _mm256_set1_ps(x); }
+RT_TARGET_AVX2 inline simd_real simd_zero() { return _mm256_setzero_ps(); }
+RT_TARGET_AVX2 inline simd_real simd_lane_index() { return _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0); }
+RT_TARGET_AVX2 inline simd_real simd_load(const real* p) { return _mm256_load_ps(p); }
+RT_TARGET_AVX2 inline simd_real simd_loadu(const real* p) { return _mm256_loadu_ps(p); }
+RT_TARGET_AVX2 inline void simd_store(real* p, simd_real v) { _mm256_store_ps(p, v); }
+RT_TARGET_AVX2 inline simd_real simd_add(simd_real a, simd_real b) { return _mm256_add_ps(a, b); }
+RT_TARGET_AVX2 inline simd_real simd_sub(simd_real a, simd_real b) { return _mm256_sub_ps(a, b); }
+RT_TARGET_AVX2 inline simd_real simd_mul(simd_real a, simd_real b) { return _mm256_mul_ps(a, b); }
+RT_TARGET_AVX2 inline simd_real simd_div(simd_real a, simd_real b) { return _mm256_div_ps(a, b); }
+RT_TARGET_AVX2 inline simd_real simd_sqrt(simd_real a) { return _mm256_sqrt_ps(a); }
+RT_TARGET_AVX2 inline simd_real simd_min(simd_real a, simd_real b) { return _mm256_min_ps(a, b); }
+RT_TARGET_AVX2 inline simd_real simd_max(simd_real a, simd_real b) { return _mm256_max_ps(a, b); }
+RT_TARGET_AVX2 inline simd_real simd_lt(simd_real a, simd_real b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+RT_TARGET_AVX2 inline simd_real simd_gt(simd_real a, simd_real b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+RT_TARGET_AVX2 inline simd_real simd_ge(simd_real a, simd_real b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+RT_TARGET_AVX2 inline simd_real simd_and(simd_real a, simd_real b) { return _mm256_and_ps(a, b); }
+RT_TARGET_AVX2 inline simd_real simd_or(simd_real a, simd_real b) { return _mm256_or_ps(a, b); }
+RT_TARGET_AVX2 inline simd_real simd_select(simd_real mask, simd_real if_true, simd_real if_false) {
+    return _mm256_blendv_ps(if_false, if_true, mask);
+}
+RT_TARGET_AVX2 inline int simd_mask(simd_real mask) { return _mm256_movemask_ps(mask); }
+#endif
+#else
+constexpr int simd_width = 4; // Only used for data layout off x86. The kernels fall back to scalar code.
+#endif
+
+//std::allocator only promises alignof(T). The vector loads want 32 bytes.
+template <typename T, size_t Alignment = 32>
+struct aligned_allocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind { using other = aligned_allocator<U, Alignment>; };
+
+    aligned_allocator() = default;
+    template <typename U>
+    aligned_allocator(const aligned_allocator<U, Alignment>&) {}
+
+    T* allocate(size_t n) {
+        void* p = ::operator new(n * sizeof(T), std::align_val_t(Alignment));
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t) {
+        ::operator delete(p, std::align_val_t(Alignment));
+    }
+
+    template <typename U>
+    bool operator==(const aligned_allocator<U, Alignment>&) const { return true; }
+    template <typename U>
+    bool operator!=(const aligned_allocator<U, Alignment>&) const { return false; }
+};
+
+#endif //SIMD_H
@@ -2,17 +2,23 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "stats.h"
 #include "vec3.h"
 
 class sphere : public hittable {
 public:
     //Reckless reading about math was used to find this. It creates a sphere at point3& center with a radius of radius.
-    sphere(point3 _center, double _radius, shared_ptr<material> _material)
-            : center(_center), radius(_radius), mat(_material) {}
+    sphere(point3 _center, real _radius, const material* _material)
+            : center(_center), radius(_radius), mat(_material)
+    {
+        auto rvec = vec3(radius, radius, radius);
+        bbox = aabb(center - rvec, center + rvec);
+    }
 
     //We used to have two doubles to find out what two points define the ray. We use the (now created) interval.h
     //class 'interval' to do so now. The points used to be called max and min and likewise ray_t has a max and min value.
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        RT_STAT(++thread_stats().prim_tests);
         vec3 oc = r.origin() - center;
         auto a = r.direction().length_squared();
         auto half_b = dot(oc, r.direction());
@@ -37,13 +43,17 @@ public:
         rec.set_face_normal(r, outward_normal);
         rec.mat = mat;
 
+        RT_STAT(++thread_stats().prim_hits);
         return true;
     }
 
+    aabb bounding_box() const override { return bbox; }
+
 private:
     point3 center;
-    double radius;
-    shared_ptr<material> mat;
+    real radius;
+    const material* mat; //Owned by the scene's material_table.
+    aabb bbox;
 };
 
 #endif
\ No newline at end of file
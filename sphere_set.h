@@ -0,0 +1,438 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "common_constants.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "simd.h"
+#include "stats.h"
+
+#include <utility>
+#include <vector>
+
+//A whole bunch of spheres stored "structure of arrays" style: every center x in one array, every center y in
+//another and so on, instead of one heap object per sphere. Eight neighbouring spheres are then eight neighbouring
+//floats in each array, which is exactly what one AVX2 register holds, so one ray gets tested against eight spheres
+//with a single set of instructions (four in the double precision build).
+//
+//The spheres get their own BVH with leaves of up to `lanes` spheres, and the arrays are sorted into leaf order so a
+//leaf is one (unaligned) vector load per array. The binary BVH is then collapsed into a wide one (every node has up
+//to `lanes` children) whose child boxes are stored the same SoA way, so one ray is tested against all the child
+//boxes at once too. CPUs without AVX2 (checked at runtime with CPUID) walk the binary tree with the scalar test.
+class sphere_set : public hittable {
+public:
+    static constexpr int lanes = simd_width; // reals per AVX2 register.
+
+    void add(const point3& center, real radius, const material* mat) {
+        pending.push_back(pending_sphere{center, radius, mat});
+    }
+
+    size_t size() const { return mats.size(); }
+
+    //Room for n spheres before build(), so adding a few million doesn't keep reallocating.
+    void reserve(size_t n) { pending.reserve(n); }
+
+    //Build the BVH and lay the spheres out in leaf order. Call after the last add() and before rendering.
+    void build() {
+        std::vector<aabb> boxes;
+        boxes.reserve(pending.size());
+        for (const auto& s : pending) {
+            auto rvec = vec3(s.radius, s.radius, s.radius);
+            boxes.push_back(aabb(s.center - rvec, s.center + rvec));
+        }
+        tree.build(boxes, lanes);
+        bbox = tree.bounding_box();
+
+        // Pad the end so a leaf near the end can still load a full vector. The padding lanes get masked off.
+        size_t padded = pending.size() + lanes;
+        cx.assign(padded, 0);
+        cy.assign(padded, 0);
+        cz.assign(padded, 0);
+        radius.assign(padded, 0);
+        mats.assign(pending.size(), nullptr);
+
+        slot_of.assign(pending.size(), 0);
+        for (size_t i = 0; i < tree.prim_indices.size(); i++) {
+            slot_of[tree.prim_indices[i]] = static_cast<int>(i);
+            const auto& s = pending[tree.prim_indices[i]];
+            cx[i] = s.center.x();
+            cy[i] = s.center.y();
+            cz[i] = s.center.z();
+            radius[i] = s.radius;
+            mats[i] = s.mat;
+        }
+        pending.clear();
+        pending.shrink_to_fit();
+
+        nodes.clear();
+        if (!tree.nodes.empty())
+            collapse(tree, 0);
+    }
+
+    //Move sphere `index` (counting add() calls from 0) after build(). Call refit() once everything has moved.
+    void move(size_t index, const point3& center) {
+        int i = slot_of[index];
+        cx[i] = center.x();
+        cy[i] = center.y();
+        cz[i] = center.z();
+    }
+
+    point3 center(size_t index) const {
+        int i = slot_of[index];
+        return point3(cx[i], cy[i], cz[i]);
+    }
+
+    //Fit the BVH boxes (both trees) to where the spheres are now. For animation: the spheres stay in the same leaves,
+    //so a frame costs one pass over the nodes instead of a whole build(). Fine for things moving around a bit; if
+    //everything ends up somewhere else entirely, build a new set.
+    void refit() {
+        tree.refit([&](int first, int count) { return leaf_box(first, count); });
+        bbox = tree.bounding_box();
+        for (size_t k = nodes.size(); k-- > 0;) {
+            wide_node& node = nodes[k];
+            for (int lane = 0; lane < node.child_count; lane++) {
+                aabb box = node.count[lane] > 0 ? leaf_box(node.child[lane], node.count[lane])
+                                                : wide_box(nodes[node.child[lane]]);
+                node.min_x[lane] = box.x.min; node.max_x[lane] = box.x.max;
+                node.min_y[lane] = box.y.min; node.max_y[lane] = box.y.max;
+                node.min_z[lane] = box.z.min; node.max_z[lane] = box.z.max;
+            }
+        }
+    }
+
+    //Turn the AVX2 path on or off (it's only ever on if the CPU has AVX2). Handy for comparing the two.
+    void use_simd(bool enable) {
+        avx2 = enable && cpu_has_avx2();
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        vec3 dir = r.direction();
+        leaf_ray lr{r.origin(), dir, dir.length_squared(), vec3(1/dir.x(), 1/dir.y(), 1/dir.z())};
+        int closest = -1;
+        real t_max = ray_t.max;
+
+        if (!avx2) {
+            // Without AVX2 the plain binary tree is quicker than testing the wide nodes' boxes one by one.
+            tree.traverse(r, ray_t, [&](int first, int count, interval& t) {
+                int index = hit_leaf_scalar(*this, lr, first, count, t.min, t.max);
+                RT_STAT(thread_stats().prim_tests += count);
+                if (index < 0)
+                    return false;
+                RT_STAT(++thread_stats().prim_hits);
+                closest = index;
+                t_max = t.max;
+                return true;
+            });
+            return closest >= 0 && fill_record(r, closest, t_max, rec);
+        }
+
+        // Each stack entry remembers where the ray entered its box so boxes behind a closer hit get skipped.
+        struct entry { int node; real t_enter; };
+        entry stack[max_stack];
+        int stack_size = 0;
+        stack[stack_size++] = entry{0, ray_t.min};
+
+        while (stack_size > 0) {
+            entry e = stack[--stack_size];
+            if (e.t_enter >= t_max)
+                continue;
+
+            const wide_node& node = nodes[e.node];
+            alignas(32) real t_enter[lanes];
+            int mask = hit_boxes_avx2(node, lr, ray_t.min, t_max, t_enter);
+            RT_STAT(thread_stats().box_tests += node.child_count);
+
+            // Visit the hit children nearest first. Leaves get tested right away, inner nodes go on the stack
+            // farthest first so the nearest one comes off next.
+            int order[lanes];
+            int hits = 0;
+            for (int lane = 0; lane < node.child_count; lane++) {
+                if (!(mask & (1 << lane)))
+                    continue;
+                int k = hits++;
+                while (k > 0 && t_enter[order[k-1]] > t_enter[lane]) {
+                    order[k] = order[k-1];
+                    k--;
+                }
+                order[k] = lane;
+            }
+
+            int inner[lanes];
+            int inner_count = 0;
+            for (int k = 0; k < hits; k++) {
+                int lane = order[k];
+                if (node.count[lane] > 0) {
+                    int index = hit_leaf_avx2(*this, lr, node.child[lane], node.count[lane], ray_t.min, t_max);
+                    RT_STAT(thread_stats().prim_tests += node.count[lane]);
+                    if (index >= 0) {
+                        RT_STAT(++thread_stats().prim_hits);
+                        closest = index;
+                    }
+                } else {
+                    inner[inner_count++] = lane;
+                }
+            }
+            for (int k = inner_count - 1; k >= 0; k--)
+                stack[stack_size++] = entry{node.child[inner[k]], t_enter[inner[k]]};
+        }
+
+        return closest >= 0 && fill_record(r, closest, t_max, rec);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+private:
+    struct pending_sphere {
+        point3 center;
+        real radius;
+        const material* mat;
+    };
+
+    struct leaf_ray {
+        point3 orig;
+        vec3   dir;
+        real   a;       // dir.length_squared(), the same for every sphere.
+        vec3   inv_dir; // For the box tests.
+    };
+
+    //One node of the wide BVH: `lanes` children (8 in the float build, 4 in double). Child boxes are stored SoA so
+    //all of them load straight into registers.
+    //A child with count > 0 is a leaf of spheres [child, child+count), otherwise child is the index of another node.
+    struct alignas(32) wide_node {
+        real min_x[lanes], min_y[lanes], min_z[lanes];
+        real max_x[lanes], max_y[lanes], max_z[lanes];
+        int child[lanes];
+        int count[lanes];
+        int child_count;
+    };
+
+    //The binary tree can be ~100 levels deep in bad cases and every level pushes at most lanes-1 entries.
+    static constexpr int max_stack = 1024;
+
+    using aligned_reals = std::vector<real, aligned_allocator<real>>;
+
+    std::vector<pending_sphere> pending;
+    aligned_reals cx, cy, cz, radius;
+    std::vector<const material*> mats;
+    std::vector<int> slot_of;                              // add() order -> position in the arrays above.
+    bvh_tree tree;                                         // Binary tree, walked when there's no AVX2.
+    std::vector<wide_node, aligned_allocator<wide_node>> nodes; // The same tree `lanes` wide, walked with AVX2.
+    aabb bbox;
+    bool avx2 = cpu_has_avx2();
+
+    aabb leaf_box(int first, int count) const {
+        aabb box;
+        for (int i = first; i < first + count; i++) {
+            vec3 r(radius[i], radius[i], radius[i]);
+            point3 c(cx[i], cy[i], cz[i]);
+            box = aabb(box, aabb(c - r, c + r));
+        }
+        return box;
+    }
+
+    //The box around everything under a wide node: the union of its children's boxes.
+    static aabb wide_box(const wide_node& node) {
+        aabb box;
+        for (int lane = 0; lane < node.child_count; lane++) {
+            box = aabb(box, aabb(interval(node.min_x[lane], node.max_x[lane]),
+                                 interval(node.min_y[lane], node.max_y[lane]),
+                                 interval(node.min_z[lane], node.max_z[lane])));
+        }
+        return box;
+    }
+
+    //Only the closest sphere gets the full hit record worked out.
+    bool fill_record(const ray& r, int i, real t, hit_record& rec) const {
+        auto center = point3(cx[i], cy[i], cz[i]);
+        rec.t = t;
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (rec.p - center) / radius[i];
+        rec.set_face_normal(r, outward_normal);
+        rec.mat = mats[i];
+        return true;
+    }
+
+    //Turn binary node `index` of tree into a wide node (and its subtree). Children are gathered by repeatedly
+    //opening up the biggest inner child until there are `lanes` of them (or only leaves left).
+    int collapse(const bvh_tree& tree, int index) {
+        int gathered[lanes];
+        int gathered_count = 0;
+        const auto& root = tree.nodes[index];
+        if (root.count > 0) {
+            gathered[gathered_count++] = index;
+        } else {
+            gathered[gathered_count++] = index + 1;
+            gathered[gathered_count++] = root.offset;
+        }
+
+        while (gathered_count < lanes) {
+            int open = -1;
+            double open_area = -1;
+            for (int k = 0; k < gathered_count; k++) {
+                const auto& node = tree.nodes[gathered[k]];
+                if (node.count == 0 && node.box.surface_area() > open_area) {
+                    open = k;
+                    open_area = node.box.surface_area();
+                }
+            }
+            if (open < 0)
+                break;
+            int opened = gathered[open];
+            gathered[open] = opened + 1;
+            gathered[gathered_count++] = tree.nodes[opened].offset;
+        }
+
+        int wide_index = static_cast<int>(nodes.size());
+        nodes.emplace_back();
+        {
+            wide_node& wide = nodes[wide_index];
+            wide.child_count = gathered_count;
+            for (int k = 0; k < lanes; k++) {
+                // Unused lanes get an inside out box. They're masked off by child_count anyway.
+                const aabb box = k < gathered_count ? tree.nodes[gathered[k]].box : aabb();
+                wide.min_x[k] = box.x.min; wide.max_x[k] = box.x.max;
+                wide.min_y[k] = box.y.min; wide.max_y[k] = box.y.max;
+                wide.min_z[k] = box.z.min; wide.max_z[k] = box.z.max;
+                wide.child[k] = 0;
+                wide.count[k] = 0;
+            }
+        }
+
+        for (int k = 0; k < gathered_count; k++) {
+            const auto& node = tree.nodes[gathered[k]];
+            if (node.count > 0) {
+                nodes[wide_index].child[k] = node.offset;
+                nodes[wide_index].count[k] = node.count;
+            } else {
+                int child = collapse(tree, gathered[k]); // May reallocate nodes, so index again afterwards.
+                nodes[wide_index].child[k] = child;
+            }
+        }
+        return wide_index;
+    }
+
+    //Test spheres [first, first+count) one at a time. Returns the index of the nearest hit and pulls t_max in to it,
+    //or returns -1 if none of them were hit.
+    static int hit_leaf_scalar(const sphere_set& set, const leaf_ray& r, int first, int count,
+                               real t_min, real& t_max) {
+        int closest = -1;
+        for (int i = first; i < first + count; i++) {
+            vec3 oc = r.orig - point3(set.cx[i], set.cy[i], set.cz[i]);
+            auto half_b = dot(oc, r.dir);
+            auto c = oc.length_squared() - set.radius[i]*set.radius[i];
+            auto discriminant = half_b*half_b - r.a*c;
+            if (discriminant < 0)
+                continue;
+            auto sqrtd = sqrt(discriminant);
+
+            auto root = (-half_b - sqrtd) / r.a;
+            if (!(t_min < root && root < t_max)) {
+                root = (-half_b + sqrtd) / r.a;
+                if (!(t_min < root && root < t_max))
+                    continue;
+            }
+            t_max = root;
+            closest = i;
+        }
+        return closest;
+    }
+
+#if RT_X86
+    //The same test as hit_leaf_scalar for a whole register of spheres at once. Lanes past `count` are masked off.
+    RT_TARGET_AVX2
+    static int hit_leaf_avx2(const sphere_set& set, const leaf_ray& r, int first, int count,
+                             real t_min, real& t_max) {
+        const simd_real ocx = simd_sub(simd_set1(r.orig.x()), simd_loadu(set.cx.data() + first));
+        const simd_real ocy = simd_sub(simd_set1(r.orig.y()), simd_loadu(set.cy.data() + first));
+        const simd_real ocz = simd_sub(simd_set1(r.orig.z()), simd_loadu(set.cz.data() + first));
+        const simd_real rad = simd_loadu(set.radius.data() + first);
+
+        const simd_real dx = simd_set1(r.dir.x());
+        const simd_real dy = simd_set1(r.dir.y());
+        const simd_real dz = simd_set1(r.dir.z());
+        const simd_real a  = simd_set1(r.a);
+
+        simd_real half_b = simd_add(simd_add(simd_mul(ocx, dx), simd_mul(ocy, dy)), simd_mul(ocz, dz));
+        simd_real oc_len2 = simd_add(simd_add(simd_mul(ocx, ocx), simd_mul(ocy, ocy)), simd_mul(ocz, ocz));
+        simd_real c = simd_sub(oc_len2, simd_mul(rad, rad));
+        simd_real discriminant = simd_sub(simd_mul(half_b, half_b), simd_mul(a, c));
+
+        simd_real valid = simd_and(simd_ge(discriminant, simd_zero()),
+                                   simd_lt(simd_lane_index(), simd_set1(static_cast<real>(count))));
+        if (simd_mask(valid) == 0)
+            return -1;
+
+        simd_real sqrtd = simd_sqrt(simd_max(discriminant, simd_zero()));
+        simd_real neg_half_b = simd_sub(simd_zero(), half_b);
+        simd_real near_root = simd_div(simd_sub(neg_half_b, sqrtd), a);
+        simd_real far_root  = simd_div(simd_add(neg_half_b, sqrtd), a);
+
+        const simd_real lo = simd_set1(t_min);
+        const simd_real hi = simd_set1(t_max);
+        simd_real near_ok = simd_and(simd_gt(near_root, lo), simd_lt(near_root, hi));
+        simd_real far_ok  = simd_and(simd_gt(far_root, lo), simd_lt(far_root, hi));
+
+        simd_real root = simd_select(near_ok, near_root, far_root);
+        int mask = simd_mask(simd_and(valid, simd_or(near_ok, far_ok)));
+        if (mask == 0)
+            return -1;
+
+        alignas(32) real roots[lanes];
+        simd_store(roots, root);
+
+        int closest = -1;
+        for (int lane = 0; lane < lanes; lane++) {
+            if ((mask & (1 << lane)) && roots[lane] < t_max) {
+                t_max = roots[lane];
+                closest = first + lane;
+            }
+        }
+        return closest;
+    }
+
+    //The slab test (see aabb::hit) against every child box of a wide node at once. Returns a bitmask of the hit
+    //children and where the ray entered each of them.
+    RT_TARGET_AVX2
+    static int hit_boxes_avx2(const wide_node& node, const leaf_ray& r, real t_min, real t_max, real* t_enter) {
+        const simd_real ox = simd_set1(r.orig.x());
+        const simd_real oy = simd_set1(r.orig.y());
+        const simd_real oz = simd_set1(r.orig.z());
+        const simd_real ix = simd_set1(r.inv_dir.x());
+        const simd_real iy = simd_set1(r.inv_dir.y());
+        const simd_real iz = simd_set1(r.inv_dir.z());
+
+        simd_real tx0 = simd_mul(simd_sub(simd_load(node.min_x), ox), ix);
+        simd_real tx1 = simd_mul(simd_sub(simd_load(node.max_x), ox), ix);
+        simd_real ty0 = simd_mul(simd_sub(simd_load(node.min_y), oy), iy);
+        simd_real ty1 = simd_mul(simd_sub(simd_load(node.max_y), oy), iy);
+        simd_real tz0 = simd_mul(simd_sub(simd_load(node.min_z), oz), iz);
+        simd_real tz1 = simd_mul(simd_sub(simd_load(node.max_z), oz), iz);
+
+        simd_real near_t = simd_max(simd_max(simd_min(tx0, tx1), simd_min(ty0, ty1)),
+                                    simd_max(simd_min(tz0, tz1), simd_set1(t_min)));
+        simd_real far_t  = simd_min(simd_min(simd_max(tx0, tx1), simd_max(ty0, ty1)),
+                                    simd_min(simd_max(tz0, tz1), simd_set1(t_max)));
+
+        simd_store(t_enter, near_t);
+        int mask = simd_mask(simd_lt(near_t, far_t));
+        return mask & ((1 << node.child_count) - 1);
+    }
+#else
+    // Never called (cpu_has_avx2() is false off x86) but hit() still has to compile.
+    static int hit_boxes_avx2(const wide_node&, const leaf_ray&, real, real, real*) {
+        return 0;
+    }
+
+    static int hit_leaf_avx2(const sphere_set& set, const leaf_ray& r, int first, int count,
+                             real t_min, real& t_max) {
+        return hit_leaf_scalar(set, r, first, count, t_min, t_max);
+    }
+#endif
+};
+
+#endif //SPHERE_SET_H
@@ -0,0 +1,172 @@
+#ifndef STATS_H
+#define STATS_H
+
+//Counting where the render time goes: rays, intersection tests, how long paths get, which materials scatter, and
+//how long tiles take.
+//
+//Only built with -DRT_ENABLE_STATS=ON (CMake option). Otherwise every RT_STAT(...) in the code is an empty statement
+//and none of this exists, so a normal build pays nothing for it.
+//
+//Each thread counts into its own render_stats (plain integers, no atomics, nothing shared), and collect_stats()
+//adds them all up once the frame is done and the workers are idle.
+
+#ifdef RT_ENABLE_STATS
+
+#include "material.h"
+
+#include <cstdint>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define RT_STAT(...) __VA_ARGS__
+
+struct render_stats {
+    static constexpr int path_bins = 64; // Paths of path_bins-1 bounces or more share the last bin.
+
+    uint64_t primary_rays   = 0;  // Rays from the camera.
+    uint64_t secondary_rays = 0;  // Rays from a scatter.
+    uint64_t shadow_rays    = 0;  // Rays aimed at a light.
+    uint64_t box_tests      = 0;  // BVH boxes a ray was tested against.
+    uint64_t prim_tests     = 0;  // Ray-sphere tests.
+    uint64_t prim_hits      = 0;  // Of those, the ones that found a hit closer than the last one.
+
+    //How paths end, and after how many bounces.
+    uint64_t escaped       = 0;   // Flew off into the sky.
+    uint64_t absorbed      = 0;   // scatter() said no (a light always does), or the throughput hit zero.
+    uint64_t roulette      = 0;   // Killed by Russian roulette.
+    uint64_t depth_limited = 0;   // Ran out of max_depth.
+    uint64_t path_length[path_bins] = {};
+
+    uint64_t scatters[material_kind_count] = {};
+
+    uint64_t tiles   = 0;
+    uint64_t tile_ns = 0;         // Summed over every tile.
+    uint64_t tile_ns_max = 0;     // The slowest tile.
+
+    void end_path(int bounces) {
+        path_length[bounces < path_bins ? bounces : path_bins - 1]++;
+    }
+
+    void merge(const render_stats& o) {
+        primary_rays += o.primary_rays;
+        secondary_rays += o.secondary_rays;
+        shadow_rays += o.shadow_rays;
+        box_tests += o.box_tests;
+        prim_tests += o.prim_tests;
+        prim_hits += o.prim_hits;
+        escaped += o.escaped;
+        absorbed += o.absorbed;
+        roulette += o.roulette;
+        depth_limited += o.depth_limited;
+        for (int k = 0; k < path_bins; k++)
+            path_length[k] += o.path_length[k];
+        for (int k = 0; k < material_kind_count; k++)
+            scatters[k] += o.scatters[k];
+        tiles += o.tiles;
+        tile_ns += o.tile_ns;
+        tile_ns_max = tile_ns_max > o.tile_ns_max ? tile_ns_max : o.tile_ns_max;
+    }
+
+    std::string to_json() const {
+        std::ostringstream out;
+        out << "{\"primary_rays\": " << primary_rays
+            << ", \"secondary_rays\": " << secondary_rays
+            << ", \"shadow_rays\": " << shadow_rays
+            << ", \"box_tests\": " << box_tests
+            << ", \"prim_tests\": " << prim_tests
+            << ", \"prim_hits\": " << prim_hits
+            << ", \"paths\": {\"escaped\": " << escaped << ", \"absorbed\": " << absorbed
+            << ", \"roulette\": " << roulette << ", \"depth_limited\": " << depth_limited << "}";
+
+        //Trailing empty bins would just be noise.
+        int last = path_bins - 1;
+        while (last > 0 && path_length[last] == 0)
+            last--;
+        out << ", \"path_length\": [";
+        for (int k = 0; k <= last; k++)
+            out << (k ? ", " : "") << path_length[k];
+        out << "]";
+
+        out << ", \"scatters\": {";
+        for (int k = 0; k < material_kind_count; k++)
+            out << (k ? ", " : "") << '"' << material_kind_name(static_cast<material_kind>(k)) << "\": " << scatters[k];
+        out << "}";
+
+        out << ", \"tiles\": " << tiles
+            << ", \"tile_ms_mean\": " << (tiles ? tile_ns / 1e6 / tiles : 0.0)
+            << ", \"tile_ms_max\": " << tile_ns_max / 1e6 << "}";
+        return out.str();
+    }
+};
+
+//Every thread's counters, so they can be found and added up. A thread that exits hands its counts to `retired`.
+class stats_registry {
+public:
+    static stats_registry& get() {
+        static stats_registry registry;
+        return registry;
+    }
+
+    void add(render_stats* s) {
+        std::lock_guard<std::mutex> guard(lock);
+        live.push_back(s);
+    }
+
+    void remove(render_stats* s) {
+        std::lock_guard<std::mutex> guard(lock);
+        retired.merge(*s);
+        for (size_t k = 0; k < live.size(); k++) {
+            if (live[k] == s) {
+                live[k] = live.back();
+                live.pop_back();
+                break;
+            }
+        }
+    }
+
+    //Only call these while no thread is rendering (between frames). The counters themselves aren't atomic.
+    render_stats collect() {
+        std::lock_guard<std::mutex> guard(lock);
+        render_stats total = retired;
+        for (auto* s : live)
+            total.merge(*s);
+        return total;
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> guard(lock);
+        retired = render_stats();
+        for (auto* s : live)
+            *s = render_stats();
+    }
+
+private:
+    std::mutex lock;
+    std::vector<render_stats*> live;
+    render_stats retired;
+};
+
+struct thread_stats_slot {
+    render_stats stats;
+    thread_stats_slot() { stats_registry::get().add(&stats); }
+    ~thread_stats_slot() { stats_registry::get().remove(&stats); }
+};
+
+//This thread's counters.
+inline render_stats& thread_stats() {
+    thread_local thread_stats_slot slot;
+    return slot.stats;
+}
+
+inline render_stats collect_stats() { return stats_registry::get().collect(); }
+inline void reset_stats() { stats_registry::get().reset(); }
+
+#else
+
+#define RT_STAT(...) do {} while (0)
+
+#endif //RT_ENABLE_STATS
+
+#endif //STATS_H
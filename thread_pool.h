@@ -0,0 +1,152 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//A fixed set of worker threads that live as long as the pool does.
+//render2 used to start one std::async per scanline, which on a 4K image is over 2000 OS threads fighting over the
+//cores. Here the threads are made once and fed work.
+//
+//Every worker has its own deque of task indices. A worker takes from the front of its own deque and, once that runs
+//dry, steals from the back of somebody else's. Tasks are handed out in contiguous blocks so each worker starts on
+//neighbouring tiles, and stealing from the far end keeps thieves away from what the owner is about to touch.
+class thread_pool {
+public:
+    //thread_count 0 means one worker per hardware thread.
+    explicit thread_pool(unsigned thread_count = 0) {
+        if (thread_count == 0)
+            thread_count = std::thread::hardware_concurrency();
+        if (thread_count == 0)
+            thread_count = 8; // hardware_concurrency is allowed to not know.
+
+        for (unsigned i = 0; i < thread_count; i++)
+            queues.push_back(std::make_unique<worker_queue>());
+        for (unsigned i = 0; i < thread_count; i++)
+            workers.emplace_back(&thread_pool::worker_loop, this, i);
+    }
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> guard(wake_lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+    //Run task(i) for every i in [0, count) across the workers and wait for all of them to finish.
+    //Only one parallel_for runs at a time and a task must not start another one (it would wait on itself).
+    void parallel_for(int count, const std::function<void(int)>& task) {
+        if (count <= 0)
+            return;
+
+        std::lock_guard<std::mutex> one_job_at_a_time(job_lock);
+
+        current_task = &task;
+        remaining.store(count);
+
+        // Contiguous block per worker.
+        auto n = static_cast<int>(queues.size());
+        for (int w = 0; w < n; w++) {
+            int begin = static_cast<int>(static_cast<long long>(count) * w / n);
+            int end = static_cast<int>(static_cast<long long>(count) * (w + 1) / n);
+            std::lock_guard<std::mutex> guard(queues[w]->lock);
+            for (int i = begin; i < end; i++)
+                queues[w]->tasks.push_back(i);
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(wake_lock);
+            generation++;
+        }
+        wake.notify_all();
+
+        std::unique_lock<std::mutex> guard(done_lock);
+        done.wait(guard, [this] { return remaining.load() == 0; });
+        current_task = nullptr;
+    }
+
+private:
+    struct worker_queue {
+        std::mutex lock;
+        std::deque<int> tasks;
+    };
+
+    std::vector<std::unique_ptr<worker_queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex job_lock;
+    const std::function<void(int)>* current_task = nullptr;
+    std::atomic<int> remaining{0};
+
+    std::mutex wake_lock;
+    std::condition_variable wake;
+    unsigned long long generation = 0;
+    bool stopping = false;
+
+    std::mutex done_lock;
+    std::condition_variable done;
+
+    bool pop_own(unsigned self, int& index) {
+        auto& q = *queues[self];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.tasks.empty())
+            return false;
+        index = q.tasks.front();
+        q.tasks.pop_front();
+        return true;
+    }
+
+    bool steal(unsigned self, int& index) {
+        auto n = static_cast<unsigned>(queues.size());
+        for (unsigned k = 1; k < n; k++) {
+            auto& q = *queues[(self + k) % n];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (!q.tasks.empty()) {
+                index = q.tasks.back();
+                q.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void worker_loop(unsigned self) {
+        unsigned long long seen_generation = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> guard(wake_lock);
+                wake.wait(guard, [&] { return stopping || generation != seen_generation; });
+                if (stopping)
+                    return;
+                seen_generation = generation;
+            }
+
+            int index;
+            while (pop_own(self, index) || steal(self, index)) {
+                // current_task was written before the indices were queued under the same queue lock, so it is
+                // always the task that this index belongs to.
+                (*current_task)(index);
+                if (remaining.fetch_sub(1) == 1) {
+                    std::lock_guard<std::mutex> guard(done_lock);
+                    done.notify_all();
+                }
+            }
+        }
+    }
+};
+
+#endif //THREAD_POOL_H
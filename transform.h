@@ -0,0 +1,135 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "common_constants.h"
+
+#include "aabb.h"
+
+#include <cmath>
+
+//An affine transform: translate, rotate, scale (and anything made by combining those). Stored as three rows of a
+//4x4 matrix, since the bottom row of an affine one is always 0 0 0 1. The left 3x3 is the linear part, the last
+//column the translation.
+class transform {
+public:
+    real m[3][4];
+
+    transform() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+    static transform translate(const vec3& offset) {
+        transform t;
+        for (int r = 0; r < 3; r++)
+            t.m[r][3] = offset[r];
+        return t;
+    }
+
+    static transform scale(const vec3& factor) {
+        transform t;
+        for (int r = 0; r < 3; r++)
+            t.m[r][r] = factor[r];
+        return t;
+    }
+
+    //Turn `degrees` around `axis` (counter-clockwise looking down the axis at the origin). Rodrigues' formula.
+    static transform rotate(const vec3& axis, double degrees) {
+        vec3 a = unit_vector(axis);
+        auto theta = degrees_to_radians(degrees);
+        auto c = std::cos(theta);
+        auto s = std::sin(theta);
+        auto k = 1 - c;
+
+        transform t;
+        t.m[0][0] = a.x()*a.x()*k + c;       t.m[0][1] = a.x()*a.y()*k - a.z()*s; t.m[0][2] = a.x()*a.z()*k + a.y()*s;
+        t.m[1][0] = a.y()*a.x()*k + a.z()*s; t.m[1][1] = a.y()*a.y()*k + c;       t.m[1][2] = a.y()*a.z()*k - a.x()*s;
+        t.m[2][0] = a.z()*a.x()*k - a.y()*s; t.m[2][1] = a.z()*a.y()*k + a.x()*s; t.m[2][2] = a.z()*a.z()*k + c;
+        return t;
+    }
+
+    //Scale, then rotate around x, y and z in that order (degrees), then move to position. The usual way to place
+    //an object, and what the scene files store.
+    static transform place(const point3& position, const vec3& rotation, const vec3& size) {
+        return translate(position)
+             * rotate(vec3(0, 0, 1), rotation.z())
+             * rotate(vec3(0, 1, 0), rotation.y())
+             * rotate(vec3(1, 0, 0), rotation.x())
+             * scale(size);
+    }
+
+    //a * b does b first, then a.
+    transform operator*(const transform& b) const {
+        transform t;
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 4; c++) {
+                t.m[r][c] = m[r][0]*b.m[0][c] + m[r][1]*b.m[1][c] + m[r][2]*b.m[2][c];
+            }
+            t.m[r][3] += m[r][3];
+        }
+        return t;
+    }
+
+    point3 point(const point3& p) const {
+        return point3(m[0][0]*p.x() + m[0][1]*p.y() + m[0][2]*p.z() + m[0][3],
+                      m[1][0]*p.x() + m[1][1]*p.y() + m[1][2]*p.z() + m[1][3],
+                      m[2][0]*p.x() + m[2][1]*p.y() + m[2][2]*p.z() + m[2][3]);
+    }
+
+    vec3 vector(const vec3& v) const {
+        return vec3(m[0][0]*v.x() + m[0][1]*v.y() + m[0][2]*v.z(),
+                    m[1][0]*v.x() + m[1][1]*v.y() + m[1][2]*v.z(),
+                    m[2][0]*v.x() + m[2][1]*v.y() + m[2][2]*v.z());
+    }
+
+    //Normals don't transform like vectors once there's non uniform scaling: they need the inverse transpose. So
+    //call this on the *inverse* transform and it multiplies by its transpose. Not unit length afterwards.
+    vec3 normal_from_inverse(const vec3& n) const {
+        return vec3(m[0][0]*n.x() + m[1][0]*n.y() + m[2][0]*n.z(),
+                    m[0][1]*n.x() + m[1][1]*n.y() + m[2][1]*n.z(),
+                    m[0][2]*n.x() + m[1][2]*n.y() + m[2][2]*n.z());
+    }
+
+    double determinant() const {
+        return m[0][0] * (m[1][1]*m[2][2] - m[1][2]*m[2][1])
+             - m[0][1] * (m[1][0]*m[2][2] - m[1][2]*m[2][0])
+             + m[0][2] * (m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+    }
+
+    //Only meaningful if determinant() isn't 0 (nothing was scaled flat).
+    transform inverse() const {
+        auto inv_det = 1 / determinant();
+        transform t;
+        t.m[0][0] = (m[1][1]*m[2][2] - m[1][2]*m[2][1]) * inv_det;
+        t.m[0][1] = (m[0][2]*m[2][1] - m[0][1]*m[2][2]) * inv_det;
+        t.m[0][2] = (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * inv_det;
+        t.m[1][0] = (m[1][2]*m[2][0] - m[1][0]*m[2][2]) * inv_det;
+        t.m[1][1] = (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * inv_det;
+        t.m[1][2] = (m[0][2]*m[1][0] - m[0][0]*m[1][2]) * inv_det;
+        t.m[2][0] = (m[1][0]*m[2][1] - m[1][1]*m[2][0]) * inv_det;
+        t.m[2][1] = (m[0][1]*m[2][0] - m[0][0]*m[2][1]) * inv_det;
+        t.m[2][2] = (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * inv_det;
+        // The translation undoes the original one, in the inverted frame.
+        for (int r = 0; r < 3; r++)
+            t.m[r][3] = -(t.m[r][0]*m[0][3] + t.m[r][1]*m[1][3] + t.m[r][2]*m[2][3]);
+        return t;
+    }
+
+    //The box around a transformed box. Each output axis is the translation plus, per input axis, whichever end of
+    //that axis pushes it furthest (Arvo's trick), so no need to transform all eight corners.
+    aabb box(const aabb& b) const {
+        if (b.empty())
+            return b;
+        interval out[3];
+        for (int r = 0; r < 3; r++) {
+            real lo = m[r][3], hi = m[r][3];
+            for (int c = 0; c < 3; c++) {
+                real e0 = m[r][c] * b.axis(c).min;
+                real e1 = m[r][c] * b.axis(c).max;
+                lo += e0 < e1 ? e0 : e1;
+                hi += e0 < e1 ? e1 : e0;
+            }
+            out[r] = interval(lo, hi);
+        }
+        return aabb(out[0], out[1], out[2]);
+    }
+};
+
+#endif //TRANSFORM_H
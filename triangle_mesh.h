@@ -0,0 +1,155 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "common_constants.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "stats.h"
+
+#include <cstdint>
+#include <vector>
+
+//A mesh of triangles with one material. Triangles are three indices into a shared array of vertex positions, not
+//an object each, so a million triangle mesh is a few flat arrays: 12 bytes per vertex and 12 per triangle, plus its
+//own BVH (the same binned SAH bvh_tree the spheres use) built over the triangles.
+//
+//Fill in positions/indices (and normals if there are any, see load_mesh in mesh_io.h), then call build() once
+//before rendering. build() reorders the triangles so every BVH leaf is a contiguous run of them.
+class triangle_mesh : public hittable {
+public:
+    std::vector<point3>   positions;
+    std::vector<uint32_t> indices;          // 3 per triangle, into positions.
+
+    //Smooth shading, optional. Per vertex normals, found through normal_indices (3 per triangle) or, if that's
+    //empty, through the same indices as the positions. No normals at all means flat shaded triangles.
+    std::vector<vec3>     normals;
+    std::vector<uint32_t> normal_indices;
+
+    const material* mat = nullptr;
+
+    size_t triangle_count() const { return indices.size() / 3; }
+
+    void build() {
+        size_t count = triangle_count();
+        std::vector<aabb> boxes;
+        boxes.reserve(count);
+        for (size_t k = 0; k < count; k++) {
+            const point3& p0 = positions[indices[3*k + 0]];
+            const point3& p1 = positions[indices[3*k + 1]];
+            const point3& p2 = positions[indices[3*k + 2]];
+            aabb box(aabb(p0, p1), aabb(p2, p2));
+            // A triangle lying flat along an axis has a box with no thickness, which the slab test never hits.
+            box = aabb(pad(box.x), pad(box.y), pad(box.z));
+            boxes.push_back(box);
+        }
+        tree.build(boxes, 4);
+
+        // Put the triangles in leaf order. The leaves then index triangles directly and prim_indices can go.
+        std::vector<uint32_t> sorted(indices.size());
+        std::vector<uint32_t> sorted_normals(normal_indices.size());
+        for (size_t k = 0; k < count; k++) {
+            size_t from = static_cast<size_t>(tree.prim_indices[k]);
+            for (int c = 0; c < 3; c++) {
+                sorted[3*k + c] = indices[3*from + c];
+                if (!normal_indices.empty())
+                    sorted_normals[3*k + c] = normal_indices[3*from + c];
+            }
+        }
+        indices.swap(sorted);
+        normal_indices.swap(sorted_normals);
+        tree.prim_indices.clear();
+        tree.prim_indices.shrink_to_fit();
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        int closest = -1;
+        real closest_t = 0, closest_u = 0, closest_v = 0;
+
+        tree.traverse(r, ray_t, [&](int first, int count, interval& t) {
+            bool found = false;
+            for (int k = first; k < first + count; k++) {
+                real hit_t, u, v;
+                RT_STAT(++thread_stats().prim_tests);
+                if (intersect(r, k, t, hit_t, u, v)) {
+                    RT_STAT(++thread_stats().prim_hits);
+                    t.max = hit_t;
+                    closest = k;
+                    closest_t = hit_t;
+                    closest_u = u;
+                    closest_v = v;
+                    found = true;
+                }
+            }
+            return found;
+        });
+
+        if (closest < 0)
+            return false;
+
+        size_t k = static_cast<size_t>(closest);
+        const point3& p0 = positions[indices[3*k + 0]];
+        const point3& p1 = positions[indices[3*k + 1]];
+        const point3& p2 = positions[indices[3*k + 2]];
+
+        rec.t = closest_t;
+        rec.p = r.at(rec.t);
+        vec3 geometric = unit_vector(cross(p1 - p0, p2 - p0));
+        rec.set_face_normal(r, geometric);
+        if (!normals.empty()) {
+            // Smooth normal, flipped to the same side front/back as the geometric one set_face_normal picked.
+            const auto& ni = normal_indices.empty() ? indices : normal_indices;
+            vec3 smooth = (1 - closest_u - closest_v) * normals[ni[3*k + 0]]
+                        + closest_u * normals[ni[3*k + 1]]
+                        + closest_v * normals[ni[3*k + 2]];
+            if (smooth.length_squared() > 0) {
+                smooth = unit_vector(smooth);
+                rec.normal = dot(smooth, rec.normal) >= 0 ? smooth : -smooth;
+            }
+        }
+        rec.mat = mat;
+        return true;
+    }
+
+    aabb bounding_box() const override { return tree.bounding_box(); }
+
+private:
+    bvh_tree tree;
+
+    static interval pad(const interval& i) {
+        const real minimum = 0.0001;
+        return i.size() < minimum ? i.expand(minimum) : i;
+    }
+
+    //Möller–Trumbore. Solves origin + t*dir = p0 + u*(p1-p0) + v*(p2-p0) straight away with a few cross products,
+    //so there's no plane to find first and nothing to store per triangle except the three vertex indices.
+    bool intersect(const ray& r, size_t k, const interval& ray_t, real& t, real& u, real& v) const {
+        const point3& p0 = positions[indices[3*k + 0]];
+        const point3& p1 = positions[indices[3*k + 1]];
+        const point3& p2 = positions[indices[3*k + 2]];
+
+        vec3 edge1 = p1 - p0;
+        vec3 edge2 = p2 - p0;
+        vec3 pvec = cross(r.direction(), edge2);
+        real det = dot(edge1, pvec);
+        if (det == 0) // The ray runs along the triangle's plane.
+            return false;
+
+        real inv_det = 1 / det;
+        vec3 tvec = r.origin() - p0;
+        u = dot(tvec, pvec) * inv_det;
+        if (u < 0 || u > 1)
+            return false;
+
+        vec3 qvec = cross(tvec, edge1);
+        v = dot(r.direction(), qvec) * inv_det;
+        if (v < 0 || u + v > 1)
+            return false;
+
+        t = dot(edge2, qvec) * inv_det;
+        return ray_t.surrounds(t);
+    }
+};
+
+#endif //TRIANGLE_MESH_H
@@ -1,6 +1,8 @@
 #ifndef VEC3_H
 #define VEC3_H
 
+#include "precision.h"
+
 #include <cmath>
 #include <iostream>
 
@@ -12,23 +14,23 @@ using std::sqrt;
 class vec3 {
 public:
     // Components of the vector
-    double e[3];
+    real e[3];
 
     // Constructors
     vec3() : e{0, 0, 0} {}
-    vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+    vec3(real e0, real e1, real e2) : e{e0, e1, e2} {}
 
     // Accessors for individual components
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
+    real x() const { return e[0]; }
+    real y() const { return e[1]; }
+    real z() const { return e[2]; }
 
     // Unary negation operator
     vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
 
     // Subscript operator for access to components
-    double operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
+    real operator[](int i) const { return e[i]; }
+    real& operator[](int i) { return e[i]; }
 
     // Compound addition operator
     vec3& operator+=(const vec3& v) {
@@ -39,7 +41,7 @@ public:
     }
 
     // Compound multiplication by scalar operator
-    vec3& operator*=(double t) {
+    vec3& operator*=(real t) {
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
@@ -47,17 +49,17 @@ public:
     }
 
     // Compound division by scalar operator
-    vec3& operator/=(double t) {
+    vec3& operator/=(real t) {
         return *this *= 1 / t;
     }
 
     // Calculate the length of the vector
-    double length() const {
+    real length() const {
         return sqrt(length_squared());
     }
 
     // Calculate the squared length of the vector (avoiding square root)
-    double length_squared() const {
+    real length_squared() const {
         return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
     }
     
@@ -73,7 +75,7 @@ public:
         return vec3(random_double(), random_double(), random_double());
     }
 
-    static vec3 random(double min, double max) {
+    static vec3 random(real min, real max) {
         return vec3(random_double(min,max), random_double(min,max), random_double(min,max));
     }
     
@@ -105,20 +107,20 @@ inline vec3 operator*(const vec3& u, const vec3& v) {
 }
 
 // Scalar multiplication operators for vec3
-inline vec3 operator*(double t, const vec3& v) {
+inline vec3 operator*(real t, const vec3& v) {
     return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
-inline vec3 operator*(const vec3& v, double t) {
+inline vec3 operator*(const vec3& v, real t) {
     return t * v;
 }
 
 // Scalar division operator for vec3
-inline vec3 operator/(vec3 v, double t) {
+inline vec3 operator/(vec3 v, real t) {
     return (1 / t) * v;
 }
 
 // Dot product of two vectors
-inline double dot(const vec3& u, const vec3& v) {
+inline real dot(const vec3& u, const vec3& v) {
     return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
 }
 
@@ -190,7 +192,7 @@ inline vec3 reflect(const vec3& v, const vec3& n) {
     return v - 2*dot(v,n)*n;
 }
 
-inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
+inline vec3 refract(const vec3& uv, const vec3& n, real etai_over_etat) {
     auto cos_theta = fmin(dot(-uv, n), 1.0);
     vec3 r_out_perp =  etai_over_etat * (uv + cos_theta*n);
     vec3 r_out_parallel = -sqrt(fabs(1.0 - r_out_perp.length_squared())) * n;
@@ -0,0 +1,99 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "common_constants.h"
+
+#include "color.h"
+#include "hittable.h"
+#include "rng.h"
+#include "sampler.h"
+
+#include <cstdint>
+#include <vector>
+
+//The paths a wavefront render has in flight (see camera::trace_wavefront). Instead of one path followed all the way
+//to the end before the next one starts, a whole batch of paths goes through each step together: every path is
+//intersected, then every hit is shaded, then the dead paths are squeezed out, and round again for the next bounce.
+//
+//Struct of arrays: one array per field, so a stage only streams through the fields it actually uses (intersect
+//never touches throughput, compaction never touches a hit_record).
+struct wavefront_queue {
+    std::vector<real> ox, oy, oz;   // Ray origins.
+    std::vector<real> dx, dy, dz;   // Ray directions.
+    std::vector<real> tr, tg, tb;   // Throughput so far.
+    std::vector<real> pdf;          // Of the bounce that sent the ray off, for weighting any light it hits.
+    std::vector<pcg32> rng;         // Each path's own random numbers, so it draws the same ones it would alone.
+    std::vector<sampler> samplers;  // And its own sampler, for the samplers that aren't just rng.
+    std::vector<uint32_t> slot;     // Where the path's color goes when it ends.
+
+    //Scratch for one bounce. Not compacted, just overwritten.
+    std::vector<hit_record> hits;   // What intersect found, for shade.
+    std::vector<uint8_t> alive;     // Cleared when a path ends during this bounce.
+    std::vector<uint32_t> batches;  // Live path indices, grouped by material kind.
+
+    size_t size() const { return slot.size(); }
+
+    void clear() {
+        for (auto* v : {&ox, &oy, &oz, &dx, &dy, &dz, &tr, &tg, &tb, &pdf})
+            v->clear();
+        rng.clear();
+        samplers.clear();
+        slot.clear();
+    }
+
+    void push(const ray& r, const pcg32& g, const sampler& numbers, uint32_t where) {
+        ox.push_back(r.origin().x());    oy.push_back(r.origin().y());    oz.push_back(r.origin().z());
+        dx.push_back(r.direction().x()); dy.push_back(r.direction().y()); dz.push_back(r.direction().z());
+        tr.push_back(1);
+        tg.push_back(1);
+        tb.push_back(1);
+        pdf.push_back(0);
+        rng.push_back(g);
+        samplers.push_back(numbers);
+        slot.push_back(where);
+    }
+
+    ray get_ray(size_t k) const {
+        return ray(point3(ox[k], oy[k], oz[k]), vec3(dx[k], dy[k], dz[k]));
+    }
+
+    void set_ray(size_t k, const ray& r) {
+        ox[k] = r.origin().x();    oy[k] = r.origin().y();    oz[k] = r.origin().z();
+        dx[k] = r.direction().x(); dy[k] = r.direction().y(); dz[k] = r.direction().z();
+    }
+
+    color throughput(size_t k) const { return color(tr[k], tg[k], tb[k]); }
+
+    void set_throughput(size_t k, const color& c) {
+        tr[k] = c.x();
+        tg[k] = c.y();
+        tb[k] = c.z();
+    }
+
+    //Drop every path whose alive flag is 0, keeping the rest in order.
+    void compact() {
+        size_t n = size();
+        size_t kept = 0;
+        for (size_t k = 0; k < n; k++) {
+            if (!alive[k])
+                continue;
+            if (kept != k) {
+                ox[kept] = ox[k]; oy[kept] = oy[k]; oz[kept] = oz[k];
+                dx[kept] = dx[k]; dy[kept] = dy[k]; dz[kept] = dz[k];
+                tr[kept] = tr[k]; tg[kept] = tg[k]; tb[kept] = tb[k];
+                pdf[kept] = pdf[k];
+                rng[kept] = rng[k];
+                samplers[kept] = samplers[k];
+                slot[kept] = slot[k];
+            }
+            kept++;
+        }
+        for (auto* v : {&ox, &oy, &oz, &dx, &dy, &dz, &tr, &tg, &tb, &pdf})
+            v->resize(kept);
+        rng.resize(kept);
+        samplers.resize(kept);
+        slot.resize(kept);
+    }
+};
+
+#endif //WAVEFRONT_H